@@ -29,6 +29,11 @@
 #include <assert.h>
 #include <fstream>
 #include <sstream>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "MurmurHash3.h"
 #include "Common.h"
@@ -48,7 +53,67 @@ struct Decision {
 class DecisionMap {
   private:
     UUIDHashMap<Decision> decision_map;
+    // binary decision table mapped from the solver output, if there is one
+    void *mapped = nullptr;
+    size_t mapped_size = 0;
+    const DecisionTableEntry *table = nullptr;
+    uint64_t table_size = 0;
+
+    Decision lookup(const UUID &uuid) {
+        Decision decision;
+        decision.decision = CostSite::INVALID;
+        if (table != nullptr) {
+            const DecisionTableEntry *entry = FindDecisionTableEntry(table, table_size, uuid);
+            if (entry != nullptr) {
+                decision.decision = (CostSite)entry->decision;
+                decision.bblid = entry->bblid;
+                decision.difference = entry->difference;
+                decision.parallel = entry->parallelism;
+            }
+            return decision;
+        }
+        auto it = decision_map.find(uuid);
+        if (it != decision_map.end()) {
+            decision = it->second;
+        }
+        return decision;
+    }
+
+    bool mapDecisionTable(const char *in)
+    {
+        int fd = open(in, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(DecisionTableHeader)) {
+            close(fd);
+            return false;
+        }
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) return false;
+
+        const DecisionTableHeader *header = (const DecisionTableHeader *)addr;
+        if (memcmp(header->magic, DecisionTableMagic, sizeof(header->magic)) != 0
+            || header->version != DecisionTableVersion
+            || header->entry_size != sizeof(DecisionTableEntry)
+            || header->count != (st.st_size - sizeof(DecisionTableHeader)) / sizeof(DecisionTableEntry)) {
+            munmap(addr, st.st_size);
+            return false;
+        }
+        mapped = addr;
+        mapped_size = st.st_size;
+        table = (const DecisionTableEntry *)(header + 1);
+        table_size = header->count;
+        return true;
+    }
+
   public:
+    ~DecisionMap() {
+        if (mapped != nullptr) {
+            munmap(mapped, mapped_size);
+        }
+    }
+
     Decision getBasicBlockDecision(Module &M, BasicBlock &BB) {
         Decision decision;
         decision.decision = CostSite::INVALID;
@@ -68,12 +133,7 @@ class DecisionMap {
         // errs() << "Hash = " << bblhash[1] << " " << bblhash[0] << "\n";
 
         UUID uuid(bblhash[1], bblhash[0]);
-        if (decision_map.find(uuid) == decision_map.end()) {
-        }
-        else {
-            // std::cerr << "found same function." << std::endl;
-            decision = decision_map[uuid];
-        }
+        decision = lookup(uuid);
 
         return decision;
 
@@ -90,11 +150,19 @@ class DecisionMap {
     }
 
     Decision getMainDecision() {
-        return decision_map[UUID(MAIN_BBLID, MAIN_BBLID)];
+        // main defaults to CPU if the solver did not see it
+        Decision decision = lookup(MAIN_BBLHASH);
+        if (decision.decision == CostSite::INVALID) {
+            decision.decision = CostSite::CPU;
+        }
+        return decision;
     }
 
     void initDecisionMap(const char *in)
     {
+        // a binary decision table (Solver.exe --decision-table) needs no parsing
+        if (mapDecisionTable(in)) return;
+
         std::ifstream ifs(in, std::ifstream::in);
         /********************************************************
          * Parser for PIMProf output file
@@ -0,0 +1,213 @@
+//===- BatchDriver.cpp - Solve many workloads in one process ----*- C++ -*-===//
+//
+//
+//===----------------------------------------------------------------------===//
+//
+//
+//===----------------------------------------------------------------------===//
+#include <sstream>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "BatchDriver.h"
+#include "CostSolver.h"
+#include "ThreadPool.h"
+
+using namespace PIMProf;
+
+// the parsed profile takes roughly this many times the size of its text form
+static const uint64_t MemoryPerInputByte = 4;
+
+/* ===================================================================== */
+/* BatchDriver */
+/* ===================================================================== */
+
+void BatchDriver::initialize(CommandLineParser *parser)
+{
+    _command_line_parser = parser;
+    std::ifstream manifest(_command_line_parser->manifestFile());
+    if (!manifest.is_open()) {
+        errormsg("Unable to open manifest ``%s''", _command_line_parser->manifestFile().c_str());
+        exit(1);
+    }
+    ParseManifest(manifest);
+}
+
+void BatchDriver::ParseManifest(std::istream &ifs)
+{
+    std::string line;
+    int lineno = 0;
+    while (std::getline(ifs, line)) {
+        lineno++;
+        std::stringstream ss(line);
+        std::vector<std::string> args;
+        std::string token;
+        while (ss >> token) {
+            args.push_back(token);
+        }
+        if (args.empty() || args[0][0] == '#') continue;
+        if (args.size() < 2 || args[1] == "batch") {
+            errormsg("Manifest line %d: expect <name> <mode> <options>", lineno);
+            exit(1);
+        }
+
+        Job job;
+        job.name = args[0];
+        args[0] = "Solver.exe";
+        std::vector<char *> argv;
+        for (auto &arg : args) {
+            argv.push_back(&arg[0]);
+        }
+        argv.push_back(nullptr);
+        // getopt keeps its state in globals, so jobs are parsed one by one here
+        optind = 1;
+        if (!job.parser.initialize(args.size(), argv.data(), false)) {
+            job.error = "invalid options";
+            errormsg("Manifest line %d: invalid options for job %s", lineno, job.name.c_str());
+            _jobs.push_back(job);
+            continue;
+        }
+
+        std::string inputs[] = {
+            job.parser.cpustatsfile(), job.parser.pimstatsfile(), job.parser.reusefile(),
+            job.parser.decisionFile(), job.parser.scaDecisionFile(),
+            job.parser.cpucontextfile(), job.parser.pimcontextfile()
+        };
+        for (auto &input : inputs) {
+            struct stat st;
+            if (input == "") continue;
+            if (stat(input.c_str(), &st) == 0 && access(input.c_str(), R_OK) == 0) {
+                job.input_size += st.st_size;
+            }
+            else if (job.error == "") {
+                job.error = "unable to read " + input;
+                errormsg("Manifest line %d: unable to read ``%s'' for job %s", lineno, input.c_str(), job.name.c_str());
+            }
+        }
+        job.memory = job.input_size * MemoryPerInputByte;
+        _jobs.push_back(job);
+    }
+}
+
+int BatchDriver::Run()
+{
+    // largest input first, so that the long jobs do not end up last
+    std::vector<size_t> order(_jobs.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {
+        return _jobs[lhs].input_size > _jobs[rhs].input_size;
+    });
+
+    MemoryBudget budget(_command_line_parser->memoryBudget());
+    {
+        ThreadPool pool(_command_line_parser->threads());
+        infomsg("Run %lu jobs on %d threads", _jobs.size(), pool.size());
+        for (size_t i : order) {
+            Job &job = _jobs[i];
+            if (job.error != "") continue;
+            pool.Submit([this, &job, &budget]() {
+                budget.Acquire(job.memory);
+                RunJob(job);
+                budget.Release(job.memory);
+            });
+        }
+        pool.Wait();
+    }
+
+    std::ofstream ofs(_command_line_parser->outputfile());
+    PrintSummary(ofs);
+
+    int failed = 0;
+    for (auto &job : _jobs) {
+        if (!job.success) failed++;
+    }
+    infomsg("%lu jobs finished, %d failed", _jobs.size(), failed);
+    return failed;
+}
+
+void BatchDriver::RunJob(Job &job)
+{
+    infomsg("Start job %s", job.name.c_str());
+    auto start = std::chrono::steady_clock::now();
+
+    std::stringstream report;
+    {
+        CostSolver solver;
+        if (!solver.initialize(&job.parser)) {
+            job.error = "unable to read the inputs";
+            job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            warningmsg("Job %s failed, %s", job.name.c_str(), job.error.c_str());
+            return;
+        }
+        solver.PrintSolution(report);
+    }
+    job.success = true;
+    if (job.parser.outputfile() != "") {
+        std::ofstream ofs(job.parser.outputfile());
+        ofs << report.str();
+        ofs.close();
+        job.success = ofs.good();
+    }
+    if (!job.success) {
+        warningmsg("Unable to write ``%s'' for job %s", job.parser.outputfile().c_str(), job.name.c_str());
+    }
+    ParseReport(report, job.results);
+
+    job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    infomsg("Finish job %s in %.3f s", job.name.c_str(), job.seconds);
+}
+
+void BatchDriver::ParseReport(std::istream &ifs, std::vector<Result> &results)
+{
+    // the same lines util/csvdecision.py picks from a single run, e.g.
+    // CPU only time (ns): 2.64636e+06
+    // Greedy offloading time (ns): 6.79129e+07 = CPU 1.9627e+06 + PIM 459741 + REUSE 4.63753e+07 + SWITCH 1.91152e+07
+    std::string line;
+    while (std::getline(ifs, line)) {
+        std::stringstream ss(line);
+        std::vector<std::string> words;
+        std::string word;
+        while (ss >> word) {
+            words.push_back(word);
+        }
+        if (words.size() == 5 && words[1] == "only" && words[3] == "(ns):") {
+            Result result;
+            result.method = words[0] + "-only";
+            result.total = words[4];
+            (words[0] == "CPU" ? result.cpu : result.pim) = words[4];
+            results.push_back(result);
+        }
+        else if (words.size() == 17 && words[1] == "offloading" && words[3] == "(ns):"
+            && words[5] == "=" && words[6] == "CPU" && words[9] == "PIM"
+            && words[12] == "REUSE" && words[15] == "SWITCH") {
+            Result result;
+            result.method = words[0];
+            result.total = words[4];
+            result.cpu = words[7];
+            result.pim = words[10];
+            result.reuse = words[13];
+            result.swtch = words[16];
+            results.push_back(result);
+        }
+    }
+}
+
+void BatchDriver::PrintSummary(std::ostream &ofs)
+{
+    ofs << "workload,method,status,seconds,total,cpu,pim,reuse,switch" << std::endl;
+    for (auto &job : _jobs) {
+        std::string status = job.success ? "ok" : "failed";
+        if (job.results.empty()) {
+            ofs << job.name << ",," << status << "," << job.seconds << ",,,,," << std::endl;
+        }
+        for (auto &result : job.results) {
+            ofs << job.name << "," << result.method << "," << status << "," << job.seconds << ","
+                << result.total << "," << result.cpu << "," << result.pim << ","
+                << result.reuse << "," << result.swtch << std::endl;
+        }
+    }
+}
@@ -0,0 +1,100 @@
+//===- BatchDriver.h - Solve many workloads in one process ------*- C++ -*-===//
+//
+//
+//===----------------------------------------------------------------------===//
+//
+//
+//===----------------------------------------------------------------------===//
+#ifndef __BATCHDRIVER_H__
+#define __BATCHDRIVER_H__
+
+#include <vector>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+
+#include "Common.h"
+#include "Util.h"
+
+namespace PIMProf {
+
+/* ===================================================================== */
+/* MemoryBudget */
+/* ===================================================================== */
+/// Counting semaphore over bytes. A request larger than the whole budget is
+/// granted once nothing else holds memory, so an oversized job runs alone
+/// instead of deadlocking.
+class MemoryBudget {
+  private:
+    std::mutex _lock;
+    std::condition_variable _released;
+    uint64_t _limit;
+    uint64_t _used = 0;
+
+  public:
+    MemoryBudget(uint64_t limit) : _limit(limit) {}
+
+    void Acquire(uint64_t bytes)
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        _released.wait(guard, [&]() { return _used == 0 || _used + bytes <= _limit; });
+        _used += bytes;
+    }
+
+    void Release(uint64_t bytes)
+    {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _used -= bytes;
+        }
+        _released.notify_all();
+    }
+};
+
+/* ===================================================================== */
+/* BatchDriver */
+/* ===================================================================== */
+/// Each manifest line is a job: a name followed by the arguments of a
+/// single solver run, e.g.
+///     bfs reuse -c cpu/bfs.out -p pim/bfs.out -r reuse/bfs.out -t cts/bfs.out -s sca/bfs.out -o bfs.txt
+/// Empty lines and lines starting with # are ignored. A job with bad
+/// options or an input that can not be read fails on its own, and is
+/// reported as failed in the summary while the other jobs run.
+class BatchDriver {
+  private:
+    // one row of the summary, times are in nanoseconds
+    struct Result {
+        std::string method;
+        std::string total, cpu, pim, reuse, swtch;
+    };
+
+    struct Job {
+        std::string name;
+        CommandLineParser parser;
+        uint64_t input_size = 0;
+        uint64_t memory = 0;
+        bool success = false;
+        std::string error; // why the job can not run, empty if it can
+        double seconds = 0;
+        std::vector<Result> results;
+    };
+
+    CommandLineParser *_command_line_parser;
+    std::vector<Job> _jobs;
+
+  public:
+    void initialize(CommandLineParser *parser);
+
+    /// returns the number of failed jobs
+    int Run();
+
+  private:
+    void ParseManifest(std::istream &ifs);
+    void RunJob(Job &job);
+    void ParseReport(std::istream &ifs, std::vector<Result> &results);
+    void PrintSummary(std::ostream &ofs);
+};
+
+} // namespace PIMProf
+
+#endif // __BATCHDRIVER_H__
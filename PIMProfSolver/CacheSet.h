@@ -0,0 +1,282 @@
+//===- CacheSet.h - Cache sets and replacement policies ---------*- C++ -*-===//
+//
+//
+//===----------------------------------------------------------------------===//
+//
+//
+//===----------------------------------------------------------------------===//
+#ifndef __CACHESET_H__
+#define __CACHESET_H__
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) && !defined(PIMPROF_SCALAR_TAGS)
+#include <immintrin.h>
+#endif
+
+namespace PIMProf {
+
+static const uint32_t MAX_ASSOCIATIVITY = 32;
+
+/* ===================================================================== */
+/* Tag lookup */
+/* ===================================================================== */
+/// Tags are compared TAG_VECTOR at a time: with AVX2 four 64-bit tags per
+/// compare, with SSE2 two, otherwise one by one (also with
+/// -DPIMPROF_SCALAR_TAGS). The tags of a set are padded with EMPTY_TAG up
+/// to a multiple of TAG_VECTOR, which no address ever matches.
+#if defined(__AVX2__) && !defined(PIMPROF_SCALAR_TAGS)
+static const uint32_t TAG_VECTOR = 4;
+#elif defined(__SSE2__) && !defined(PIMPROF_SCALAR_TAGS)
+static const uint32_t TAG_VECTOR = 2;
+#else
+static const uint32_t TAG_VECTOR = 1;
+#endif
+static const uint64_t EMPTY_TAG = ~0ULL;
+
+/// the number of tags a set takes, a direct mapped set is not padded
+static inline uint32_t TagStride(uint32_t associativity)
+{
+    return associativity == 1 ? 1 : (associativity + TAG_VECTOR - 1) & ~(TAG_VECTOR - 1);
+}
+
+/// @return a mask whose lowest set bit is the first of the n = TagStride(...)
+/// tags that equals tagaddr, 0 if there is none
+static inline uint32_t MatchTags(const uint64_t *tags, uint32_t n, uint64_t tagaddr)
+{
+    uint32_t mask = 0;
+#if defined(__AVX2__) && !defined(PIMPROF_SCALAR_TAGS)
+    if (n == 1) return tags[0] == tagaddr;
+    const __m256i key = _mm256_set1_epi64x(tagaddr);
+    for (uint32_t i = 0; i < n; i += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(tags + i)), key);
+        mask |= (uint32_t)_mm256_movemask_pd(_mm256_castsi256_pd(eq)) << i;
+    }
+#elif defined(__SSE2__) && !defined(PIMPROF_SCALAR_TAGS)
+    if (n == 1) return tags[0] == tagaddr;
+    const __m128i key = _mm_set1_epi64x(tagaddr);
+    for (uint32_t i = 0; i < n; i += 2) {
+        // SSE2 has no 64-bit compare, both 32-bit halves have to match
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(tags + i)), key);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        mask |= (uint32_t)_mm_movemask_pd(_mm_castsi128_pd(eq)) << i;
+    }
+#else
+    for (uint32_t i = 0; i < n; i++) {
+        if (tags[i] == tagaddr) return 1u << i;
+    }
+#endif
+    return mask;
+}
+
+/* ===================================================================== */
+/* Replacement policies */
+/* ===================================================================== */
+/// A policy keeps StateSize(associativity) STATE words per set, for the
+/// associativities it Supports, and tells
+/// CACHE_SETS which way to fill next (Victim) and how a hit or a fill on
+/// a way changes the state of the set (Touch). Everything is static and
+/// inline, so the tag lookup and the update compile into the access path
+/// of the cache level.
+
+class DIRECT_MAPPED
+{
+  public:
+    typedef uint8_t STATE;
+    static inline bool Supports(uint32_t associativity) { return associativity == 1; }
+    static inline uint32_t StateSize(uint32_t) { return 0; }
+    static inline void Reset(STATE *, uint32_t) {}
+    static inline uint32_t Victim(STATE *, uint32_t) { return 0; }
+    static inline void Touch(STATE *, uint32_t, uint32_t) {}
+};
+
+/// @brief Replace the ways from the last to the first and then start over
+class ROUND_ROBIN
+{
+  public:
+    typedef uint8_t STATE;
+    static inline bool Supports(uint32_t) { return true; }
+    static inline uint32_t StateSize(uint32_t) { return 1; }
+    static inline void Reset(STATE *state, uint32_t associativity) { *state = associativity - 1; }
+    static inline uint32_t Victim(STATE *state, uint32_t associativity)
+    {
+        const uint32_t index = *state;
+        *state = index - 1 + (index == 0) * associativity;
+        return index;
+    }
+    static inline void Touch(STATE *, uint32_t, uint32_t) {}
+};
+
+/// @brief True LRU with one age counter per way,
+/// 0 is the most and associativity - 1 the least recently used way.
+/// With SSE2 the counters of a set are padded to 16 bytes with AGE_PAD,
+/// which is never younger than a way and never the oldest, and the
+/// counters are updated 16 at a time.
+class LRU
+{
+  public:
+    typedef uint8_t STATE;
+    static const STATE AGE_PAD = 0x7f;
+    static inline bool Supports(uint32_t) { return true; }
+#if defined(__SSE2__) && !defined(PIMPROF_SCALAR_TAGS)
+    static inline uint32_t StateSize(uint32_t associativity) { return (associativity + 15) & ~15; }
+#else
+    static inline uint32_t StateSize(uint32_t associativity) { return associativity; }
+#endif
+    static inline void Reset(STATE *age, uint32_t associativity)
+    {
+        for (uint32_t i = 0; i < StateSize(associativity); i++) {
+            age[i] = (i < associativity ? i : AGE_PAD);
+        }
+    }
+    static inline uint32_t Victim(STATE *age, uint32_t associativity)
+    {
+#if defined(__SSE2__) && !defined(PIMPROF_SCALAR_TAGS)
+        const __m128i oldest = _mm_set1_epi8(associativity - 1);
+        uint32_t mask = 0;
+        for (uint32_t i = 0; i < StateSize(associativity); i += 16) {
+            __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(age + i)), oldest);
+            mask |= (uint32_t)_mm_movemask_epi8(eq) << i;
+        }
+        return __builtin_ctz(mask);
+#else
+        uint32_t way = 0;
+        for (uint32_t i = 0; i < associativity; i++) {
+            way |= i & -(uint32_t)(age[i] == associativity - 1);
+        }
+        return way;
+#endif
+    }
+    /// every way younger than the touched one gets one older
+    static inline void Touch(STATE *age, uint32_t associativity, uint32_t way)
+    {
+#if defined(__SSE2__) && !defined(PIMPROF_SCALAR_TAGS)
+        const __m128i current = _mm_set1_epi8(age[way]);
+        for (uint32_t i = 0; i < StateSize(associativity); i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(age + i));
+            // the compare gives -1 for the younger ways
+            v = _mm_sub_epi8(v, _mm_cmpgt_epi8(current, v));
+            _mm_storeu_si128((__m128i *)(age + i), v);
+        }
+#else
+        const STATE current = age[way];
+        for (uint32_t i = 0; i < associativity; i++) {
+            age[i] += (age[i] < current);
+        }
+#endif
+        age[way] = 0;
+    }
+};
+
+/// @brief Tree pseudo-LRU: associativity - 1 bits in a heap, bit n tells
+/// which half under node n to fill next (1 for the right one).
+/// Associativity has to be a power of 2.
+class PLRU
+{
+  public:
+    typedef uint32_t STATE;
+    static inline bool Supports(uint32_t associativity) { return (associativity & (associativity - 1)) == 0; }
+    static inline uint32_t StateSize(uint32_t) { return 1; }
+    static inline void Reset(STATE *tree, uint32_t) { *tree = 0; }
+    static inline uint32_t Victim(STATE *tree, uint32_t associativity)
+    {
+        uint32_t node = 1, way = 0;
+        for (uint32_t half = associativity >> 1; half > 0; half >>= 1) {
+            const uint32_t right = (*tree >> node) & 1;
+            way |= half & -right;
+            node = 2 * node + right;
+        }
+        return way;
+    }
+    /// point every node on the path to way at the other half
+    static inline void Touch(STATE *tree, uint32_t associativity, uint32_t way)
+    {
+        uint32_t node = 1;
+        for (uint32_t half = associativity >> 1; half > 0; half >>= 1) {
+            const uint32_t right = (way & half) != 0;
+            *tree = (*tree & ~(1u << node)) | ((right ^ 1) << node);
+            node = 2 * node + right;
+        }
+    }
+};
+
+/* ===================================================================== */
+/* CACHE_SETS */
+/* ===================================================================== */
+/// All sets of a cache level: the tags of set s are
+/// _tags[s * stride ... s * stride + associativity - 1], stride being
+/// TagStride(associativity), and its policy state sits in a separate array
+/// in the same order. A tag of 0 is an empty way, as it has always been here.
+template <class POLICY>
+class CACHE_SETS
+{
+  public:
+    typedef typename POLICY::STATE STATE;
+
+  private:
+    const uint32_t _associativity;
+    const uint32_t _stride;
+    const uint32_t _stateSize;
+    std::vector<uint64_t> _tags;
+    std::vector<STATE> _state;
+
+  public:
+    CACHE_SETS(uint32_t numSets, uint32_t associativity)
+      : _associativity(associativity),
+        _stride(TagStride(associativity)),
+        _stateSize(POLICY::StateSize(associativity)),
+        _tags((size_t)numSets * _stride),
+        _state((size_t)numSets * _stateSize)
+    {
+        assert(associativity > 0 && associativity <= MAX_ASSOCIATIVITY);
+        assert(POLICY::Supports(associativity));
+        Flush();
+    }
+
+    inline uint32_t NumSets() const { return _tags.size() / _stride; }
+    inline uint32_t Associativity() const { return _associativity; }
+    inline size_t MemoryUsage() const { return _tags.size() * sizeof(uint64_t) + _state.size() * sizeof(STATE); }
+
+    /// @return the way that holds tagaddr in set, or -1
+    inline int32_t FindWay(uint32_t set, uint64_t tagaddr) const
+    {
+        uint32_t mask = MatchTags(&_tags[(size_t)set * _stride], _stride, tagaddr);
+        return mask ? __builtin_ctz(mask) : -1;
+    }
+
+    /// @return true on a hit, which counts as a use for the policy
+    inline bool Find(uint32_t set, uint64_t tagaddr)
+    {
+        int32_t way = FindWay(set, tagaddr);
+        if (way < 0) return false;
+        POLICY::Touch(State(set), _associativity, way);
+        return true;
+    }
+
+    inline void Replace(uint32_t set, uint64_t tagaddr)
+    {
+        STATE *state = State(set);
+        uint32_t way = POLICY::Victim(state, _associativity);
+        _tags[(size_t)set * _stride + way] = tagaddr;
+        POLICY::Touch(state, _associativity, way);
+    }
+
+    void Flush()
+    {
+        for (size_t i = 0; i < _tags.size(); i++) {
+            _tags[i] = (i % _stride < _associativity ? 0 : EMPTY_TAG);
+        }
+        for (uint32_t set = 0; set < NumSets(); set++) {
+            POLICY::Reset(State(set), _associativity);
+        }
+    }
+
+  private:
+    inline STATE *State(uint32_t set) { return _state.data() + (size_t)set * _stateSize; }
+};
+
+} // namespace PIMProf
+
+#endif // __CACHESET_H__
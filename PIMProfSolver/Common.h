@@ -8,10 +8,12 @@
 #ifndef __COMMON_H__
 #define __COMMON_H__
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <map>
 #include <unordered_map>
+#include <algorithm>
 
 namespace PIMProf {
 /* ===================================================================== */
@@ -163,6 +165,40 @@ const BBLID MAIN_BBLID = 1;
 const BBLID TSJ_BBLID = 1;
 const UUID MAIN_BBLHASH(MAIN_BBLID, MAIN_BBLID);
 
+/* ===================================================================== */
+/* Binary decision table */
+/* ===================================================================== */
+/// Written by the solver with --decision-table and mapped by OffloaderInjection.
+/// Entries are sorted by bblhash, so a lookup is a binary search directly
+/// on the mapped file and nothing has to be parsed.
+const char DecisionTableMagic[8] = {'P', 'I', 'M', 'P', 'D', 'T', 'B', 'L'};
+const uint32_t DecisionTableVersion = 1;
+
+struct DecisionTableHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t count;
+};
+
+struct DecisionTableEntry {
+    uint64_t hi, lo;
+    int64_t bblid;
+    COST difference;
+    int32_t decision;
+    int32_t parallelism;
+};
+
+inline const DecisionTableEntry *FindDecisionTableEntry(
+    const DecisionTableEntry *begin, uint64_t count, const UUID &bblhash)
+{
+    const DecisionTableEntry *end = begin + count;
+    const DecisionTableEntry *it = std::lower_bound(begin, end, bblhash,
+        [](const DecisionTableEntry &entry, const UUID &key) { return UUID(entry.hi, entry.lo) < key; });
+    if (it != end && it->hi == bblhash.first && it->lo == bblhash.second) return it;
+    return nullptr;
+}
+
 } // namespace PIMProf
 
 #endif // __COMMON_H__
\ No newline at end of file
@@ -8,6 +8,7 @@
 
 #include <cfloat>
 #include <climits>
+#include <tuple>
 
 #include "Common.h"
 #include "CostSolver.h"
@@ -35,31 +36,9 @@ using namespace PIMProf;
 
 // }
 
-void CostSolver::initialize(CommandLineParser *parser)
+bool CostSolver::initialize(CommandLineParser *parser)
 {
     _command_line_parser = parser;
-    _batch_threshold = 0;
-    _batch_size = 0;
-
-    std::ifstream scaDecision(_command_line_parser->scaDecisionFile());
-    std::ifstream decision(_command_line_parser->decisionFile());
-    std::ifstream cpustats(_command_line_parser->cpustatsfile());
-    std::ifstream pimstats(_command_line_parser->pimstatsfile());
-    std::ifstream reuse(_command_line_parser->reusefile());
-    assert(cpustats.is_open());
-    assert(pimstats.is_open());
-    assert(reuse.is_open());
-    ParseDecision(decision);
-    ParseSCADecision(scaDecision);
-    ParseStats(cpustats, _bbl_hash2stats[CPU]);
-    ParseStats(pimstats, _bbl_hash2stats[PIM]);
-    ParseReuse(reuse, _bbl_data_reuse, _bbl_switch_count);
-
-    // Convert BBLStats to FuncStats
-    // BBL2Func(_bbl_hash2stats[CPU], _func_hash2stats[CPU]);
-    // BBL2Func(_bbl_hash2stats[PIM], _func_hash2stats[PIM]);
-    // BBL2Func(_bbl_data_reuse, _func_data_reuse);
-    // BBL2Func(_bbl_switch_count, _func_switch_count);
 
     // temporarily define flush and fetch cost here
     _flush_cost[CostSite::CPU] = 60;
@@ -73,6 +52,125 @@ void CostSolver::initialize(CommandLineParser *parser)
     _parallelism_threshold = 15;
     _batch_threshold = 0.001;
     _batch_size = 10;
+
+    std::string loadsnapshot = _command_line_parser->loadSnapshotFile();
+    std::string savesnapshot = _command_line_parser->saveSnapshotFile();
+    _result_cache.initialize(_command_line_parser->cacheDir(), _command_line_parser->cacheSize());
+    if (loadsnapshot != "" || savesnapshot != "" || _result_cache.enabled()) {
+        _input_hash[INPUT_CPUSTATS] = HashFile(_command_line_parser->cpustatsfile());
+        _input_hash[INPUT_PIMSTATS] = HashFile(_command_line_parser->pimstatsfile());
+        _input_hash[INPUT_REUSE] = HashFile(_command_line_parser->reusefile());
+        _input_hash[INPUT_CTS] = HashFile(_command_line_parser->decisionFile());
+        _input_hash[INPUT_SCA] = HashFile(_command_line_parser->scaDecisionFile());
+        _context_hash[CPU] = HashFile(_command_line_parser->cpucontextfile());
+        _context_hash[PIM] = HashFile(_command_line_parser->pimcontextfile());
+    }
+
+    _cache_hit = false;
+    if (_result_cache.enabled()) {
+        _fingerprint = ResultCache::Fingerprint(RunDescription());
+        _cache_hit = _result_cache.Lookup(_fingerprint, _solution);
+        if (_cache_hit) {
+            infomsg("Result cache hit, inputs are not parsed");
+            return true;
+        }
+    }
+
+    if (loadsnapshot == "" || !LoadSnapshot(loadsnapshot)) {
+        std::ifstream scaDecision(_command_line_parser->scaDecisionFile());
+        std::ifstream decision(_command_line_parser->decisionFile());
+        std::ifstream cpustats(_command_line_parser->cpustatsfile());
+        std::ifstream pimstats(_command_line_parser->pimstatsfile());
+        std::ifstream reuse(_command_line_parser->reusefile());
+        // a missing decision or reuse file is only fine if none was named
+        std::pair<std::string, bool> inputs[5] = {
+            {_command_line_parser->cpustatsfile(), cpustats.is_open()},
+            {_command_line_parser->pimstatsfile(), pimstats.is_open()},
+            {_command_line_parser->reusefile(), reuse.is_open() || _command_line_parser->reusefile() == ""},
+            {_command_line_parser->decisionFile(), decision.is_open() || _command_line_parser->decisionFile() == ""},
+            {_command_line_parser->scaDecisionFile(), scaDecision.is_open() || _command_line_parser->scaDecisionFile() == ""},
+        };
+        for (auto &input : inputs) {
+            if (!input.second) {
+                errormsg("Unable to open ``%s''", input.first.c_str());
+                return false;
+            }
+        }
+        ParseDecision(decision);
+        ParseSCADecision(scaDecision);
+        ParseStats(cpustats, CPU);
+        ParseStats(pimstats, PIM);
+        if (!_stream_bblhash.empty()) {
+            AssignStreamBBLID();
+        }
+        ParseReuse(reuse, _bbl_data_reuse, _bbl_switch_count);
+        if (_bbl_data_reuse.getResidualSegments() > 0) {
+            infomsg("%lu segment occurrences with total count %lu were below the admission threshold of the profiler, they are not part of the reuse cost",
+                _bbl_data_reuse.getResidualSegments(), _bbl_data_reuse.getResidualCount());
+        }
+        if (_bbl_data_reuse.getSampleRate() < 1) {
+            infomsg("Reuse segments were sampled at rate %g, their counts are scaled by %g",
+                _bbl_data_reuse.getSampleRate(), 1 / _bbl_data_reuse.getSampleRate());
+        }
+    }
+
+    // a snapshot of a profile with epochs would load without its phases,
+    // so such a profile is never saved and always parsed
+    if (savesnapshot != "") {
+        if (!_epochs.empty()) {
+            warningmsg("The profile has %lu epochs, which snapshots do not hold, no snapshot is saved", _epochs.size());
+        }
+        else {
+            SaveSnapshot(savesnapshot);
+        }
+    }
+
+    // calling contexts are not in snapshots, they are always parsed
+    std::string contextfile[MAX_COST_SITE] = {
+        _command_line_parser->cpucontextfile(), _command_line_parser->pimcontextfile()
+    };
+    if (contextfile[CPU] != "" || contextfile[PIM] != "") {
+        for (int i = 0; i < MAX_COST_SITE; i++) {
+            std::ifstream context(contextfile[i]);
+            if (!context.is_open()) {
+                errormsg("Calling context stats need both --cpu-context and --pim-context, unable to open ``%s''", contextfile[i].c_str());
+                return false;
+            }
+            ParseContext(context, (CostSite)i);
+        }
+    }
+
+    // Convert BBLStats to FuncStats
+    // BBL2Func(_bbl_hash2stats[CPU], _func_hash2stats[CPU]);
+    // BBL2Func(_bbl_hash2stats[PIM], _func_hash2stats[PIM]);
+    // BBL2Func(_bbl_data_reuse, _func_data_reuse);
+    // BBL2Func(_bbl_switch_count, _func_switch_count);
+    return true;
+}
+
+std::string CostSolver::RunDescription()
+{
+    // bump the version whenever the solver output changes for the same inputs
+    std::ostringstream oss;
+    oss << std::setprecision(17)
+        << "solver 3" << std::endl
+        << "mode " << _command_line_parser->mode() << std::endl
+        << "dataMoveThreshold " << _dataMoveThreshold << std::endl
+        << "flush " << _flush_cost[CPU] << " " << _flush_cost[PIM] << std::endl
+        << "fetch " << _fetch_cost[CPU] << " " << _fetch_cost[PIM] << std::endl
+        << "switch " << _switch_cost[CPU] << " " << _switch_cost[PIM] << std::endl
+        << "mpki " << _mpki_threshold << std::endl
+        << "parallelism " << _parallelism_threshold << std::endl
+        << "batch " << _batch_threshold << " " << _batch_size << std::endl
+        << "phase " << _command_line_parser->phaseDistance() << std::endl;
+    for (int i = 0; i < MAX_INPUT_FILE; i++) {
+        oss << "input " << _input_hash[i].first << " " << _input_hash[i].second << std::endl;
+    }
+    if (_command_line_parser->cpucontextfile() != "" || _command_line_parser->pimcontextfile() != "") {
+        oss << "context " << _context_hash[CPU].first << " " << _context_hash[CPU].second
+            << " " << _context_hash[PIM].first << " " << _context_hash[PIM].second << std::endl;
+    }
+    return oss.str();
 }
 
 CostSolver::~CostSolver()
@@ -81,6 +179,14 @@ CostSolver::~CostSolver()
         for (auto it : _bbl_hash2stats[i]) {
             delete it.second;
         }
+        for (auto &epoch : _epochs) {
+            for (auto it : epoch.stats[i]) {
+                delete it.second;
+            }
+        }
+        for (auto it : _context_hash2stats[i]) {
+            delete it.second;
+        }
     }
 }
 
@@ -163,18 +269,38 @@ void CostSolver::ParseSCADecision(std::istream &ifs)
     }
 }
 
-void CostSolver::ParseStats(std::istream &ifs, UUIDHashMap<ThreadRunStats *> &statsmap)
+void CostSolver::ParseStats(std::istream &ifs, CostSite site)
 {
     std::string line, token;
     int tid = 0;
+    bool isdelta = false;
+    UUIDHashMap<ThreadRunStats *> *target = &_bbl_hash2stats[site];
     while(std::getline(ifs, line)) {
         if (line.find(HORIZONTAL_LINE) != std::string::npos) { // skip next 2 lines
             std::getline(ifs, line);
             std::stringstream ss(line);
-            ss >> token >> tid;
+            ss >> token;
+            target = &_bbl_hash2stats[site];
+            isdelta = (token == "Delta");
+            if (isdelta) {
+                // example: Delta 3 Thread 0
+                int index;
+                ss >> index >> token;
+            }
+            else if (token == "Epoch") {
+                // example: Epoch 3 Thread 0
+                size_t epoch;
+                ss >> epoch >> token;
+                if (epoch >= _epochs.size()) {
+                    _epochs.resize(epoch + 1);
+                }
+                target = &_epochs[epoch].stats[site];
+            }
+            ss >> tid;
             std::getline(ifs, line);
             continue;
         }
+        UUIDHashMap<ThreadRunStats *> &statsmap = *target;
         std::stringstream ss(line);
 
         RunStats bblstats;
@@ -184,6 +310,14 @@ void CostSolver::ParseStats(std::istream &ifs, UUIDHashMap<ThreadRunStats *> &st
            >> bblstats.memory_access
            >> std::hex >> bblstats.bblhash.first >> bblstats.bblhash.second;
         assert(bblstats.elapsed_time >= 0);
+        // the 95% confidence interval, if timing was sampled
+        COST ci;
+        if (ss >> std::dec >> ci) {
+            bblstats.elapsed_time_var = (ci / 1.96) * (ci / 1.96);
+        }
+        if (isdelta && site == CPU) {
+            _stream_bblhash[std::make_pair(tid, bblstats.bblid)] = bblstats.bblhash;
+        }
         auto it = statsmap.find(bblstats.bblhash);
         if (statsmap.find(bblstats.bblhash) == statsmap.end()) {
             ThreadRunStats *p = new ThreadRunStats(tid, bblstats);
@@ -195,6 +329,52 @@ void CostSolver::ParseStats(std::istream &ifs, UUIDHashMap<ThreadRunStats *> &st
     }
 }
 
+void CostSolver::AssignStreamBBLID()
+{
+    std::vector<ThreadRunStats *> sorted;
+    SortStatsMap(_bbl_hash2stats[CPU], sorted);
+    for (BBLID i = 0; i < (BBLID)sorted.size(); ++i) {
+        sorted[i]->bblid = i;
+    }
+}
+
+void CostSolver::ParseContext(std::istream &ifs, CostSite site)
+{
+    std::string line, token;
+    int tid = 0;
+    while(std::getline(ifs, line)) {
+        if (line.find(HORIZONTAL_LINE) != std::string::npos) { // skip next 2 lines
+            // example: Context - Thread 0, depth 4, collapsed 0
+            std::getline(ifs, line);
+            std::stringstream ss(line);
+            ss >> token >> token >> token >> tid;
+            std::getline(ifs, line);
+            continue;
+        }
+        std::stringstream ss(line);
+
+        RunStats contextstats;
+        UUID bblhash, parent;
+        ss >> contextstats.bblid
+           >> contextstats.elapsed_time
+           >> contextstats.instruction_count
+           >> contextstats.memory_access
+           >> std::hex >> bblhash.first >> bblhash.second
+           >> contextstats.bblhash.first >> contextstats.bblhash.second
+           >> parent.first >> parent.second;
+        if (ss.fail()) continue;
+        assert(contextstats.elapsed_time >= 0);
+        _context_bblhash[contextstats.bblhash] = bblhash;
+        auto it = _context_hash2stats[site].find(contextstats.bblhash);
+        if (it == _context_hash2stats[site].end()) {
+            _context_hash2stats[site].insert(std::make_pair(contextstats.bblhash, new ThreadRunStats(tid, contextstats)));
+        }
+        else {
+            it->second->MergeStats(tid, contextstats);
+        }
+    }
+}
+
 void CostSolver::PrintStats(std::ostream &ofs)
 {
     const std::vector<ThreadRunStats *> *sorted = getBBLSortedStats();
@@ -231,35 +411,99 @@ void CostSolver::ParseReuse(std::istream &ifs, DataReuse<BBLID> &reuse, SwitchCo
 
     // we parses reuse segments and BBL switch counts at the same time
     bool isreusesegment = true; 
+    // the epoch of the switch counts, -1 for the whole run
+    int epoch = -1;
+    // the switch counts of a streamed profile come in deltas to be added up
+    bool isdelta = false;
+    std::map<std::pair<BBLID, BBLID>, uint64_t> deltaswitch;
+
+    // a streamed profile numbers BBLs per thread, see AssignStreamBBLID.
+    // A BBL missing from the CPU stats maps to -1, the segments and switch
+    // counts that refer to one are skipped and counted.
+    bool streamed = !_stream_bblhash.empty();
+    int tid = 0;
+    uint64_t unmappedsegments = 0, unmappedswitches = 0;
+    auto getBBLID = [&](BBLID id) -> BBLID {
+        if (!streamed) return id;
+        auto it = _stream_bblhash.find(std::make_pair(tid, id));
+        if (it == _stream_bblhash.end()) return -1;
+        return _bbl_hash2stats[CPU][it->second]->bblid;
+    };
     
     while(std::getline(ifs, line)) {
         if (line.find(HORIZONTAL_LINE) != std::string::npos) {
             std::getline(ifs, line);
             std::stringstream ss(line);
             ss >> token;
+            epoch = -1;
+            isdelta = false;
             if (token == "ReuseSegment") {
                 isreusesegment = true;
             }
             else if (token == "BBLSwitchCount") {
                 isreusesegment = false;
             }
+            else if (token == "ReuseDelta" || token == "SwitchDelta") {
+                // example: ReuseDelta 3 - Thread 0
+                isreusesegment = (token == "ReuseDelta");
+                isdelta = true;
+                int index;
+                ss >> index >> token >> token >> tid;
+            }
+            else if (token == "EpochSwitchCount") {
+                // example: EpochSwitchCount 3 - Thread 0
+                isreusesegment = false;
+                ss >> epoch >> token >> token >> tid;
+                assert(epoch >= 0);
+                if (epoch >= (int)_epochs.size()) {
+                    _epochs.resize(epoch + 1);
+                }
+            }
             else { assert(0); }
             continue;
         }
-        if (isreusesegment) {
+        if (isreusesegment && line.compare(0, 8, "residual") == 0) {
+            // example: residual count = 1200, segments = 35
+            std::stringstream ss(line);
+            uint64_t count, segments;
+            ss >> token >> token >> token >> count >> token >> token >> token >> segments;
+            reuse.addResidual(count, segments);
+        }
+        else if (isreusesegment && line.compare(0, 8, "sampling") == 0) {
+            // example: sampling rate = 0.01
+            std::stringstream ss(line);
+            double rate;
+            ss >> token >> token >> token >> rate;
+            if (reuse.getSampleRate() != 1 && reuse.getSampleRate() != rate) {
+                warningmsg("Reuse segments were sampled at different rates %g and %g", reuse.getSampleRate(), rate);
+            }
+            reuse.setSampleRate(std::min(reuse.getSampleRate(), rate));
+        }
+        else if (isreusesegment) {
             std::stringstream ss(line);
             BBLIDDataReuseSegment seg;
             ss >> token >> token >> token; // example: head = 208,
-            BBLID head = std::stoi(token.substr(0, token.size() - 1)); //example:  208,
+            BBLID head = getBBLID(std::stoi(token.substr(0, token.size() - 1))); //example:  208,
             int64_t count;
             ss >> token >> token >> count; //example: count = 4
             ss >> token;
             BBLID bblid;
-            BBLID prebblid = head;
+            std::vector<BBLID> bblids;
+            bool mapped = (head >= 0);
             while (ss >> bblid) {
-                seg.insert(bblid);
-                interBB_CL_DM[{std::min(bblid,prebblid),std::max(bblid,prebblid)}]+=count;
-                prebblid = bblid;
+                bblid = getBBLID(bblid);
+                mapped &= (bblid >= 0);
+                bblids.push_back(bblid);
+            }
+            if (!mapped) {
+                unmappedsegments++;
+                continue;
+            }
+            BBLID prebblid = head;
+            for (BBLID id : bblids) {
+                seg.insert(id);
+                interBB_CL_DM[{std::min(id,prebblid),std::max(id,prebblid)}]+=count;
+                prebblid = id;
             }
             seg.setHead(head);
             if (count < 0) {
@@ -273,18 +517,39 @@ void CostSolver::ParseReuse(std::istream &ifs, DataReuse<BBLID> &reuse, SwitchCo
             std::stringstream ss(line);
             BBLID fromidx;
             ss >> token >> token >> fromidx >> token;
+            fromidx = getBBLID(fromidx);
             std::vector<std::pair<BBLID, uint64_t>> toidxvec;
             while (ss >> token) {
                 size_t delim = token.find(':');
-                BBLID toidx = stoull(token.substr(0, delim));
+                BBLID toidx = getBBLID(stoull(token.substr(0, delim)));
                 uint64_t count = stoull(token.substr(delim + 1));
+                if (fromidx < 0 || toidx < 0) {
+                    unmappedswitches++;
+                    continue;
+                }
+                if (epoch >= 0) {
+                    // threads share the rows of an epoch, so add up
+                    _epochs[epoch].switchcnt[std::make_pair(fromidx, toidx)] += count;
+                    continue;
+                }
                 
                 interBB_REG_DM[{std::min(fromidx,toidx),std::max(fromidx,toidx)}]+=count;
+                if (isdelta) {
+                    deltaswitch[std::make_pair(fromidx, toidx)] += count;
+                    continue;
+                }
                 toidxvec.push_back(std::make_pair(toidx, count));
             }
-            switchcnt.RowInsert(fromidx, toidxvec);
+            if (epoch < 0 && !isdelta && fromidx >= 0) {
+                switchcnt.RowInsert(fromidx, toidxvec);
+            }
         }
     }
+    if (unmappedsegments > 0 || unmappedswitches > 0) {
+        warningmsg("%lu reuse segments and %lu switch counts refer to BBLs that are not in the CPU stats, they are skipped",
+            unmappedsegments, unmappedswitches);
+    }
+    switchcnt.RowInsert(deltaswitch);
     switchcnt.Sort();
 
     // std::ofstream ofs("graph.dot", std::ios::out);
@@ -293,20 +558,295 @@ void CostSolver::ParseReuse(std::istream &ifs, DataReuse<BBLID> &reuse, SwitchCo
     // reuse.PrintAllSegments(std::cout, [](BBLID bblid){ return bblid; });
 }
 
+/* ===================================================================== */
+/* Snapshot */
+/* ===================================================================== */
+// Layout: header, then for each site the stats columns ordered by BBLID,
+// the flattened reuse trie, the switch count list in CSR form,
+// the interBB data movement maps and the decisions read from file.
+// Every array is 8-byte aligned so that the file can be used in place after mmap.
+static const char SnapshotMagic[8] = {'P', 'I', 'M', 'P', 'S', 'N', 'A', 'P'};
+// version 2 snapshots may have been saved from a profile with epochs
+static const uint32_t SnapshotVersion = 3;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t input_count;
+    uint64_t input_hash[CostSolver::MAX_INPUT_FILE][2];
+};
+
+// interBB maps and decisions from file are stored as arrays of these
+struct SnapshotBBLPair {
+    BBLID first, second;
+    COST cost;
+};
+
+struct SnapshotDecision {
+    uint64_t hi, lo;
+    int64_t site;
+};
+
+void CostSolver::SaveSnapshot(const std::string &filename)
+{
+    const std::vector<ThreadRunStats *> *sorted = getBBLSortedStats();
+    BinaryWriter out(filename);
+    if (!out.good()) {
+        errormsg("Unable to write snapshot ``%s''", filename.c_str());
+        return;
+    }
+
+    SnapshotHeader header;
+    memcpy(header.magic, SnapshotMagic, sizeof(header.magic));
+    header.version = SnapshotVersion;
+    header.input_count = MAX_INPUT_FILE;
+    for (int i = 0; i < MAX_INPUT_FILE; i++) {
+        header.input_hash[i][0] = _input_hash[i].first;
+        header.input_hash[i][1] = _input_hash[i].second;
+    }
+    out.write(header);
+
+    for (int site = 0; site < MAX_COST_SITE; site++) {
+        std::vector<UUID> bblhash;
+        std::vector<BBLID> bblid;
+        std::vector<COST> elapsed_time, elapsed_time_var;
+        std::vector<uint64_t> instruction_count, memory_access;
+        std::vector<uint64_t> thread_offset(1, 0);
+        std::vector<COST> thread_elapsed_time;
+        for (auto stats : sorted[site]) {
+            bblhash.push_back(stats->bblhash);
+            bblid.push_back(stats->bblid);
+            elapsed_time.push_back(stats->elapsed_time);
+            instruction_count.push_back(stats->instruction_count);
+            memory_access.push_back(stats->memory_access);
+            elapsed_time_var.push_back(stats->elapsed_time_var);
+            const std::vector<COST> &elapsed = stats->ThreadElapsedTime();
+            thread_elapsed_time.insert(thread_elapsed_time.end(), elapsed.begin(), elapsed.end());
+            thread_offset.push_back(thread_elapsed_time.size());
+        }
+        out.writeArray(bblhash);
+        out.writeArray(bblid);
+        out.writeArray(elapsed_time);
+        out.writeArray(instruction_count);
+        out.writeArray(memory_access);
+        out.writeArray(elapsed_time_var);
+        out.writeArray(thread_offset);
+        out.writeArray(thread_elapsed_time);
+    }
+
+    std::vector<uint32_t> parent, leaves;
+    std::vector<BBLID> cur;
+    std::vector<uint64_t> count;
+    std::vector<uint8_t> isleaf;
+    _bbl_data_reuse.Flatten(parent, cur, count, isleaf, leaves);
+    out.writeArray(parent);
+    out.writeArray(cur);
+    out.writeArray(count);
+    out.writeArray(isleaf);
+    out.writeArray(leaves);
+
+    std::vector<uint64_t> row_offset(1, 0);
+    std::vector<std::pair<int64_t, uint64_t>> row_elems;
+    for (auto &row : _bbl_switch_count) {
+        row_elems.insert(row_elems.end(), row.begin(), row.end());
+        row_offset.push_back(row_elems.size());
+    }
+    out.writeArray(row_offset);
+    out.writeArray(row_elems);
+
+    for (auto *dm : {&interBB_CL_DM, &interBB_REG_DM}) {
+        std::vector<SnapshotBBLPair> pairs;
+        for (auto &elem : *dm) {
+            pairs.push_back({elem.first.first, elem.first.second, elem.second});
+        }
+        out.writeArray(pairs);
+    }
+
+    for (auto *decision : {&ctsDecision, &scaDecision}) {
+        std::vector<SnapshotDecision> decisions;
+        for (auto &elem : *decision) {
+            decisions.push_back({elem.first.first, elem.first.second, elem.second});
+        }
+        out.writeArray(decisions);
+    }
+
+    if (!out.good()) {
+        errormsg("Failed to write snapshot ``%s''", filename.c_str());
+    }
+    else {
+        infomsg("Snapshot saved to ``%s''", filename.c_str());
+    }
+}
+
+bool CostSolver::LoadSnapshot(const std::string &filename)
+{
+    MappedFile file(filename);
+    if (!file.is_open()) {
+        warningmsg("Unable to open snapshot ``%s'', parse input files instead", filename.c_str());
+        return false;
+    }
+    BinaryReader in(file.data(), file.size());
+
+    SnapshotHeader header = in.read<SnapshotHeader>();
+    if (in.fail() || memcmp(header.magic, SnapshotMagic, sizeof(header.magic)) != 0
+        || header.version != SnapshotVersion || header.input_count != MAX_INPUT_FILE) {
+        warningmsg("``%s'' is not a valid snapshot, parse input files instead", filename.c_str());
+        return false;
+    }
+    for (int i = 0; i < MAX_INPUT_FILE; i++) {
+        if (UUID(header.input_hash[i][0], header.input_hash[i][1]) != _input_hash[i]) {
+            warningmsg("Snapshot ``%s'' does not match the input files, parse input files instead", filename.c_str());
+            return false;
+        }
+    }
+
+    // read everything before touching the solver state so that a truncated
+    // snapshot leaves the solver untouched
+    struct StatsColumns {
+        uint64_t size[8];
+        const UUID *bblhash;
+        const BBLID *bblid;
+        const COST *elapsed_time;
+        const uint64_t *instruction_count;
+        const uint64_t *memory_access;
+        const COST *elapsed_time_var;
+        const uint64_t *thread_offset;
+        const COST *thread_elapsed_time;
+    } columns[MAX_COST_SITE];
+    bool valid = true;
+    for (int site = 0; site < MAX_COST_SITE; site++) {
+        StatsColumns &c = columns[site];
+        c.bblhash = in.readArray<UUID>(c.size[0]);
+        c.bblid = in.readArray<BBLID>(c.size[1]);
+        c.elapsed_time = in.readArray<COST>(c.size[2]);
+        c.instruction_count = in.readArray<uint64_t>(c.size[3]);
+        c.memory_access = in.readArray<uint64_t>(c.size[4]);
+        c.elapsed_time_var = in.readArray<COST>(c.size[5]);
+        c.thread_offset = in.readArray<uint64_t>(c.size[6]);
+        c.thread_elapsed_time = in.readArray<COST>(c.size[7]);
+        for (int i = 1; i < 6; i++) {
+            valid &= (c.size[i] == c.size[0]);
+        }
+        valid &= (!in.fail() && c.size[6] == c.size[0] + 1 && c.thread_offset[c.size[0]] == c.size[7]);
+    }
+    uint64_t trie_size[5];
+    const uint32_t *parent = in.readArray<uint32_t>(trie_size[0]);
+    const BBLID *cur = in.readArray<BBLID>(trie_size[1]);
+    const uint64_t *count = in.readArray<uint64_t>(trie_size[2]);
+    const uint8_t *isleaf = in.readArray<uint8_t>(trie_size[3]);
+    const uint32_t *leaves = in.readArray<uint32_t>(trie_size[4]);
+    uint64_t row_size, row_elems_size;
+    const uint64_t *row_offset = in.readArray<uint64_t>(row_size);
+    const std::pair<int64_t, uint64_t> *row_elems = in.readArray<std::pair<int64_t, uint64_t>>(row_elems_size);
+    uint64_t dm_size[2];
+    const SnapshotBBLPair *dm[2];
+    for (int i = 0; i < 2; i++) {
+        dm[i] = in.readArray<SnapshotBBLPair>(dm_size[i]);
+    }
+    uint64_t decision_size[2];
+    const SnapshotDecision *decision[2];
+    for (int i = 0; i < 2; i++) {
+        decision[i] = in.readArray<SnapshotDecision>(decision_size[i]);
+    }
+    valid &= (!in.fail() && columns[CPU].size[0] == columns[PIM].size[0]
+        && trie_size[1] == trie_size[0] && trie_size[2] == trie_size[0] && trie_size[3] == trie_size[0]
+        && row_size > 0 && row_offset[row_size - 1] == row_elems_size);
+    // every offset and index is checked here as well, the arrays are used as is below
+    for (int site = 0; valid && site < MAX_COST_SITE; site++) {
+        StatsColumns &c = columns[site];
+        valid &= (c.thread_offset[0] == 0);
+        for (uint64_t i = 0; valid && i < c.size[0]; i++) {
+            valid &= (c.thread_offset[i] <= c.thread_offset[i + 1] && c.thread_offset[i + 1] <= c.size[7]);
+        }
+    }
+    if (valid) {
+        valid &= (row_offset[0] == 0);
+        for (uint64_t i = 0; valid && i + 1 < row_size; i++) {
+            valid &= (row_offset[i] <= row_offset[i + 1]);
+        }
+        valid &= BBLIDDataReuse::ValidFlat(trie_size[0], parent, trie_size[4], leaves);
+    }
+    if (!valid) {
+        warningmsg("Snapshot ``%s'' is corrupted, parse input files instead", filename.c_str());
+        return false;
+    }
+
+    for (int site = 0; site < MAX_COST_SITE; site++) {
+        StatsColumns &c = columns[site];
+        _bbl_sorted_stats[site].clear();
+        _bbl_hash2stats[site].reserve(c.size[0]);
+        for (uint64_t i = 0; i < c.size[0]; i++) {
+            RunStats bblstats(c.bblid[i], c.bblhash[i], c.elapsed_time[i], c.instruction_count[i], c.memory_access[i]);
+            bblstats.elapsed_time_var = c.elapsed_time_var[i];
+            std::vector<COST> elapsed(c.thread_elapsed_time + c.thread_offset[i], c.thread_elapsed_time + c.thread_offset[i + 1]);
+            ThreadRunStats *stats = new ThreadRunStats(bblstats, elapsed);
+            _bbl_hash2stats[site].insert(std::make_pair(stats->bblhash, stats));
+            _bbl_sorted_stats[site].push_back(stats);
+        }
+    }
+    _dirty = false;
+
+    _bbl_data_reuse.Unflatten(trie_size[0], parent, cur, count, isleaf, trie_size[4], leaves);
+
+    for (uint64_t i = 0; i + 1 < row_size; i++) {
+        std::vector<std::pair<int64_t, uint64_t>> toidxvec(row_elems + row_offset[i], row_elems + row_offset[i + 1]);
+        _bbl_switch_count.RowInsert(i, toidxvec);
+    }
+
+    std::map<std::pair<BBLID,BBLID>, COST> *dmmap[2] = {&interBB_CL_DM, &interBB_REG_DM};
+    for (int i = 0; i < 2; i++) {
+        for (uint64_t j = 0; j < dm_size[i]; j++) {
+            dmmap[i]->emplace_hint(dmmap[i]->end(), std::make_pair(dm[i][j].first, dm[i][j].second), dm[i][j].cost);
+        }
+    }
+
+    DecisionFromFile *decisionmap[2] = {&ctsDecision, &scaDecision};
+    for (int i = 0; i < 2; i++) {
+        for (uint64_t j = 0; j < decision_size[i]; j++) {
+            decisionmap[i]->emplace_hint(decisionmap[i]->end(), UUID(decision[i][j].hi, decision[i][j].lo), (CostSite)decision[i][j].site);
+        }
+    }
+
+    infomsg("Snapshot loaded from ``%s''", filename.c_str());
+    return true;
+}
+
 DECISION CostSolver::PrintSolution(std::ostream &ofs)
+{
+    if (_cache_hit) {
+        ofs << _solution.report;
+    }
+    else if (!_result_cache.enabled()) {
+        Solve(ofs);
+    }
+    else {
+        std::ostringstream oss;
+        Solve(oss);
+        _solution.report = oss.str();
+        _result_cache.Store(_fingerprint, _solution);
+        ofs << _solution.report;
+    }
+    if (_command_line_parser->exportFile() != "") {
+        ExportSolution();
+    }
+    if (_command_line_parser->decisionTableFile() != "") {
+        WriteDecisionTable();
+    }
+    return _solution.decision;
+}
+
+DECISION CostSolver::Solve(std::ostream &ofs)
 {
     DECISION decision;
     DECISION scaPrintDecision;
     DECISION ctsPrintDecision;
     
     if (_command_line_parser->mode() == CommandLineParser::Mode::MPKI) {
-        ofs << "CPU only time (ns): " << ElapsedTime(CPU) << std::endl
-            << "PIM only time (ns): " << ElapsedTime(PIM) << std::endl;
+        PrintSingleSiteTime(ofs);
         decision = PrintMPKIStats(ofs);
     }
     if (_command_line_parser->mode() == CommandLineParser::Mode::REUSE) {
-        ofs << "CPU only time (ns): " << ElapsedTime(CPU) << std::endl
-            << "PIM only time (ns): " << ElapsedTime(PIM) << std::endl;
+        PrintSingleSiteTime(ofs);
 
         const std::vector<ThreadRunStats *> *sorted = getBBLSortedStats();
         uint64_t instr_cnt = 0;
@@ -328,19 +868,133 @@ DECISION CostSolver::PrintSolution(std::ostream &ofs)
             }
         }
         minSCAResult.print(ofs);
+        _cost_breakdown.push_back({"SCA", minSCAResult.total_time,
+            minSCAResult.elapsed_time.first, minSCAResult.elapsed_time.second,
+            minSCAResult.reuse_cost, minSCAResult.switch_cost});
+        if (!_epochs.empty()) {
+            PrintPhaseStats(ofs);
+        }
+        if (!_context_hash2stats[CPU].empty()) {
+            PrintContextStats(ofs);
+        }
     }
     if (_command_line_parser->mode() == CommandLineParser::Mode::DEBUG) {
-        ofs << "CPU only time (ns): " << ElapsedTime(CPU) << std::endl
-            << "PIM only time (ns): " << ElapsedTime(PIM) << std::endl;
+        PrintSingleSiteTime(ofs);
         decision = Debug_HierarchicalDecision(ofs);
     }
 
-    PrintDecision(ofs, decision, ctsPrintDecision,false);
-    ofs << delayCout.str();
+    PrintNoiseStats(ofs, decision);
+
+    // the report tables are only formatted when there is a report to write,
+    // a cached report is always complete since any later run may be served from it
+    if (_command_line_parser->outputfile() != "" || _result_cache.enabled()) {
+        PrintDecision(ofs, decision, ctsPrintDecision,false);
+        ofs << delayCout.str();
+    }
+    if (_command_line_parser->exportFile() != "" || _result_cache.enabled()) {
+        BuildExportRecords(decision, ctsPrintDecision);
+    }
+    if (_command_line_parser->decisionTableFile() != "" || _result_cache.enabled()) {
+        BuildDecisionTable(decision);
+    }
+    _solution.decision = decision;
 
     return decision;
 }
 
+void CostSolver::BuildDecisionTable(const DECISION &decision)
+{
+    const std::vector<ThreadRunStats *> *sorted = getBBLSortedStats();
+    std::vector<DecisionTableEntry> &entries = _solution.table;
+    entries.assign(sorted[CPU].size(), DecisionTableEntry());
+    for (uint32_t i = 0; i < sorted[CPU].size(); i++) {
+        auto *cpustats = sorted[CPU][i];
+        auto *pimstats = sorted[PIM][i];
+        DecisionTableEntry &entry = entries[i];
+        entry.hi = cpustats->bblhash.first;
+        entry.lo = cpustats->bblhash.second;
+        entry.bblid = i;
+        entry.difference = cpustats->MaxElapsedTime() - pimstats->MaxElapsedTime();
+        // same as the report, anything but PIM runs on CPU
+        entry.decision = (i < decision.size() && decision[i] == PIM ? PIM : CPU);
+        entry.parallelism = pimstats->parallelism();
+    }
+    // already sorted by bblhash, kept explicit since the pass relies on it
+    std::sort(entries.begin(), entries.end(), [](const DecisionTableEntry &lhs, const DecisionTableEntry &rhs) {
+        return UUID(lhs.hi, lhs.lo) < UUID(rhs.hi, rhs.lo);
+    });
+}
+
+void CostSolver::WriteDecisionTable()
+{
+    const std::vector<DecisionTableEntry> &entries = _solution.table;
+    DecisionTableHeader header;
+    memcpy(header.magic, DecisionTableMagic, sizeof(header.magic));
+    header.version = DecisionTableVersion;
+    header.entry_size = sizeof(DecisionTableEntry);
+    header.count = entries.size();
+
+    std::string filename = _command_line_parser->decisionTableFile();
+    std::ofstream ofs(filename, std::ofstream::out | std::ofstream::binary);
+    ofs.write((const char *)&header, sizeof(header));
+    ofs.write((const char *)entries.data(), entries.size() * sizeof(DecisionTableEntry));
+    ofs.close();
+    if (!ofs.good()) {
+        warningmsg("Unable to write decision table ``%s''", filename.c_str());
+    }
+}
+
+void CostSolver::PrintSingleSiteTime(std::ostream &ofs)
+{
+    COST cpu = ElapsedTime(CPU);
+    COST pim = ElapsedTime(PIM);
+    ofs << "CPU only time (ns): " << cpu << std::endl
+        << "PIM only time (ns): " << pim << std::endl;
+    _cost_breakdown.push_back({"CPU-only", cpu, cpu, 0, 0, 0});
+    _cost_breakdown.push_back({"PIM-only", pim, 0, pim, 0, 0});
+}
+
+void CostSolver::PrintCostBreakdown(std::ostream &ofs, const std::string &method, COST total_time,
+    std::pair<COST, COST> elapsed_time, COST reuse_cost, COST switch_cost)
+{
+    ofs << method << " offloading time (ns): " << total_time << " = CPU " << elapsed_time.first << " + PIM " << elapsed_time.second << " + REUSE " << reuse_cost << " + SWITCH " << switch_cost << std::endl;
+    _cost_breakdown.push_back({method, total_time, elapsed_time.first, elapsed_time.second, reuse_cost, switch_cost});
+}
+
+void CostSolver::BuildExportRecords(const DECISION &decision, const DECISION &ctsPrintDecision)
+{
+    const std::vector<ThreadRunStats *> *sorted = getBBLSortedStats();
+    std::vector<BBCOUNT> bbcount = bbTimesFromSwitchInfo(decision, _bbl_switch_count);
+    std::vector<DecisionRecord> &records = _solution.records;
+    records.assign(sorted[CPU].size(), DecisionRecord());
+    for (uint32_t i = 0; i < sorted[CPU].size(); i++) {
+        auto *cpustats = sorted[CPU][i];
+        auto *pimstats = sorted[PIM][i];
+        auto it = scaDecision.find(cpustats->bblhash);
+        DecisionRecord &record = records[i];
+        record.bblid = i;
+        record.hash_hi = cpustats->bblhash.first;
+        record.hash_lo = cpustats->bblhash.second;
+        record.decision = (i < decision.size() ? decision[i] : INVALID);
+        record.cts_decision = (i < ctsPrintDecision.size() ? ctsPrintDecision[i] : INVALID);
+        record.sca_decision = (it == scaDecision.end() ? CPU : it->second);
+        record.parallelism = pimstats->parallelism();
+        record.bbcount = (i < bbcount.size() ? bbcount[i] : 0);
+        record.cpu = cpustats->MaxElapsedTime();
+        record.pim = pimstats->MaxElapsedTime();
+    }
+    _solution.costs = _cost_breakdown;
+}
+
+void CostSolver::ExportSolution()
+{
+    std::string filename = _command_line_parser->exportFile();
+    ExportFormat format = getExportFormat(_command_line_parser->exportFormat(), filename);
+    if (!ExportRecords(filename, format, _solution.costs, _solution.records)) {
+        warningmsg("Unable to export decision to ``%s''", filename.c_str());
+    }
+}
+
 // std::ostream & CostSolver::PrintDecision(std::ostream &ofs, const DECISION &decision, bool toscreen)
 // {
 //     const std::vector<ThreadRunStats *> *sorted = getBBLSortedStats();
@@ -393,6 +1047,27 @@ void CostSolver::redecideSCAByCLDM(DECISION &scaPrintDecision){
 
 }
 
+// one row of the decision tables, formatted the same way as setw on an ostream
+static void AppendDecisionRow(std::string &out, uint32_t i, const char *decision, const char *ctsdecision,
+    const char *scadecision, int parallelism, BBCOUNT bbcount, COST cpu, COST pim, COST diff, const UUID &bblhash)
+{
+    char row[256];
+    int n = snprintf(row, sizeof(row), "%7u%10s%12s%12s%14d%14lu%15g%15g%15g  %21lx  %21lx\n",
+        i, decision, ctsdecision, scadecision, parallelism, (unsigned long)bbcount, cpu, pim, diff,
+        (unsigned long)bblhash.first, (unsigned long)bblhash.second);
+    out.append(row, n);
+}
+
+static void AppendTopRow(std::string &out, uint32_t i, const char *decision, const char *ctsdecision,
+    int parallelism, BBCOUNT bbcount, COST cpu, COST pim, COST percentage, COST diff, const UUID &bblhash)
+{
+    char row[256];
+    int n = snprintf(row, sizeof(row), "%7u%10s%12s%14d%14lu%15g%15g%15g%15g  %21lx  %21lx\n",
+        i, decision, ctsdecision, parallelism, (unsigned long)bbcount, cpu, pim, percentage, diff,
+        (unsigned long)bblhash.first, (unsigned long)bblhash.second);
+    out.append(row, n);
+}
+
 std::ostream & CostSolver::PrintDecision(std::ostream &ofs, const DECISION &decision, const DECISION &scaPrintDecision, bool toscreen)
 {
     const std::vector<ThreadRunStats *> *sorted = getBBLSortedStats();
@@ -406,70 +1081,42 @@ std::ostream & CostSolver::PrintDecision(std::ostream &ofs, const DECISION &deci
         ofs << std::endl;
     }
     else {
-        std::stringstream IncorrectCPUDecision;
-        std::stringstream IncorrectPIMDecision;
         const float showThrehold = 0.005;
         std::map<COST, uint32_t> top10PIMProfBB;
         std::map<COST, uint32_t> top10SCABB;
-        COST PIMProfCost = Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count);
-        COST scaCost = Cost(scaPrintDecision, _bbl_data_reuse.getRoot(), _bbl_switch_count);
+        COST PIMProfCost = Cost(decision, _bbl_data_reuse, _bbl_switch_count);
+        COST scaCost = Cost(scaPrintDecision, _bbl_data_reuse, _bbl_switch_count);
         COST threshold = (1e+7);
         COST potential=0;
         std::vector<BBCOUNT> bbcount = bbTimesFromSwitchInfo(decision, _bbl_switch_count);
-        ofs << std::setw(7) << "BBLID"
-            << std::setw(10) << "Decision"
-            << std::setw(12) << "ctsDecision"
-            << std::setw(12) << "scaDecision"
-            << std::setw(14) << "Parallelism"
-            << std::setw(14) << "bbCount"
-            << std::setw(15) << "CPU"
-            << std::setw(15) << "PIM"
-            << std::setw(15) << "Difference"
-            << std::setw(21) << "Hash(hi)"
-            << std::setw(21) << "Hash(lo)"
-            << std::endl;
-        IncorrectCPUDecision << std::setw(7) << "BBLID"
-            << std::setw(10) << "Decision"
-            << std::setw(12) << "ctsDecision"
-            << std::setw(12) << "scaDecision"
-            << std::setw(14) << "Parallelism"
-            << std::setw(14) << "bbCount"
-            << std::setw(15) << "CPU"
-            << std::setw(15) << "PIM"
-            << std::setw(15) << "Difference"
-            << std::setw(21) << "Hash(hi)"
-            << std::setw(21) << "Hash(lo)"
-            << std::endl;
-        IncorrectPIMDecision << std::setw(7) << "BBLID"
-            << std::setw(10) << "Decision"
-            << std::setw(12) << "ctsDecision"
-            << std::setw(12) << "scaDecision"
-            << std::setw(14) << "Parallelism"
-            << std::setw(14) << "bbCount"
-            << std::setw(15) << "CPU"
-            << std::setw(15) << "PIM"
-            << std::setw(15) << "Difference"
-            << std::setw(21) << "Hash(hi)"
-            << std::setw(21) << "Hash(lo)"
-            << std::endl; 
-        for (uint32_t i = 0; i < sorted[CPU].size(); i++) {
+        uint32_t size = sorted[CPU].size();
+
+        char header[256];
+        snprintf(header, sizeof(header), "%7s%10s%12s%12s%14s%14s%15s%15s%15s%21s%21s\n",
+            "BBLID", "Decision", "ctsDecision", "scaDecision", "Parallelism", "bbCount",
+            "CPU", "PIM", "Difference", "Hash(hi)", "Hash(lo)");
+        char topheader[256];
+        snprintf(topheader, sizeof(topheader), "%7s%10s%12s%14s%14s%15s%15s%15s%15s%21s%21s\n",
+            "BBLID", "Decision", "ctsDecision", "Parallelism", "bbCount",
+            "CPU", "PIM", "Percentage", "Difference", "Hash(hi)", "Hash(lo)");
+
+        // the lookups and the per-BBL differences are shared by all tables below
+        std::vector<const char *> scasite(size);
+        std::vector<COST> diff(size);
+        // a BBL is an incorrect decision if the SCA decision puts it on the slower side
+        // by more than the threshold, the threshold is divided by 10 until there is one
+        COST maxincorrect = 0;
+        std::string table(header);
+        table.reserve(size * 180);
+        for (uint32_t i = 0; i < size; i++) {
             auto *cpustats = sorted[CPU][i];
             auto *pimstats = sorted[PIM][i];
-            COST diff = cpustats->MaxElapsedTime() - pimstats->MaxElapsedTime();
-            ofs << std::setw(7) << std::dec << i
-                << std::setw(10) << getCostSiteString(decision[i])
-                << std::setw(12) << getCostSiteString(scaPrintDecision[i])
-                << std::setw(12) << getCostSiteString(scaDecision[cpustats->bblhash])
-                << std::setw(14) << std::dec << pimstats->parallelism()
-                << std::setw(14) << std::dec << bbcount[i]
-                << std::setw(15) << cpustats->MaxElapsedTime()
-                << std::setw(15) << pimstats->MaxElapsedTime()
-                << std::setw(15) << diff
-                << "  "
-                << std::setw(21) << std::hex << cpustats->bblhash.first
-                << "  "
-                << std::setw(21) << std::hex << cpustats->bblhash.second
-                << std::setfill(' ') << std::endl;
+            auto it = scaDecision.find(cpustats->bblhash);
+            scasite[i] = CostSiteString[it == scaDecision.end() ? CPU : it->second].c_str();
+            diff[i] = cpustats->MaxElapsedTime() - pimstats->MaxElapsedTime();
+            AppendDecisionRow(table, i, CostSiteString[decision[i]].c_str(), CostSiteString[scaPrintDecision[i]].c_str(),
+                scasite[i], pimstats->parallelism(), bbcount[i],
+                cpustats->MaxElapsedTime(), pimstats->MaxElapsedTime(), diff[i], cpustats->bblhash);
             COST PIMProfBBCost = sorted[decision[i]][i]->MaxElapsedTime();
             COST scaBBCost = sorted[scaPrintDecision[i]][i]->MaxElapsedTime();
             if(PIMProfBBCost > showThrehold * PIMProfCost){
@@ -478,176 +1125,90 @@ std::ostream & CostSolver::PrintDecision(std::ostream &ofs, const DECISION &deci
             if(scaBBCost > showThrehold * scaCost){
                 top10SCABB[scaBBCost] = i;
             }
-            if(diff > threshold && getCostSiteString(scaPrintDecision[i])=="C"){
-                IncorrectCPUDecision << std::setw(7) << std::dec << i
-                << std::setw(10) << getCostSiteString(decision[i])
-                << std::setw(12) << getCostSiteString(scaPrintDecision[i])
-                << std::setw(12) << getCostSiteString(scaDecision[cpustats->bblhash])
-                << std::setw(14) << std::dec << pimstats->parallelism()
-                << std::setw(14) << std::dec << bbcount[i]
-                << std::setw(15) << cpustats->MaxElapsedTime()
-                << std::setw(15) << pimstats->MaxElapsedTime()
-                << std::setw(15) << diff
-                << "  "
-                << std::setw(21) << std::hex << cpustats->bblhash.first
-                << "  "
-                << std::setw(21) << std::hex << cpustats->bblhash.second
-                << std::setfill(' ') << std::endl;
-                potential += std::abs(diff);
+            if (scaPrintDecision[i] == CPU) {
+                maxincorrect = std::max(maxincorrect, diff[i]);
             }
-            if(diff < -threshold && getCostSiteString(scaPrintDecision[i])=="P"){
-                IncorrectPIMDecision << std::setw(7) << std::dec << i
-                << std::setw(10) << getCostSiteString(decision[i])
-                << std::setw(12) << getCostSiteString(scaPrintDecision[i])
-                << std::setw(12) << getCostSiteString(scaDecision[cpustats->bblhash])
-                << std::setw(14) << std::dec << pimstats->parallelism()
-                << std::setw(14) << std::dec << bbcount[i]
-                << std::setw(15) << cpustats->MaxElapsedTime()
-                << std::setw(15) << pimstats->MaxElapsedTime()
-                << std::setw(15) << diff
-                << "  "
-                << std::setw(21) << std::hex << cpustats->bblhash.first
-                << "  "
-                << std::setw(21) << std::hex << cpustats->bblhash.second
-                << std::setfill(' ') << std::endl;
-                potential += std::abs(diff);
+            if (scaPrintDecision[i] == PIM) {
+                maxincorrect = std::max(maxincorrect, -diff[i]);
             }
         }
-        // half threshold if  IncorrectDecision is empty
-        while(potential==0){
-            threshold = threshold/10;
-            for (uint32_t i = 0; i < sorted[CPU].size(); i++) {
-                auto *cpustats = sorted[CPU][i];
-                auto *pimstats = sorted[PIM][i];
-                COST diff = cpustats->MaxElapsedTime() - pimstats->MaxElapsedTime();
-                if(diff > threshold && getCostSiteString(scaPrintDecision[i])=="C"){
-                    IncorrectCPUDecision << std::setw(7) << std::dec << i
-                    << std::setw(10) << getCostSiteString(decision[i])
-                    << std::setw(12) << getCostSiteString(scaPrintDecision[i])
-                    << std::setw(12) << getCostSiteString(scaDecision[cpustats->bblhash])
-                    << std::setw(14) << std::dec << pimstats->parallelism()
-                    << std::setw(14) << std::dec << bbcount[i]
-                    << std::setw(15) << cpustats->MaxElapsedTime()
-                    << std::setw(15) << pimstats->MaxElapsedTime()
-                    << std::setw(15) << diff
-                    << "  "
-                    << std::setw(21) << std::hex << cpustats->bblhash.first
-                    << "  "
-                    << std::setw(21) << std::hex << cpustats->bblhash.second
-                    << std::setfill(' ') << std::endl;
-                    potential += std::abs(diff);
-                }
-                if(diff < -threshold && getCostSiteString(scaPrintDecision[i])=="P"){
-                    IncorrectPIMDecision << std::setw(7) << std::dec <<  i
-                    << std::setw(10) << getCostSiteString(decision[i])
-                    << std::setw(12) << getCostSiteString(scaPrintDecision[i])
-                    << std::setw(12) << getCostSiteString(scaDecision[cpustats->bblhash])
-                    << std::setw(14) << std::dec << pimstats->parallelism()
-                    << std::setw(14) << std::dec << bbcount[i]
-                    << std::setw(15) << cpustats->MaxElapsedTime()
-                    << std::setw(15) << pimstats->MaxElapsedTime()
-                    << std::setw(15) << diff
-                    << "  "
-                    << std::setw(21) << std::hex << cpustats->bblhash.first
-                    << "  "
-                    << std::setw(21) << std::hex << cpustats->bblhash.second
-                    << std::setfill(' ') << std::endl;
-                    potential += std::abs(diff);
-                }
+        ofs << table;
+        if (maxincorrect > 0) {
+            while (!(maxincorrect > threshold)) {
+                threshold = threshold/10;
             }
         }
+        else {
+            // nothing to report at any threshold
+            threshold = INFINITY;
+        }
+
+        std::string IncorrectCPUDecision(header);
+        std::string IncorrectPIMDecision(header);
+        for (uint32_t i = 0; i < size; i++) {
+            auto *cpustats = sorted[CPU][i];
+            auto *pimstats = sorted[PIM][i];
+            std::string *incorrect = nullptr;
+            if (diff[i] > threshold && scaPrintDecision[i] == CPU) {
+                incorrect = &IncorrectCPUDecision;
+            }
+            if (diff[i] < -threshold && scaPrintDecision[i] == PIM) {
+                incorrect = &IncorrectPIMDecision;
+            }
+            if (incorrect != nullptr) {
+                AppendDecisionRow(*incorrect, i, CostSiteString[decision[i]].c_str(), CostSiteString[scaPrintDecision[i]].c_str(),
+                    scasite[i], pimstats->parallelism(), bbcount[i],
+                    cpustats->MaxElapsedTime(), pimstats->MaxElapsedTime(), diff[i], cpustats->bblhash);
+                potential += std::abs(diff[i]);
+            }
+        }
+
         // Print top10PIMProfBB[PIMProfBBCost] = i;
-        ofs << HORIZONTAL_LINE << std::endl;
-        ofs << "top10PIMProfBB" << std::endl;
-        ofs << std::setw(7) << "BBLID"
-            << std::setw(10) << "Decision"
-            << std::setw(12) << "ctsDecision"
-            // << std::setw(12) << "scaDecision"
-            << std::setw(14) << "Parallelism"
-            << std::setw(14) << "bbCount"
-            << std::setw(15) << "CPU"
-            << std::setw(15) << "PIM"
-            << std::setw(15) << "Percentage"
-            << std::setw(15) << "Difference"
-            << std::setw(21) << "Hash(hi)"
-            << std::setw(21) << "Hash(lo)"
-            << std::endl;
+        std::string top(topheader);
         COST sumofShowBBTime  = 0;
         for(auto it = top10PIMProfBB.begin(); it != top10PIMProfBB.end(); it++){
             auto key = it->first;
             auto i = it->second;
             auto *cpustats = sorted[CPU][i];
             auto *pimstats = sorted[PIM][i];
-            COST diff = cpustats->MaxElapsedTime() - pimstats->MaxElapsedTime();
-            ofs << std::setw(7) << std::dec << i
-                << std::setw(10) << getCostSiteString(decision[i])
-                << std::setw(12) << getCostSiteString(scaPrintDecision[i])
-                << std::setw(14) << std::dec << pimstats->parallelism()
-                << std::setw(14) << std::dec << bbcount[i]
-                << std::setw(15) << cpustats->MaxElapsedTime()
-                << std::setw(15) << pimstats->MaxElapsedTime()
-                << std::setw(15) << key*100/PIMProfCost 
-                << std::setw(15) << diff
-                << "  "
-                << std::setw(21) << std::hex << cpustats->bblhash.first
-                << "  "
-                << std::setw(21) << std::hex << cpustats->bblhash.second
-                << std::setfill(' ') << std::endl;
-                sumofShowBBTime += key;
+            AppendTopRow(top, i, CostSiteString[decision[i]].c_str(), CostSiteString[scaPrintDecision[i]].c_str(),
+                pimstats->parallelism(), bbcount[i], cpustats->MaxElapsedTime(), pimstats->MaxElapsedTime(),
+                key*100/PIMProfCost, diff[i], cpustats->bblhash);
+            sumofShowBBTime += key;
         }
+        ofs << HORIZONTAL_LINE << std::endl;
+        ofs << "top10PIMProfBB" << std::endl;
+        ofs << top;
         ofs << "ShowBBTime: " << sumofShowBBTime*100/PIMProfCost << " %" << std::endl;
         // Print top10SCABB[] = i;
-        ofs << HORIZONTAL_LINE << std::endl;
-        ofs << "top10SCABB" << std::endl;
-        ofs << std::setw(7) << "BBLID"
-            << std::setw(10) << "Decision"
-            << std::setw(12) << "ctsDecision"
-            // << std::setw(12) << "scaDecision"
-            << std::setw(14) << "Parallelism"
-            << std::setw(14) << "bbCount"
-            << std::setw(15) << "CPU"
-            << std::setw(15) << "PIM"
-            << std::setw(15) << "Percentage"
-            << std::setw(15) << "Difference"
-            << std::setw(21) << "Hash(hi)"
-            << std::setw(21) << "Hash(lo)"
-            << std::endl;
+        top = topheader;
         sumofShowBBTime  = 0;
         for(auto it = top10SCABB.begin(); it != top10SCABB.end(); it++){
             auto key = it->first;
             auto i = it->second;
             auto *cpustats = sorted[CPU][i];
             auto *pimstats = sorted[PIM][i];
-            COST diff = cpustats->MaxElapsedTime() - pimstats->MaxElapsedTime();
-            ofs << std::setw(7) << std::dec << i
-                << std::setw(10) << getCostSiteString(decision[i])
-                << std::setw(12) << getCostSiteString(scaPrintDecision[i])
-                << std::setw(14) << std::dec << pimstats->parallelism()
-                << std::setw(14) << std::dec << bbcount[i]
-                << std::setw(15) << cpustats->MaxElapsedTime()
-                << std::setw(15) << pimstats->MaxElapsedTime()
-                << std::setw(15) << key*100/scaCost 
-                << std::setw(15) << diff
-                << "  "
-                << std::setw(21) << std::hex << cpustats->bblhash.first
-                << "  "
-                << std::setw(21) << std::hex << cpustats->bblhash.second
-                << std::setfill(' ') << std::endl;
-                sumofShowBBTime += key;
+            AppendTopRow(top, i, CostSiteString[decision[i]].c_str(), CostSiteString[scaPrintDecision[i]].c_str(),
+                pimstats->parallelism(), bbcount[i], cpustats->MaxElapsedTime(), pimstats->MaxElapsedTime(),
+                key*100/scaCost, diff[i], cpustats->bblhash);
+            sumofShowBBTime += key;
         }
+        ofs << HORIZONTAL_LINE << std::endl;
+        ofs << "top10SCABB" << std::endl;
+        ofs << top;
         ofs << "ShowBBTime: " << sumofShowBBTime*100/scaCost << " %" << std::endl;
         // Print IncorrectCPUDecision
         ofs << HORIZONTAL_LINE << std::endl;
         ofs << "IncorrectCPUDecision" << std::endl;
-        ofs << IncorrectCPUDecision.str();
+        ofs << IncorrectCPUDecision;
         // Print IncorrectPIMDecision
         ofs << HORIZONTAL_LINE << std::endl;
         ofs << "IncorrectPIMDecision" << std::endl;
-        ofs << IncorrectPIMDecision.str();
+        ofs << IncorrectPIMDecision;
         // optimize potential
         auto pimprofTime = ElapsedTime(decision);
         ofs << "Optimize potential " << potential/(pimprofTime.first + pimprofTime.second) << std::endl;
-        ReuseCostPrint(scaPrintDecision, _bbl_data_reuse.getRoot(), ofs);
+        ReuseCostPrint(scaPrintDecision, _bbl_data_reuse, ofs);
     }
     return ofs;
 }
@@ -687,13 +1248,13 @@ DECISION CostSolver::PrintMPKIStats(std::ostream &ofs)
         }
     }
 
-    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse.getRoot());
+    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse);
     COST switch_cost = SwitchCost(decision, _bbl_switch_count);
     auto elapsed_time = ElapsedTime(decision);
     COST total_time = reuse_cost + switch_cost + elapsed_time.first + elapsed_time.second;
-    assert(total_time == Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count));
+    assert(total_time == Cost(decision, _bbl_data_reuse, _bbl_switch_count));
 
-    ofs << "MPKI offloading time (ns): " << total_time << " = CPU " << elapsed_time.first << " + PIM " << elapsed_time.second << " + REUSE " << reuse_cost << " + SWITCH " << switch_cost << std::endl;
+    PrintCostBreakdown(ofs, "MPKI", total_time, elapsed_time, reuse_cost, switch_cost);
 
     return decision;
 }
@@ -718,13 +1279,13 @@ DECISION CostSolver::PrintCTSStatsFromfile(DecisionFromFile decisionFromFile, st
             decision.push_back(CostSite::CPU);
         }
     }
-    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse.getRoot());
+    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse);
     COST switch_cost = SwitchCost(decision, _bbl_switch_count);
     auto elapsed_time = ElapsedTime(decision);
     COST total_time = reuse_cost + switch_cost + elapsed_time.first + elapsed_time.second;
-    assert(total_time == Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count));
+    assert(total_time == Cost(decision, _bbl_data_reuse, _bbl_switch_count));
 
-    ofs << "CTS offloading time (ns): " << total_time << " = CPU " << elapsed_time.first << " + PIM " << elapsed_time.second << " + REUSE " << reuse_cost << " + SWITCH " << switch_cost << std::endl;
+    PrintCostBreakdown(ofs, "CTS", total_time, elapsed_time, reuse_cost, switch_cost);
     // ofs << "SCA configuration: " << " sca_mpki_threshold: " << sca_mpki_threshold \
     //     << " sca_parallelism_threshold: " << sca_parallelism_threshold \
     //     << " instr_threshold_percentage: " << instr_threshold_percentage \
@@ -759,13 +1320,13 @@ DECISION CostSolver::PrintSCAStatsFromfile(DecisionFromFile decisionFromFile, st
     }
     redecideSCAByCLDM(decision);
 
-    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse.getRoot());
+    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse);
     COST switch_cost = SwitchCost(decision, _bbl_switch_count);
     auto elapsed_time = ElapsedTime(decision);
     COST total_time = reuse_cost + switch_cost + elapsed_time.first + elapsed_time.second;
-    assert(total_time == Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count));
+    assert(total_time == Cost(decision, _bbl_data_reuse, _bbl_switch_count));
 
-    ofs << "SCAFromfile offloading time (ns): " << total_time << " = CPU " << elapsed_time.first << " + PIM " << elapsed_time.second << " + REUSE " << reuse_cost << " + SWITCH " << switch_cost << std::endl;
+    PrintCostBreakdown(ofs, "SCAFromfile", total_time, elapsed_time, reuse_cost, switch_cost);
     // ofs << "SCA configuration: " << " sca_mpki_threshold: " << sca_mpki_threshold \
     //     << " sca_parallelism_threshold: " << sca_parallelism_threshold \
     //     << " instr_threshold_percentage: " << instr_threshold_percentage \
@@ -811,11 +1372,11 @@ CostSolver::bestSCAResult CostSolver::PrintSCAStats(
         }
     }
 
-    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse.getRoot());
+    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse);
     COST switch_cost = SwitchCost(decision, _bbl_switch_count);
     auto elapsed_time = ElapsedTime(decision);
     COST total_time = reuse_cost + switch_cost + elapsed_time.first + elapsed_time.second;
-    assert(total_time == Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count));
+    assert(total_time == Cost(decision, _bbl_data_reuse, _bbl_switch_count));
 
     bestSCAResult result(total_time, elapsed_time, reuse_cost, switch_cost, sca_mpki_threshold, sca_parallelism_threshold, instr_threshold_percentage);
     // ofs << "SCA offloading time (ns): " << total_time << " = CPU " << elapsed_time.first << " + PIM " << elapsed_time.second << " + REUSE " << reuse_cost << " + SWITCH " << switch_cost << std::endl;
@@ -840,20 +1401,301 @@ DECISION CostSolver::PrintGreedyStats(std::ostream &ofs)
             decision.push_back(PIM);
         }
     }
-    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse.getRoot());
+    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse);
     COST switch_cost = SwitchCost(decision, _bbl_switch_count);
     auto elapsed_time = ElapsedTime(decision);
     COST total_time = reuse_cost + switch_cost + elapsed_time.first + elapsed_time.second;
-    assert(total_time == Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count));
+    assert(total_time == Cost(decision, _bbl_data_reuse, _bbl_switch_count));
 
-    ofs << "Greedy offloading time (ns): " << total_time << " = CPU " << elapsed_time.first << " + PIM " << elapsed_time.second << " + REUSE " << reuse_cost << " + SWITCH " << switch_cost << std::endl;
+    PrintCostBreakdown(ofs, "Greedy", total_time, elapsed_time, reuse_cost, switch_cost);
 
     return decision;
 }
 
+// Classify the epochs by their instruction mix (see PhaseClassifier) and
+// decide each phase greedily on its own. Both sides of the comparison use
+// the times summed over the epochs, the whole-run side decides on the sum
+// of all phases. Taking the epochs in order, every change of phase moves
+// the data of each BBL that changes site, at SingleSegMaxReuseCost() per
+// BBL; this is reported as the REUSE part of the phase decisions, since
+// the reuse segments themselves are not split by epoch.
+void CostSolver::PrintPhaseStats(std::ostream &ofs)
+{
+    const std::vector<ThreadRunStats *> *sorted = getBBLSortedStats();
+    BBLID bblcount = sorted[CPU].size();
+
+    struct PhaseProfile {
+        int epochs = 0;
+        uint64_t instructions = 0;
+        std::vector<COST> time[MAX_COST_SITE]; // indexed by BBLID
+        std::map<std::pair<BBLID, BBLID>, uint64_t> switchcnt;
+        SwitchCountList switchlist;
+        DECISION decision;
+    };
+    std::vector<PhaseProfile> phases;
+    std::vector<int> sequence; // the phase of each non-empty epoch, in order
+
+    auto getBBLID = [&](const UUID &bblhash) {
+        auto p = _bbl_hash2stats[CPU].find(bblhash);
+        return (p == _bbl_hash2stats[CPU].end() ? (BBLID)-1 : p->second->bblid);
+    };
+
+    PhaseClassifier classifier(_command_line_parser->phaseDistance());
+    for (auto &epoch : _epochs) {
+        PhaseClassifier::Signature signature;
+        uint64_t instructions = 0;
+        for (auto it : epoch.stats[CPU]) {
+            BBLID bblid = getBBLID(it.first);
+            if (bblid < 0 || bblid >= bblcount || it.second->instruction_count == 0) continue;
+            signature.push_back(std::make_pair(bblid, (double)it.second->instruction_count));
+            instructions += it.second->instruction_count;
+        }
+        if (instructions == 0) continue;
+        std::sort(signature.begin(), signature.end());
+        for (auto &elem : signature) {
+            elem.second /= instructions;
+        }
+
+        int phase = classifier.Classify(signature);
+        if (phase == (int)phases.size()) {
+            phases.emplace_back();
+            for (int site = 0; site < MAX_COST_SITE; site++) {
+                phases.back().time[site].resize(bblcount, 0);
+            }
+        }
+        PhaseProfile &profile = phases[phase];
+        profile.epochs++;
+        profile.instructions += instructions;
+        for (int site = 0; site < MAX_COST_SITE; site++) {
+            for (auto it : epoch.stats[site]) {
+                BBLID bblid = getBBLID(it.first);
+                if (bblid < 0 || bblid >= bblcount) continue;
+                profile.time[site][bblid] += it.second->MaxElapsedTime();
+            }
+        }
+        for (auto &it : epoch.switchcnt) {
+            if (it.first.first < bblcount && it.first.second < bblcount) {
+                profile.switchcnt[it.first] += it.second;
+            }
+        }
+        sequence.push_back(phase);
+    }
+    if (sequence.empty()) {
+        warningmsg("None of the %lu profile epochs has instructions, phases are not analyzed", _epochs.size());
+        return;
+    }
+
+    DECISION wholedecision(bblcount, CPU);
+    for (BBLID i = 0; i < bblcount; i++) {
+        COST cputime = 0, pimtime = 0;
+        for (auto &profile : phases) {
+            cputime += profile.time[CPU][i];
+            pimtime += profile.time[PIM][i];
+        }
+        wholedecision[i] = (cputime <= pimtime ? CPU : PIM);
+    }
+
+    for (auto &profile : phases) {
+        profile.switchlist.RowInsert(profile.switchcnt);
+        // BBLs that take no time in the phase keep their whole-run site
+        profile.decision = wholedecision;
+        for (BBLID i = 0; i < bblcount; i++) {
+            if (profile.time[CPU][i] < profile.time[PIM][i]) {
+                profile.decision[i] = CPU;
+            }
+            else if (profile.time[CPU][i] > profile.time[PIM][i]) {
+                profile.decision[i] = PIM;
+            }
+        }
+    }
+
+    auto elapsedTime = [&](const PhaseProfile &profile, const DECISION &decision) {
+        COST cpu_elapsed_time = 0, pim_elapsed_time = 0;
+        for (BBLID i = 0; i < bblcount; i++) {
+            if (decision[i] == CPU) {
+                cpu_elapsed_time += profile.time[CPU][i];
+            }
+            else {
+                pim_elapsed_time += profile.time[PIM][i];
+            }
+        }
+        return std::make_pair(cpu_elapsed_time, pim_elapsed_time);
+    };
+
+    std::pair<COST, COST> whole_elapsed_time(0, 0), phase_elapsed_time(0, 0);
+    COST whole_switch_cost = 0, phase_switch_cost = 0;
+    ofs << "Phase analysis: " << sequence.size() << " epochs in " << phases.size() << " phases" << std::endl;
+    for (int p = 0; p < (int)phases.size(); p++) {
+        PhaseProfile &profile = phases[p];
+        auto whole = elapsedTime(profile, wholedecision);
+        auto phase = elapsedTime(profile, profile.decision);
+        COST whole_switch = SwitchCost(wholedecision, profile.switchlist);
+        COST phase_switch = SwitchCost(profile.decision, profile.switchlist);
+        int topim = 0, tocpu = 0;
+        for (BBLID i = 0; i < bblcount; i++) {
+            if (profile.decision[i] != wholedecision[i]) {
+                (profile.decision[i] == PIM ? topim : tocpu)++;
+            }
+        }
+        ofs << "Phase " << p << ": epochs " << profile.epochs
+            << ", instructions " << profile.instructions
+            << ", BBLs moved to PIM " << topim << ", to CPU " << tocpu
+            << ", time (ns) " << whole.first + whole.second + whole_switch
+            << " -> " << phase.first + phase.second + phase_switch << std::endl;
+        whole_elapsed_time.first += whole.first;
+        whole_elapsed_time.second += whole.second;
+        whole_switch_cost += whole_switch;
+        phase_elapsed_time.first += phase.first;
+        phase_elapsed_time.second += phase.second;
+        phase_switch_cost += phase_switch;
+    }
+
+    // the BBLs that change site between two phases, computed once per pair
+    std::map<std::pair<int, int>, uint64_t> changed;
+    uint64_t transitions = 0;
+    COST transition_cost = 0;
+    for (size_t k = 1; k < sequence.size(); k++) {
+        int from = sequence[k - 1], to = sequence[k];
+        if (from == to) continue;
+        auto key = std::make_pair(std::min(from, to), std::max(from, to));
+        auto it = changed.find(key);
+        if (it == changed.end()) {
+            uint64_t count = 0;
+            for (BBLID i = 0; i < bblcount; i++) {
+                count += (phases[from].decision[i] != phases[to].decision[i]);
+            }
+            it = changed.insert(std::make_pair(key, count)).first;
+        }
+        transitions++;
+        transition_cost += it->second * SingleSegMaxReuseCost();
+    }
+    ofs << "Phase changes: " << transitions << std::endl;
+
+    COST whole_time = whole_elapsed_time.first + whole_elapsed_time.second + whole_switch_cost;
+    COST phase_time = phase_elapsed_time.first + phase_elapsed_time.second + transition_cost + phase_switch_cost;
+    PrintCostBreakdown(ofs, "EpochGreedy", whole_time, whole_elapsed_time, 0, whole_switch_cost);
+    PrintCostBreakdown(ofs, "Phase", phase_time, phase_elapsed_time, transition_cost, phase_switch_cost);
+    ofs << "Phase decision gain (ns): " << whole_time - phase_time << std::endl;
+}
+
+// With sampled timing, a BBL whose CPU and PIM times differ by less than
+// the 95% confidence interval of the difference may have been decided on
+// noise. The variance of a BBL is summed over its threads, which bounds
+// that of MaxElapsedTime from above. Prints nothing if timing was exact.
+void CostSolver::PrintNoiseStats(std::ostream &ofs, const DECISION &decision)
+{
+    const std::vector<ThreadRunStats *> *sorted = getBBLSortedStats();
+    bool sampled = false;
+    std::vector<std::pair<COST, BBLID>> noisy; // by the width of the interval
+    for (BBLID i = 0; i < (BBLID)sorted[CPU].size(); i++) {
+        ThreadRunStats *cpustats = sorted[CPU][i];
+        ThreadRunStats *pimstats = sorted[PIM][i];
+        COST var = cpustats->elapsed_time_var + pimstats->elapsed_time_var;
+        if (var <= 0) continue;
+        sampled = true;
+        COST ci = 1.96 * std::sqrt(var);
+        if (std::fabs(cpustats->MaxElapsedTime() - pimstats->MaxElapsedTime()) <= ci) {
+            noisy.push_back(std::make_pair(ci, i));
+        }
+    }
+    if (!sampled) return;
+    std::sort(noisy.begin(), noisy.end(), std::greater<std::pair<COST, BBLID>>());
+
+    ofs << "Noisy decisions: " << noisy.size() << " of " << sorted[CPU].size()
+        << " BBLs differ between CPU and PIM by less than the 95% confidence interval" << std::endl;
+    for (size_t k = 0; k < noisy.size() && k < 10; k++) {
+        BBLID i = noisy[k].second;
+        ofs << "Noisy BBL " << i
+            << ": decision " << (i < (BBLID)decision.size() ? CostSiteString[decision[i]] : "-")
+            << ", CPU " << sorted[CPU][i]->MaxElapsedTime()
+            << ", PIM " << sorted[PIM][i]->MaxElapsedTime()
+            << ", CI95 " << noisy[k].first << std::endl;
+    }
+}
+
+// Decide each calling context of a BBL on its own, against deciding the BBL
+// on the sum of its contexts. Only contexts seen in both runs take part.
+// Reuse and switches are not split by context, so both sides are compared
+// on elapsed time alone. A BBL whose contexts disagree is ``mixed'', it
+// would have to be cloned per caller to take the context decisions.
+void CostSolver::PrintContextStats(std::ostream &ofs)
+{
+    struct ContextSplit {
+        COST time[MAX_COST_SITE] = {0, 0};
+        COST best = 0; // the sum of the context decisions
+        int contexts = 0;
+        int topim = 0;
+    };
+    std::map<UUID, ContextSplit> bbls;
+    uint64_t contexts = 0, unmatched = 0;
+    std::pair<COST, COST> context_elapsed_time(0, 0);
+    for (auto it : _context_hash2stats[CPU]) {
+        auto pim = _context_hash2stats[PIM].find(it.first);
+        if (pim == _context_hash2stats[PIM].end()) {
+            unmatched++;
+            continue;
+        }
+        UUID bblhash = _context_bblhash[it.first];
+        COST cputime = it.second->MaxElapsedTime();
+        COST pimtime = pim->second->MaxElapsedTime();
+        // the contexts a longer one was cut to may never run themselves
+        if (bblhash == GLOBAL_BBLHASH || (cputime == 0 && pimtime == 0)) continue;
+        contexts++;
+        ContextSplit &split = bbls[bblhash];
+        split.time[CPU] += cputime;
+        split.time[PIM] += pimtime;
+        split.best += std::min(cputime, pimtime);
+        split.contexts++;
+        if (cputime <= pimtime) {
+            context_elapsed_time.first += cputime;
+        }
+        else {
+            context_elapsed_time.second += pimtime;
+            split.topim++;
+        }
+    }
+    if (unmatched > 0) {
+        infomsg("%lu calling contexts of the CPU run are not in the PIM run, they are not analyzed", unmatched);
+    }
+
+    std::pair<COST, COST> bbl_elapsed_time(0, 0);
+    std::vector<std::pair<COST, UUID>> mixed; // by what deciding per context gains
+    for (auto &it : bbls) {
+        ContextSplit &split = it.second;
+        if (split.time[CPU] <= split.time[PIM]) {
+            bbl_elapsed_time.first += split.time[CPU];
+        }
+        else {
+            bbl_elapsed_time.second += split.time[PIM];
+        }
+        if (split.topim > 0 && split.topim < split.contexts) {
+            mixed.push_back(std::make_pair(std::min(split.time[CPU], split.time[PIM]) - split.best, it.first));
+        }
+    }
+    std::sort(mixed.begin(), mixed.end(), std::greater<std::pair<COST, UUID>>());
+
+    ofs << "Context analysis: " << contexts << " contexts of "
+        << bbls.size() << " BBLs, mixed BBLs " << mixed.size() << std::endl;
+    for (size_t i = 0; i < mixed.size() && i < 10; i++) {
+        UUID bblhash = mixed[i].second;
+        auto p = _bbl_hash2stats[CPU].find(bblhash);
+        ContextSplit &split = bbls[bblhash];
+        ofs << "Mixed BBL " << (p == _bbl_hash2stats[CPU].end() ? (BBLID)-1 : p->second->bblid)
+            << std::hex << " (" << bblhash.first << ", " << bblhash.second << ")" << std::dec
+            << ": contexts " << split.contexts << ", on PIM " << split.topim
+            << ", gain (ns) " << mixed[i].first << std::endl;
+    }
+
+    COST bbl_time = bbl_elapsed_time.first + bbl_elapsed_time.second;
+    COST context_time = context_elapsed_time.first + context_elapsed_time.second;
+    PrintCostBreakdown(ofs, "ContextTotalGreedy", bbl_time, bbl_elapsed_time, 0, 0);
+    PrintCostBreakdown(ofs, "ContextGreedy", context_time, context_elapsed_time, 0, 0);
+    ofs << "Context decision gain (ns): " << bbl_time - context_time << std::endl;
+}
+
 
 // this function does not check whether there is duplicate BBLID in cur_batch
-COST CostSolver::PermuteDecision(DECISION &decision, const std::vector<BBLID> &cur_batch, const BBLIDTrieNode *partial_root)
+COST CostSolver::PermuteDecision(DECISION &decision, const std::vector<BBLID> &cur_batch, const BBLIDDataReuse &partial_trie)
 {
 
     int cur_batch_size = cur_batch.size();
@@ -871,7 +1713,7 @@ COST CostSolver::PermuteDecision(DECISION &decision, const std::vector<BBLID> &c
                 temp_decision[cur_batch[j]] = CPU;
         }
         // PrintDecision(std::cout, temp_decision, true);
-        COST temp_total = Cost(temp_decision, partial_root, _bbl_switch_count);
+        COST temp_total = Cost(temp_decision, partial_trie, _bbl_switch_count);
         if (temp_total < cur_total) {
             cur_total = temp_total;
             decision = temp_decision; 
@@ -956,14 +1798,14 @@ COST CostSolver::PermuteDecision(DECISION &decision, const std::vector<BBLID> &c
 //         }
 //     }
 
-//     cur_total = Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count);
+//     cur_total = Cost(decision, _bbl_data_reuse, _bbl_switch_count);
 //     std::cout << "cur_total = " << cur_total << std::endl;
 //     // iterate over the remaining BBs 5 times until convergence
 //     for (int j = 0; j < 2; ++j) {
 //         for (BBLID id = 0; id < (BBLID)sorted[CPU].size(); id++) {
 //             // swap decision[id] and check if it reduces overhead
 //             decision[id] = (decision[id] == CPU ? PIM : CPU);
-//             COST temp_total = Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count);
+//             COST temp_total = Cost(decision, _bbl_data_reuse, _bbl_switch_count);
 //             if (temp_total > cur_total) {
 //                 decision[id] = (decision[id] == CPU ? PIM : CPU);
 //             }
@@ -974,11 +1816,11 @@ COST CostSolver::PermuteDecision(DECISION &decision, const std::vector<BBLID> &c
 //         std::cout << "cur_total = " << cur_total << std::endl;
 //     }
 
-//     COST reuse_cost = ReuseCost(decision, _bbl_data_reuse.getRoot());
+//     COST reuse_cost = ReuseCost(decision, _bbl_data_reuse);
 //     COST switch_cost = SwitchCost(decision, _bbl_switch_count);
 //     auto elapsed_time = ElapsedTime(decision);
 //     COST total_time = reuse_cost + switch_cost + elapsed_time.first + elapsed_time.second;
-//     assert(total_time == Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count));
+//     assert(total_time == Cost(decision, _bbl_data_reuse, _bbl_switch_count));
 
 //     ofs << "Reuse offloading time (ns): " << total_time << " = CPU " << elapsed_time.first << " + PIM " << elapsed_time.second << " + REUSE " << reuse_cost << " + SWITCH " << switch_cost << std::endl;
 
@@ -1039,7 +1881,7 @@ DECISION CostSolver::Debug_StartFromUnimportantSegment(std::ostream &ofs)
     decision.resize(_bbl_hash2stats[CPU].size(), INVALID);
     COST cur_total = FLT_MAX;
 
-    BBLIDTrieNode *partial_root = new BBLIDTrieNode();
+    BBLIDDataReuse partial_trie;
     BBLIDDataReuseSegment allidset;
     int cur_node = 0;
     int leaves_size = _bbl_data_reuse.getLeaves().size();
@@ -1055,14 +1897,14 @@ DECISION CostSolver::Debug_StartFromUnimportantSegment(std::ostream &ofs)
     for (; cur_node >= 0; --cur_node) {
         BBLIDDataReuseSegment seg;
         _bbl_data_reuse.ExportSegment(&seg, _bbl_data_reuse.getLeaves()[cur_node]);
-        _bbl_data_reuse.UpdateTrie(partial_root, &seg);
+        partial_trie.UpdateTrie(partial_trie.getRoot(), &seg);
         std::vector<BBLID> cur_batch(seg.begin(), seg.end());
         std::cout << "cur_node = " << cur_node << ", size = " << seg.size() << std::endl;
 
         // ignore too long segments
         if ((int)seg.size() >= _batch_size) continue;
 
-        cur_total = PermuteDecision(decision, cur_batch, partial_root);
+        cur_total = PermuteDecision(decision, cur_batch, partial_trie);
         
         for (auto elem : cur_batch) {
             std::cout << elem << getCostSiteString(decision[elem]) << " ";
@@ -1072,7 +1914,7 @@ DECISION CostSolver::Debug_StartFromUnimportantSegment(std::ostream &ofs)
         std::cout << std::endl;
     }
 
-    _bbl_data_reuse.DeleteTrie(partial_root);
+    partial_trie.DeleteTrie();
 
     const std::vector<ThreadRunStats *> *sorted = getBBLSortedStats();
 
@@ -1091,14 +1933,14 @@ DECISION CostSolver::Debug_StartFromUnimportantSegment(std::ostream &ofs)
         }
     }
 
-    cur_total = Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count);
+    cur_total = Cost(decision, _bbl_data_reuse, _bbl_switch_count);
     std::cout << "cur_total = " << cur_total << std::endl;
     // iterate over the remaining BBs until convergence
     for (int j = 0; j < 2; j++) {
         for (BBLID id = 0; id < (BBLID)sorted[CPU].size(); id++) {
             // swap decision[id] and check if it reduces overhead
             decision[id] = (decision[id] == CPU ? PIM : CPU);
-            COST temp_total = Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count);
+            COST temp_total = Cost(decision, _bbl_data_reuse, _bbl_switch_count);
             if (temp_total > cur_total) {
                 decision[id] = (decision[id] == CPU ? PIM : CPU);
             }
@@ -1109,13 +1951,13 @@ DECISION CostSolver::Debug_StartFromUnimportantSegment(std::ostream &ofs)
         std::cout << "cur_total = " << cur_total << std::endl;
     }
 
-    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse.getRoot());
+    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse);
     COST switch_cost = SwitchCost(decision, _bbl_switch_count);
     auto elapsed_time = ElapsedTime(decision);
     COST total_time = reuse_cost + switch_cost + elapsed_time.first + elapsed_time.second;
-    assert(total_time == Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count));
+    assert(total_time == Cost(decision, _bbl_data_reuse, _bbl_switch_count));
 
-    ofs << "Reuse offloading time (ns): " << total_time << " = CPU " << elapsed_time.first << " + PIM " << elapsed_time.second << " + REUSE " << reuse_cost << " + SWITCH " << switch_cost << std::endl;
+    PrintCostBreakdown(ofs, "Reuse", total_time, elapsed_time, reuse_cost, switch_cost);
 
     return decision;
 }
@@ -1140,7 +1982,7 @@ DECISION CostSolver::PrintReuseStats(std::ostream &ofs)
         decision.resize(_bbl_hash2stats[CPU].size(), init_decision);
         COST cur_total = FLT_MAX;
 
-        BBLIDTrieNode *partial_root = new BBLIDTrieNode();
+        BBLIDDataReuse partial_trie;
         BBLIDDataReuseSegment allidset;
         int cur_node = 0;
         int leaves_size = _bbl_data_reuse.getLeaves().size();
@@ -1156,7 +1998,7 @@ DECISION CostSolver::PrintReuseStats(std::ostream &ofs)
         for (; cur_node >= 0; --cur_node) {
             BBLIDDataReuseSegment seg;
             _bbl_data_reuse.ExportSegment(&seg, _bbl_data_reuse.getLeaves()[cur_node]);
-            _bbl_data_reuse.UpdateTrie(partial_root, &seg);
+            partial_trie.UpdateTrie(partial_trie.getRoot(), &seg);
 
             // ignore too long segments
             if ((int)seg.size() >= _batch_size) continue;
@@ -1189,7 +2031,7 @@ DECISION CostSolver::PrintReuseStats(std::ostream &ofs)
             std::vector<BBLID> cur_batch(seg.begin(), seg.end());
             std::cout << "cur_node = " << cur_node << ", size = " << seg.size() << std::endl;
 
-            cur_total = PermuteDecision(decision, cur_batch, partial_root);
+            cur_total = PermuteDecision(decision, cur_batch, partial_trie);
             
             for (auto elem : cur_batch) {
                 std::cout << elem << getCostSiteString(decision[elem]) << " ";
@@ -1200,7 +2042,7 @@ DECISION CostSolver::PrintReuseStats(std::ostream &ofs)
             std::cout << std::endl;
         }
 
-        _bbl_data_reuse.DeleteTrie(partial_root);
+        partial_trie.DeleteTrie();
 
         const std::vector<ThreadRunStats *> *sorted = getBBLSortedStats();
 
@@ -1219,14 +2061,14 @@ DECISION CostSolver::PrintReuseStats(std::ostream &ofs)
             }
         }
 
-        cur_total = Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count);
+        cur_total = Cost(decision, _bbl_data_reuse, _bbl_switch_count);
         std::cout << "cur_total = " << cur_total << std::endl;
         // iterate over the remaining BBs until convergence
         for (int j = 0; j < 2; j++) {
             for (BBLID id = 0; id < (BBLID)sorted[CPU].size(); id++) {
                 // swap decision[id] and check if it reduces overhead
                 decision[id] = (decision[id] == CPU ? PIM : CPU);
-                COST temp_total = Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count);
+                COST temp_total = Cost(decision, _bbl_data_reuse, _bbl_switch_count);
                 if (temp_total > cur_total) {
                     decision[id] = (decision[id] == CPU ? PIM : CPU);
                 }
@@ -1243,12 +2085,12 @@ DECISION CostSolver::PrintReuseStats(std::ostream &ofs)
         }
     }
 
-    COST reuse_cost = ReuseCost(min_decision, _bbl_data_reuse.getRoot());
+    COST reuse_cost = ReuseCost(min_decision, _bbl_data_reuse);
     COST switch_cost = SwitchCost(min_decision, _bbl_switch_count);
     auto elapsed_time = ElapsedTime(min_decision);
     COST total_time = reuse_cost + switch_cost + elapsed_time.first + elapsed_time.second;
 
-    ofs << "Reuse offloading time (ns): " << total_time << " = CPU " << elapsed_time.first << " + PIM " << elapsed_time.second << " + REUSE " << reuse_cost << " + SWITCH " << switch_cost << std::endl;
+    PrintCostBreakdown(ofs, "Reuse", total_time, elapsed_time, reuse_cost, switch_cost);
 
 
     // std::ofstream oo(
@@ -1276,7 +2118,7 @@ DECISION CostSolver::Debug_HierarchicalDecision(std::ostream &ofs)
     decision.resize(_bbl_hash2stats[CPU].size(), INVALID);
     COST cur_total = FLT_MAX;
 
-    BBLIDTrieNode *partial_root = new BBLIDTrieNode();
+    BBLIDDataReuse partial_trie;
     BBLIDDataReuseSegment allidset;
     int cur_node = 0;
     int leaves_size = _bbl_data_reuse.getLeaves().size();
@@ -1292,7 +2134,7 @@ DECISION CostSolver::Debug_HierarchicalDecision(std::ostream &ofs)
     for (; cur_node >= 0; --cur_node) {
         BBLIDDataReuseSegment seg;
         _bbl_data_reuse.ExportSegment(&seg, _bbl_data_reuse.getLeaves()[cur_node]);
-        _bbl_data_reuse.UpdateTrie(partial_root, &seg);
+        partial_trie.UpdateTrie(partial_trie.getRoot(), &seg);
 
         // ignore too long segments
         if ((int)seg.size() >= _batch_size) continue;
@@ -1325,7 +2167,7 @@ DECISION CostSolver::Debug_HierarchicalDecision(std::ostream &ofs)
         std::vector<BBLID> cur_batch(seg.begin(), seg.end());
         std::cout << "cur_node = " << cur_node << ", size = " << seg.size() << std::endl;
 
-        cur_total = PermuteDecision(decision, cur_batch, partial_root);
+        cur_total = PermuteDecision(decision, cur_batch, partial_trie);
         
         for (auto elem : cur_batch) {
             std::cout << elem << getCostSiteString(decision[elem]) << " ";
@@ -1336,7 +2178,7 @@ DECISION CostSolver::Debug_HierarchicalDecision(std::ostream &ofs)
         std::cout << std::endl;
     }
 
-    _bbl_data_reuse.DeleteTrie(partial_root);
+    partial_trie.DeleteTrie();
 
     const std::vector<ThreadRunStats *> *sorted = getBBLSortedStats();
 
@@ -1355,14 +2197,14 @@ DECISION CostSolver::Debug_HierarchicalDecision(std::ostream &ofs)
         }
     }
 
-    cur_total = Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count);
+    cur_total = Cost(decision, _bbl_data_reuse, _bbl_switch_count);
     std::cout << "cur_total = " << cur_total << std::endl;
     // iterate over the remaining BBs until convergence
     for (int j = 0; j < 2; j++) {
         for (BBLID id = 0; id < (BBLID)sorted[CPU].size(); id++) {
             // swap decision[id] and check if it reduces overhead
             decision[id] = (decision[id] == CPU ? PIM : CPU);
-            COST temp_total = Cost(decision, _bbl_data_reuse.getRoot(), _bbl_switch_count);
+            COST temp_total = Cost(decision, _bbl_data_reuse, _bbl_switch_count);
             if (temp_total > cur_total) {
                 decision[id] = (decision[id] == CPU ? PIM : CPU);
             }
@@ -1373,12 +2215,12 @@ DECISION CostSolver::Debug_HierarchicalDecision(std::ostream &ofs)
         std::cout << "cur_total = " << cur_total << std::endl;
     }
 
-    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse.getRoot());
+    COST reuse_cost = ReuseCost(decision, _bbl_data_reuse);
     COST switch_cost = SwitchCost(decision, _bbl_switch_count);
     auto elapsed_time = ElapsedTime(decision);
     COST total_time = reuse_cost + switch_cost + elapsed_time.first + elapsed_time.second;
 
-    ofs << "Reuse offloading time (ns): " << total_time << " = CPU " << elapsed_time.first << " + PIM " << elapsed_time.second << " + REUSE " << reuse_cost << " + SWITCH " << switch_cost << std::endl;
+    PrintCostBreakdown(ofs, "Reuse", total_time, elapsed_time, reuse_cost, switch_cost);
 
 
     std::ofstream oo(
@@ -1389,7 +2231,7 @@ DECISION CostSolver::Debug_HierarchicalDecision(std::ostream &ofs)
     return decision;
 }
 
-COST CostSolver::Cost(const DECISION &decision, const BBLIDTrieNode *reusetree, const SwitchCountList &switchcnt)
+COST CostSolver::Cost(const DECISION &decision, const BBLIDDataReuse &reusetree, const SwitchCountList &switchcnt)
 {
     auto pair = ElapsedTime(decision);
     return (ReuseCost(decision, reusetree) + SwitchCost(decision, switchcnt) + pair.first + pair.second);
@@ -1448,11 +2290,11 @@ std::vector<BBCOUNT> CostSolver::bbTimesFromSwitchInfo(const DECISION &decision,
 }
 
 // decision here should not be INVALID
-COST CostSolver::ReuseCost(const DECISION &decision, const BBLIDTrieNode *reusetree)
+COST CostSolver::ReuseCost(const DECISION &decision, const BBLIDDataReuse &reusetree)
 {
     COST cur_reuse_cost = 0;
-    for (auto elem : reusetree->_children) {
-        TrieBFS(cur_reuse_cost, decision, elem.first, elem.second, false);
+    for (auto &elem : reusetree.getNode(reusetree.getRoot())._children) {
+        TrieBFS(cur_reuse_cost, decision, reusetree, elem.idx, false);
     }
     return cur_reuse_cost;
 }
@@ -1604,86 +2446,123 @@ void CostSolver::TopReuseBBPairs(DECISION &decision)
 
 }
 
-void CostSolver::TrieBFS(COST &cost, const DECISION &decision, BBLID bblid, const BBLIDTrieNode *root, bool isDifferent)
+// Depth-first walk with an explicit stack, since the trie is as deep as the
+// longest segment. Each frame is an inner node with the children left to
+// visit, so leaves are visited, and their costs summed, in the same order as
+// a recursive walk and never take a frame.
+void CostSolver::TrieBFS(COST &cost, const DECISION &decision, const BBLIDDataReuse &reusetree, TrieIndex rootidx, bool isDifferent)
 {
-    if (root->_isLeaf) {
-        // The cost of a segment is zero if and only if the entire segment is in the same place. In other words, if isDifferent, then the cost is non-zero.
-        if (isDifferent) {
-            // If the initial W is on CPU and there are subsequent R/W on PIM,
-            // then this segment contributes to a flush of CPU and data fetch from PIM.
-            // We conservatively assume that the fetch will promote data to L1
-            assert(bblid == root->_cur);
-            if (decision[root->_cur] == CPU) {
-                cost += root->_count * (_flush_cost[CPU] + _fetch_cost[PIM]);
-            }
-            // If the initial W is on PIM and there are subsequent R/W on CPU,
-            // then this segment contributes to a flush of PIM and data fetch from CPU
-            else {
-                cost += root->_count * (_flush_cost[PIM] + _fetch_cost[CPU]);
-            }
+    std::vector<TrieBFSFrame> &stack = _trie_stack;
+    size_t bottom = stack.size();
+    TrieIndex node = rootidx;
+    while (true) {
+        const BBLIDTrieNode *root = &reusetree.getNode(node);
+        // walk along the compressed edge, bblid ends up at root->_cur
+        const BBLID *label = reusetree.getLabel(*root);
+        BBLID bblid = label[0];
+        for (uint32_t i = 1; i < root->_length; i++) {
+            isDifferent = isDifferent || decision[bblid] != decision[label[i]];
+            bblid = label[i];
         }
-    }
-    else {
-        for (auto elem : root->_children) {
+        if (root->_isLeaf) {
+            // The cost of a segment is zero if and only if the entire segment is in the same place. In other words, if isDifferent, then the cost is non-zero.
             if (isDifferent) {
-                TrieBFS(cost, decision, elem.first, elem.second, true);
-            }
-            else if (decision[bblid] != decision[elem.first]) {
-                TrieBFS(cost, decision, elem.first, elem.second, true);
-            }
-            else {
-                TrieBFS(cost, decision, elem.first, elem.second, false);
+                // If the initial W is on CPU and there are subsequent R/W on PIM,
+                // then this segment contributes to a flush of CPU and data fetch from PIM.
+                // We conservatively assume that the fetch will promote data to L1
+                assert(bblid == root->_cur);
+                if (decision[root->_cur] == CPU) {
+                    cost += root->_count * (_flush_cost[CPU] + _fetch_cost[PIM]);
+                }
+                // If the initial W is on PIM and there are subsequent R/W on CPU,
+                // then this segment contributes to a flush of PIM and data fetch from CPU
+                else {
+                    cost += root->_count * (_flush_cost[PIM] + _fetch_cost[CPU]);
+                }
             }
         }
+        else {
+            stack.push_back({root->_children.begin(), root->_children.end(), bblid, isDifferent});
+        }
+
+        // move on to the next child of the deepest node that has one left
+        while (stack.size() > bottom && stack.back().next == stack.back().end) {
+            stack.pop_back();
+        }
+        if (stack.size() == bottom) break;
+        TrieBFSFrame &frame = stack.back();
+        node = frame.next->idx;
+        isDifferent = frame.isDifferent || decision[frame.bblid] != decision[frame.next->key];
+        frame.next++;
     }
 }
 
 // decision here should not be INVALID
-COST CostSolver::ReuseCostPrint(const DECISION &decision, const BBLIDTrieNode *reusetree, std::ostream &ofs)
+COST CostSolver::ReuseCostPrint(const DECISION &decision, const BBLIDDataReuse &reusetree, std::ostream &ofs)
 {
     COST cur_reuse_cost = 0;
-    for (auto elem : reusetree->_children) {
-        TrieBFS(cur_reuse_cost, decision, elem.first, elem.second, false, {0,0} ,ofs);
+    for (auto &elem : reusetree.getNode(reusetree.getRoot())._children) {
+        TrieBFS(cur_reuse_cost, decision, reusetree, elem.idx, false, {0,0} ,ofs);
     }
     return cur_reuse_cost;
 }
 
-void CostSolver::TrieBFS(COST &cost, const DECISION &decision, BBLID bblid, const BBLIDTrieNode *root, bool isDifferent, std::pair<BBLID,BBLID> diffBBLIDs ,std::ostream &ofs)
+void CostSolver::TrieBFS(COST &cost, const DECISION &decision, const BBLIDDataReuse &reusetree, TrieIndex rootidx, bool isDifferent, std::pair<BBLID,BBLID> diffBBLIDs ,std::ostream &ofs)
 {
-    if (root->_isLeaf) {
-        // The cost of a segment is zero if and only if the entire segment is in the same place. In other words, if isDifferent, then the cost is non-zero.
-        if (isDifferent) {
-            // If the initial W is on CPU and there are subsequent R/W on PIM,
-            // then this segment contributes to a flush of CPU and data fetch from PIM.
-            // We conservatively assume that the fetch will promote data to L1
-            assert(bblid == root->_cur);
-            COST delta = 0;
-            if (decision[root->_cur] == CPU) {
-                delta += root->_count * (_flush_cost[CPU] + _fetch_cost[PIM]);
+    // (node, isDifferent, diffBBLIDs), this variant only runs once per report
+    std::vector<std::tuple<TrieIndex, bool, std::pair<BBLID,BBLID>>> stack;
+    stack.push_back(std::make_tuple(rootidx, isDifferent, diffBBLIDs));
+    while (!stack.empty()) {
+        const BBLIDTrieNode *root = &reusetree.getNode(std::get<0>(stack.back()));
+        bool isDifferent = std::get<1>(stack.back());
+        std::pair<BBLID,BBLID> diffBBLIDs = std::get<2>(stack.back());
+        stack.pop_back();
+        // walk along the compressed edge, bblid ends up at root->_cur
+        const BBLID *label = reusetree.getLabel(*root);
+        BBLID bblid = label[0];
+        for (uint32_t i = 1; i < root->_length; i++) {
+            if (!isDifferent && decision[bblid] != decision[label[i]]) {
+                isDifferent = true;
+                diffBBLIDs = {bblid, label[i]};
             }
-            // If the initial W is on PIM and there are subsequent R/W on CPU,
-            // then this segment contributes to a flush of PIM and data fetch from CPU
-            else {
-                delta += root->_count * (_flush_cost[PIM] + _fetch_cost[CPU]);
-            }
-            cost += delta;
-            if(delta > 1e+6)
-                ofs << "cost delta: " << delta 
-                << " diffBBLIDs: " 
-                << std::dec << diffBBLIDs.first 
-                << " to " << diffBBLIDs.second << std::endl;
+            bblid = label[i];
         }
-    }
-    else {
-        for (auto elem : root->_children) {
+        if (root->_isLeaf) {
+            // The cost of a segment is zero if and only if the entire segment is in the same place. In other words, if isDifferent, then the cost is non-zero.
             if (isDifferent) {
-                TrieBFS(cost, decision, elem.first, elem.second, true, diffBBLIDs, ofs);
-            }
-            else if (decision[bblid] != decision[elem.first]) {
-                TrieBFS(cost, decision, elem.first, elem.second, true, {bblid, elem.first}, ofs);
+                // If the initial W is on CPU and there are subsequent R/W on PIM,
+                // then this segment contributes to a flush of CPU and data fetch from PIM.
+                // We conservatively assume that the fetch will promote data to L1
+                assert(bblid == root->_cur);
+                COST delta = 0;
+                if (decision[root->_cur] == CPU) {
+                    delta += root->_count * (_flush_cost[CPU] + _fetch_cost[PIM]);
+                }
+                // If the initial W is on PIM and there are subsequent R/W on CPU,
+                // then this segment contributes to a flush of PIM and data fetch from CPU
+                else {
+                    delta += root->_count * (_flush_cost[PIM] + _fetch_cost[CPU]);
+                }
+                cost += delta;
+                if(delta > 1e+6)
+                    ofs << "cost delta: " << delta 
+                    << " diffBBLIDs: " 
+                    << std::dec << diffBBLIDs.first 
+                    << " to " << diffBBLIDs.second << std::endl;
             }
-            else {
-                TrieBFS(cost, decision, elem.first, elem.second, false, diffBBLIDs, ofs);
+        }
+        else {
+            for (auto it = root->_children.end(); it != root->_children.begin(); ) {
+                --it;
+                if (isDifferent) {
+                    stack.push_back(std::make_tuple(it->idx, true, diffBBLIDs));
+                }
+                else if (decision[bblid] != decision[it->key]) {
+                    stack.push_back(std::make_tuple(it->idx, true, std::make_pair(bblid, it->key)));
+                }
+                else {
+                    stack.push_back(std::make_tuple(it->idx, false, diffBBLIDs));
+                }
             }
         }
     }
@@ -23,6 +23,9 @@
 #include "Common.h"
 #include "Util.h"
 #include "Stats.h"
+#include "ResultCache.h"
+#include "Export.h"
+#include "Phase.h"
 
 namespace PIMProf
 {
@@ -45,14 +48,20 @@ class ThreadRunStats : public RunStats {
         sorted_elapsed_time[tid] = bblstats.elapsed_time;
     }
 
+    ThreadRunStats(const RunStats &bblstats, const std::vector<COST> &elapsed)
+        : RunStats(bblstats), thread_elapsed_time(elapsed), sorted_elapsed_time(elapsed)
+    {
+    }
+
+    // rhs adds to the time of thread tid, a streamed profile has several rows per thread
     ThreadRunStats& MergeStats(int tid, const RunStats &rhs) {
         if (tid >= (int)thread_elapsed_time.size()) {
             thread_elapsed_time.resize(tid + 1, 0);
             sorted_elapsed_time.resize(tid + 1, 0);
         }
         RunStats::MergeStats(rhs);
-        thread_elapsed_time[tid] = rhs.elapsed_time;
-        sorted_elapsed_time[tid] = rhs.elapsed_time;
+        thread_elapsed_time[tid] += rhs.elapsed_time;
+        dirty = true;
         return *this;
     }
 
@@ -79,10 +88,13 @@ class ThreadRunStats : public RunStats {
     }
 
     void SortElapsedTime() {
+        sorted_elapsed_time = thread_elapsed_time;
         std::sort(sorted_elapsed_time.begin(), sorted_elapsed_time.end());
         dirty = false;
     }
 
+    const std::vector<COST> &ThreadElapsedTime() const { return thread_elapsed_time; }
+
     COST ElapsedTime(int tid) {
         assert(tid < (int)thread_elapsed_time.size());
         return thread_elapsed_time[tid];
@@ -160,6 +172,12 @@ class CostSolver {
     };
 
 
+    // the input files a snapshot is validated against
+    enum InputFile {
+        INPUT_CPUSTATS, INPUT_PIMSTATS, INPUT_REUSE, INPUT_CTS, INPUT_SCA,
+        MAX_INPUT_FILE
+    };
+
   private:
     DecisionFromFile scaDecision;
     DecisionFromFile ctsDecision;
@@ -190,6 +208,30 @@ class CostSolver {
     BBLIDDataReuse _bbl_data_reuse;
     SwitchCountList _bbl_switch_count;
 
+  // track epoch level runstats, see ThreadStats::EpochMarker. Epoch e of
+  // every thread is folded into _epochs[e]. A profile with epochs is
+  // never saved as a snapshot.
+  private:
+    struct EpochProfile {
+        UUIDHashMap<ThreadRunStats *> stats[MAX_COST_SITE];
+        std::map<std::pair<BBLID, BBLID>, uint64_t> switchcnt;
+    };
+    std::vector<EpochProfile> _epochs;
+
+  // A streamed profile (see ThreadStats::DumpDelta) numbers BBLs per
+  // thread, the CPU stats map each <tid, number> to the BBL hash.
+  private:
+    std::map<std::pair<int, BBLID>, UUID> _stream_bblhash;
+
+  // track calling context level runstats, see ContextTree. Keyed by the
+  // context hash, the bblhash of each is kept in _context_bblhash.
+  private:
+    UUIDHashMap<ThreadRunStats *> _context_hash2stats[MAX_COST_SITE];
+    UUIDHashMap<UUID> _context_bblhash;
+    UUID _context_hash[MAX_COST_SITE];
+
+  private:
+
     /// the cache flush/fetch cost of each site, in nanoseconds
     COST _flush_cost[MAX_COST_SITE];
     COST _fetch_cost[MAX_COST_SITE];
@@ -203,8 +245,28 @@ class CostSolver {
     int _mpki_threshold;
     int _parallelism_threshold;
 
+    UUID _input_hash[MAX_INPUT_FILE];
+
+    ResultCache _result_cache;
+    UUID _fingerprint;
+    bool _cache_hit = false;
+    // filled by Solve, or by the result cache on a hit
+    CachedSolution _solution;
+
+    // every method that prints an offloading time also records it here
+    std::vector<CostBreakdown> _cost_breakdown;
+
+    // the explicit stack of TrieBFS, kept around to save an allocation per walk
+    struct TrieBFSFrame {
+        const TrieEdge<BBLID> *next, *end; // children left to visit
+        BBLID bblid;
+        bool isDifferent;
+    };
+    std::vector<TrieBFSFrame> _trie_stack;
+
   public:
-    void initialize(CommandLineParser *parser);
+    /// returns false if an input can not be read
+    bool initialize(CommandLineParser *parser);
     ~CostSolver();
 
     inline COST SingleSegMaxReuseCost() {
@@ -215,32 +277,50 @@ class CostSolver {
 
     void ParseDecision(std::istream &ifs);
     void ParseSCADecision(std::istream &ifs);
-    void ParseStats(std::istream &ifs, UUIDHashMap<ThreadRunStats *> &stats);
+    // fill _bbl_hash2stats[site], and _epochs for the epoch sections
+    void ParseStats(std::istream &ifs, CostSite site);
+    // after a streamed profile is parsed, number the BBLs by hash as the profiler would
+    void AssignStreamBBLID();
+    // fill _context_hash2stats[site] from ThreadStats::PrintContextStats
+    void ParseContext(std::istream &ifs, CostSite site);
     void ParseReuse(std::istream &ifs, BBLIDDataReuse &reuse, SwitchCountList &switchcnt);
 
+    // A snapshot holds the ID-aligned solver state right after the inputs are parsed,
+    // LoadSnapshot returns false if the file is missing, corrupted or out of date.
+    void SaveSnapshot(const std::string &filename);
+    bool LoadSnapshot(const std::string &filename);
+
     // const std::vector<ThreadRunStats *>* getFuncSortedStats();
     const std::vector<ThreadRunStats *>* getBBLSortedStats();
 
+    // write the report to out, served from the result cache when possible
     DECISION PrintSolution(std::ostream &out);
 
 
-    COST Cost(const DECISION &decision, const BBLIDTrieNode *reusetree, const SwitchCountList &switchcnt);
+    COST Cost(const DECISION &decision, const BBLIDDataReuse &reusetree, const SwitchCountList &switchcnt);
     COST ElapsedTime(CostSite site); // return CPU/PIM only elapsed time
     std::pair<COST, COST> ElapsedTime(const DECISION &decision); // return execution time pair (cpu_elapsed_time, pim_elapsed_time) for decision
     COST SwitchCost(const DECISION &decision, const SwitchCountList &switchcnt);
     std::vector<BBCOUNT> bbTimesFromSwitchInfo(const DECISION &decision, const SwitchCountList &switchcnt);
-    COST ReuseCost(const DECISION &decision, const BBLIDTrieNode *reusetree);
+    COST ReuseCost(const DECISION &decision, const BBLIDDataReuse &reusetree);
     void TopReuseBBPairs(DECISION &decision);
-    void TrieBFS(COST &cost, const DECISION &decision, BBLID bblid, const BBLIDTrieNode *root, bool isDifferent);
-    COST ReuseCostPrint(const DECISION &decision, const BBLIDTrieNode *reusetree, std::ostream &ofs);
-    void TrieBFS(COST &cost, const DECISION &decision, BBLID bblid, const BBLIDTrieNode *root, bool isDifferent, std::pair<BBLID,BBLID> diffBBLIDs , std::ostream &ofs);
+    void TrieBFS(COST &cost, const DECISION &decision, const BBLIDDataReuse &reusetree, TrieIndex root, bool isDifferent);
+    COST ReuseCostPrint(const DECISION &decision, const BBLIDDataReuse &reusetree, std::ostream &ofs);
+    void TrieBFS(COST &cost, const DECISION &decision, const BBLIDDataReuse &reusetree, TrieIndex root, bool isDifferent, std::pair<BBLID,BBLID> diffBBLIDs , std::ostream &ofs);
 
     void ReadConfig(ConfigReader &reader);
 
     void redecideSCAByCLDM(DECISION &scaPrintDecision);
     std::ostream &PrintDecision(std::ostream &out, const DECISION &decision, const DECISION &scaPrintDecision , bool toscreen);
     // std::ostream &PrintDecisionStat(std::ostream &out, const DECISION &decision, const std::string &name);
-    // std::ostream &PrintCostBreakdown(std::ostream &out, const DECISION &decision, const std::string &name);
+    void PrintSingleSiteTime(std::ostream &ofs);
+    void PrintCostBreakdown(std::ostream &ofs, const std::string &method, COST total_time,
+        std::pair<COST, COST> elapsed_time, COST reuse_cost, COST switch_cost);
+    void BuildExportRecords(const DECISION &decision, const DECISION &ctsPrintDecision);
+    void BuildDecisionTable(const DECISION &decision);
+    // write the export and the decision table from _solution
+    void ExportSolution();
+    void WriteDecisionTable();
     // std::ostream &PrintAnalytics(std::ostream &out);
 
     void PrintStats(std::ostream &ofs);
@@ -252,7 +332,11 @@ class CostSolver {
     void BBL2Func(SwitchCountList &bbl, SwitchCountList &func);
 
   private:
-    COST PermuteDecision(DECISION &decision, const std::vector<BBLID> &cur_batch, const BBLIDTrieNode *partial_root);
+    // the effective parameters and input hashes the result cache is keyed on
+    std::string RunDescription();
+    DECISION Solve(std::ostream &ofs);
+
+    COST PermuteDecision(DECISION &decision, const std::vector<BBLID> &cur_batch, const BBLIDDataReuse &partial_trie);
 
     DECISION PrintMPKIStats(std::ostream &ofs);
     DECISION PrintSCAStatsFromfile(DecisionFromFile decision, std::ostream &ofs);
@@ -260,6 +344,9 @@ class CostSolver {
     CostSolver::bestSCAResult PrintSCAStats(int sca_mpki_threshold, int sca_parallelism_threshold, float instr_threshold_percentage);
     DECISION PrintReuseStats(std::ostream &ofs);
     DECISION PrintGreedyStats(std::ostream &ofs);
+    void PrintPhaseStats(std::ostream &ofs);
+    void PrintContextStats(std::ostream &ofs);
+    void PrintNoiseStats(std::ostream &ofs, const DECISION &decision);
     void PrintDisjointSets(std::ostream &ofs);
     DECISION Debug_StartFromUnimportantSegment(std::ostream &ofs);
     DECISION Debug_ConsiderSwitchCost(std::ostream &ofs);
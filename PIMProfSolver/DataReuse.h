@@ -19,7 +19,11 @@
 #include <list>
 #include <set>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <algorithm>
+#include <iterator>
 #include <unordered_map>
 #include <cassert>
 
@@ -33,21 +37,33 @@ namespace PIMProf
 template <class Ty>
 class SwitchCountMatrix
 {
+    template <class Tz> friend class SwitchCountMatrix;
+
 private:
-    std::unordered_map<Ty, uint64_t> _elem2idx;
+    struct SwitchCountEntry {
+        uint32_t toidx;
+        uint64_t count;
+    };
+
+    // the counts of one row, sorted by toidx
+    struct SwitchCountRow {
+        std::vector<SwitchCountEntry> entries;
+        uint32_t last = 0; // the entry hit last, checked before searching
+    };
+
+    std::unordered_map<Ty, uint32_t> _elem2idx;
     std::vector<Ty> _idx2elem;
-    std::vector<uint64_t> _total_count;
-    std::vector<std::vector<uint64_t>> _count;
+    std::vector<SwitchCountRow> _rows;
+
+    // the element looked up last, the "to" of one insert is usually the "from" of the next
+    Ty _last_elem = Ty();
+    uint32_t _last_idx = UINT32_MAX;
+
+    // bumped whenever a counter is created, which may move the others
+    uint64_t _version = 0;
 
 public:
-    inline void createElem(const Ty elem)
-    {
-        auto it = _elem2idx.find(elem);
-        if (it == _elem2idx.end()) {
-            _idx2elem.push_back(elem);
-            _elem2idx.insert(std::make_pair(elem, _idx2elem.size() - 1));
-        }
-    }
+    inline void createElem(const Ty elem) { findOrCreate(elem); }
 
     inline size_t getIdx(const Ty elem)
     {
@@ -64,29 +80,72 @@ public:
 
     inline void insert(Ty from, Ty to, uint64_t count=1)
     {
-        createElem(from);
-        createElem(to);
-        size_t fromidx = getIdx(from);
-        size_t toidx = getIdx(to);
-        if(_count.size() <= fromidx) {
-            _count.resize(fromidx + 1);
-            _total_count.resize(fromidx + 1, 0);
+        *getCounter(from, to) += count;
+    }
+
+    // The counter of from -> to, created at 0 if there is none. The pointer
+    // stays valid as long as getVersion() returns the same value.
+    inline uint64_t *getCounter(Ty from, Ty to)
+    {
+        uint32_t fromidx = findOrCreate(from);
+        uint32_t toidx = findOrCreate(to);
+        return &getCounter(_rows[fromidx], toidx);
+    }
+    inline uint64_t getVersion() const { return _version; }
+
+    // add every count of rhs, with each element mapped through convert
+    template <class Tz, class Convert>
+    void Merge(const SwitchCountMatrix<Tz> &rhs, Convert convert)
+    {
+        for (size_t fromidx = 0; fromidx < rhs._rows.size(); ++fromidx) {
+            for (auto &entry : rhs._rows[fromidx].entries) {
+                insert(convert(rhs._idx2elem[fromidx]), convert(rhs._idx2elem[entry.toidx]), entry.count);
+            }
         }
-        if (_count[fromidx].size() <= toidx) {
-            _count[fromidx].resize(toidx + 1, 0);
+    }
+
+    // Rows are indexed by get_id of the "from" element, and the entries of
+    // a row are sorted by get_id of "to". This is the layout the solver
+    // keeps its SwitchCountList in, see CostSolver::SaveSnapshot.
+    // Elements with the same id have their counts added up.
+    void ExportCSR(std::vector<uint64_t> &row_offset, std::vector<std::pair<int64_t, uint64_t>> &row_elems,
+        BBLID (*get_id)(Ty))
+    {
+        std::vector<std::pair<std::pair<BBLID, BBLID>, uint64_t>> triples;
+        for (size_t fromidx = 0; fromidx < _rows.size(); ++fromidx) {
+            BBLID from = get_id(_idx2elem[fromidx]);
+            for (auto &entry : _rows[fromidx].entries) {
+                triples.push_back(std::make_pair(std::make_pair(from, get_id(_idx2elem[entry.toidx])), entry.count));
+            }
+        }
+        std::sort(triples.begin(), triples.end());
+        row_offset.assign(1, 0);
+        row_elems.clear();
+        for (auto &it : triples) {
+            BBLID from = it.first.first;
+            assert(from >= 0);
+            if (!row_elems.empty() && (BBLID)row_offset.size() == from + 2
+                && row_elems.back().first == it.first.second) {
+                row_elems.back().second += it.second;
+                continue;
+            }
+            // close the rows before from
+            while ((BBLID)row_offset.size() <= from + 1) {
+                row_offset.push_back(row_elems.size());
+            }
+            row_elems.push_back(std::make_pair((int64_t)it.first.second, it.second));
+            row_offset.back() = row_elems.size();
         }
-        _count[fromidx][toidx] += count;
-        _total_count[fromidx] += count;
     }
 
     std::ostream &print(std::ostream &out, BBLID (*get_id)(Ty))
     {
-        for (size_t fromidx = 0; fromidx < _count.size(); ++fromidx) {
-            if (_total_count[fromidx] > 0) {
+        for (size_t fromidx = 0; fromidx < _rows.size(); ++fromidx) {
+            if (!_rows[fromidx].entries.empty()) {
                 out << "from = " << get_id(getElem(fromidx)) << " | ";
-                for (size_t toidx = 0; toidx < _count[fromidx].size(); ++toidx) {
-                    if (_count[fromidx][toidx] > 0) {
-                        out << get_id(getElem(toidx)) << ":" << _count[fromidx][toidx] << " ";
+                for (auto &entry : _rows[fromidx].entries) {
+                    if (entry.count > 0) {
+                        out << get_id(getElem(entry.toidx)) << ":" << entry.count << " ";
                     }
                 }
                 out << std::endl;
@@ -94,6 +153,37 @@ public:
         }
         return out;
     }
+
+private:
+    inline uint32_t findOrCreate(const Ty elem)
+    {
+        if (_last_idx != UINT32_MAX && elem == _last_elem)
+            return _last_idx;
+        auto it = _elem2idx.find(elem);
+        if (it == _elem2idx.end()) {
+            it = _elem2idx.insert(std::make_pair(elem, (uint32_t)_idx2elem.size())).first;
+            _idx2elem.push_back(elem);
+            _rows.emplace_back();
+        }
+        _last_elem = elem;
+        _last_idx = it->second;
+        return _last_idx;
+    }
+
+    inline uint64_t &getCounter(SwitchCountRow &row, uint32_t toidx)
+    {
+        std::vector<SwitchCountEntry> &entries = row.entries;
+        if (row.last < entries.size() && entries[row.last].toidx == toidx)
+            return entries[row.last].count;
+        auto pos = std::lower_bound(entries.begin(), entries.end(), toidx,
+            [](const SwitchCountEntry &entry, uint32_t idx) { return entry.toidx < idx; });
+        if (pos == entries.end() || pos->toidx != toidx) {
+            pos = entries.insert(pos, SwitchCountEntry{toidx, 0});
+            _version++;
+        }
+        row.last = pos - entries.begin();
+        return pos->count;
+    }
 };
 
 class SwitchCountList{
@@ -165,6 +255,20 @@ public:
         _count[fromidx] = SwitchCountRow(fromidx, toidxvec);
     }
 
+    // insert the rows of counts, which is keyed by <fromidx, toidx>
+    void RowInsert(const std::map<std::pair<BBLID, BBLID>, uint64_t> &counts)
+    {
+        std::vector<std::pair<int64_t, uint64_t>> toidxvec;
+        for (auto it = counts.begin(); it != counts.end(); ++it) {
+            toidxvec.push_back(std::make_pair(it->first.second, it->second));
+            auto next = std::next(it);
+            if (next == counts.end() || next->first.first != it->first.first) {
+                RowInsert(it->first.first, toidxvec);
+                toidxvec.clear();
+            }
+        }
+    }
+
     void Sort() {
         for (auto &row : _count) {
             row.Sort();
@@ -207,6 +311,122 @@ public:
 };
 
 
+/* ===================================================================== */
+/* SmallFlatSet */
+/* ===================================================================== */
+/// Sorted array set of fundamental types or pointers. Up to N elements are
+/// stored inline, beyond that the array moves to the heap. clear() keeps the
+/// capacity, so a set that is cleared and refilled does not allocate again.
+template <class Ty, uint32_t N>
+class SmallFlatSet
+{
+private:
+    uint32_t _size;
+    uint32_t _capacity;
+    union {
+        Ty _inline[N];
+        Ty *_heap;
+    };
+
+public:
+    SmallFlatSet() : _size(0), _capacity(N) {}
+    ~SmallFlatSet() { if (_capacity > N) delete[] _heap; }
+
+    SmallFlatSet(const SmallFlatSet &rhs) : _size(0), _capacity(N)
+    {
+        reserve(rhs._size);
+        std::copy(rhs.begin(), rhs.end(), data());
+        _size = rhs._size;
+    }
+
+    SmallFlatSet &operator=(const SmallFlatSet &rhs)
+    {
+        if (this != &rhs) {
+            reserve(rhs._size);
+            std::copy(rhs.begin(), rhs.end(), data());
+            _size = rhs._size;
+        }
+        return *this;
+    }
+
+    // a heap array changes owner, rhs is left empty
+    SmallFlatSet(SmallFlatSet &&rhs) : _size(0), _capacity(N) { steal(rhs); }
+
+    SmallFlatSet &operator=(SmallFlatSet &&rhs)
+    {
+        if (this != &rhs) {
+            if (_capacity > N) delete[] _heap;
+            _capacity = N;
+            steal(rhs);
+        }
+        return *this;
+    }
+
+    inline uint32_t size() const { return _size; }
+    inline bool empty() const { return _size == 0; }
+    inline const Ty *begin() const { return data(); }
+    inline const Ty *end() const { return data() + _size; }
+    inline void clear() { _size = 0; }
+
+    // returns false if elem is already in the set
+    inline bool insert(Ty elem)
+    {
+        Ty *first = data();
+        Ty *pos = std::lower_bound(first, first + _size, elem, std::less<Ty>());
+        if (pos != first + _size && *pos == elem) return false;
+        if (_size == _capacity) {
+            size_t offset = pos - first;
+            reserve(_capacity * 2);
+            first = data();
+            pos = first + offset;
+        }
+        std::move_backward(pos, first + _size, first + _size + 1);
+        *pos = elem;
+        _size++;
+        return true;
+    }
+
+    template <class InputIt>
+    void insert(InputIt first, InputIt last)
+    {
+        for (; first != last; ++first) insert(*first);
+    }
+
+    inline bool operator==(const SmallFlatSet &rhs) const
+    {
+        return _size == rhs._size && std::equal(begin(), end(), rhs.begin());
+    }
+
+private:
+    inline Ty *data() { return _capacity > N ? _heap : _inline; }
+
+    // expects this to be empty and inline
+    inline void steal(SmallFlatSet &rhs)
+    {
+        if (rhs._capacity > N) {
+            _heap = rhs._heap;
+            _capacity = rhs._capacity;
+            rhs._capacity = N;
+        }
+        else {
+            std::copy(rhs._inline, rhs._inline + rhs._size, _inline);
+        }
+        _size = rhs._size;
+        rhs._size = 0;
+    }
+    inline const Ty *data() const { return _capacity > N ? _heap : _inline; }
+
+    void reserve(uint32_t capacity)
+    {
+        if (capacity <= _capacity) return;
+        Ty *heap = new Ty[capacity];
+        std::copy(begin(), end(), heap);
+        if (_capacity > N) delete[] _heap;
+        _heap = heap;
+        _capacity = capacity;
+    }
+};
+
 /* ===================================================================== */
 /* DataReuseSegment */
 /* ===================================================================== */
@@ -217,13 +437,19 @@ class DataReuseSegment
 {
     template <class Tz> friend class DataReuse;
 
+public:
+    // segments rarely have more BBLs than this
+    static const uint32_t InlineCapacity = 12;
+    typedef SmallFlatSet<Ty, InlineCapacity> SetType;
+
 private:
     Ty _head;
-    std::set<Ty> _set;
+    SetType _set;
     uint64_t _count;
 
 public:
     inline DataReuseSegment() {
+        _head = Ty();
         _count = 1;
     }
 
@@ -257,8 +483,8 @@ public:
         _count = 1;
     }
 
-    inline typename std::set<Ty>::iterator begin() { return _set.begin(); }
-    inline typename std::set<Ty>::iterator end() { return _set.end(); }
+    inline const Ty *begin() const { return _set.begin(); }
+    inline const Ty *end() const { return _set.end(); }
     inline void setHead(Ty head) { _head = head; }
     inline Ty getHead() const { return _head; }
     inline void setCount(uint64_t count) { _count = count; }
@@ -297,29 +523,467 @@ public:
     }
 };
 
+/* ===================================================================== */
+/* TagSegmentTable */
+/* ===================================================================== */
+// the finalizer of MurmurHash3, neighbouring cache lines get unrelated hashes
+inline uint64_t MixTag(uint64_t tag)
+{
+    tag ^= tag >> 33;
+    tag *= 0xff51afd7ed558ccdULL;
+    tag ^= tag >> 33;
+    tag *= 0xc4ceb9fe1a85ec53ULL;
+    tag ^= tag >> 33;
+    return tag;
+}
+
+// The open segment of every tracked cache line, keyed by its tag.
+// Segments live in the slots of a linear probing table, erase shifts the
+// rest of the probe run back instead of leaving tombstones, and the table
+// shrinks again when most lines have been erased.
+template <class Ty>
+class TagSegmentTable
+{
+public:
+    static const uint64_t EmptyTag = UINT64_MAX;
+
+private:
+    static const size_t MinCapacity = 1 << 10;
+
+    struct Slot {
+        uint64_t tag = EmptyTag;
+        DataReuseSegment<Ty> seg;
+    };
+
+    std::vector<Slot> _slots;
+    size_t _mask;
+    size_t _size;
+
+public:
+    TagSegmentTable() : _slots(MinCapacity), _mask(MinCapacity - 1), _size(0) {}
+
+    inline size_t size() const { return _size; }
+    inline size_t capacity() const { return _slots.size(); }
+
+    // returns NULL if tag has no segment
+    DataReuseSegment<Ty> *find(uint64_t tag)
+    {
+        for (size_t i = MixTag(tag) & _mask; ; i = (i + 1) & _mask) {
+            if (_slots[i].tag == tag) return &_slots[i].seg;
+            if (_slots[i].tag == EmptyTag) return NULL;
+        }
+    }
+
+    // returns the segment of tag, an empty one is created if there is none,
+    // the pointer is valid until the next insert or erase
+    DataReuseSegment<Ty> *insert(uint64_t tag)
+    {
+        assert(tag != EmptyTag);
+        if ((_size + 1) * 4 > _slots.size() * 3) {
+            Rehash(_slots.size() * 2);
+        }
+        size_t i = MixTag(tag) & _mask;
+        for (; _slots[i].tag != EmptyTag; i = (i + 1) & _mask) {
+            if (_slots[i].tag == tag) return &_slots[i].seg;
+        }
+        _slots[i].tag = tag;
+        _size++;
+        return &_slots[i].seg;
+    }
+
+    // returns false if tag has no segment
+    bool erase(uint64_t tag)
+    {
+        size_t i = MixTag(tag) & _mask;
+        for (; _slots[i].tag != tag; i = (i + 1) & _mask) {
+            if (_slots[i].tag == EmptyTag) return false;
+        }
+        // move every later entry of the run whose home is not in (i, j] into the hole
+        for (size_t j = (i + 1) & _mask; _slots[j].tag != EmptyTag; j = (j + 1) & _mask) {
+            size_t home = MixTag(_slots[j].tag) & _mask;
+            if (((j - home) & _mask) >= ((j - i) & _mask)) {
+                _slots[i] = std::move(_slots[j]);
+                i = j;
+            }
+        }
+        _slots[i].tag = EmptyTag;
+        _slots[i].seg = DataReuseSegment<Ty>();
+        _size--;
+        if (_slots.size() > MinCapacity && _size * 8 < _slots.size()) {
+            Rehash(_slots.size() / 2);
+        }
+        return true;
+    }
+
+private:
+    void Rehash(size_t capacity)
+    {
+        std::vector<Slot> slots(capacity);
+        size_t mask = capacity - 1;
+        for (auto &slot : _slots) {
+            if (slot.tag == EmptyTag) continue;
+            size_t i = MixTag(slot.tag) & mask;
+            while (slots[i].tag != EmptyTag) i = (i + 1) & mask;
+            slots[i] = std::move(slot);
+        }
+        _slots.swap(slots);
+        _mask = mask;
+    }
+};
+
 /* ===================================================================== */
 /* TrieNode */
 /* ===================================================================== */
+// nodes of a trie are addressed by their index in the arena of its DataReuse
+typedef uint32_t TrieIndex;
+const TrieIndex TrieNull = UINT32_MAX;
+
+template <class Ty>
+struct TrieEdge
+{
+    Ty key;
+    TrieIndex idx;
+};
+
+/// Bump allocator for the out-of-line child arrays of a trie. Arrays have
+/// power-of-two capacities and the ones outgrown by a node are kept on a
+/// free list of their size class for the next node that grows.
+template <class Elem>
+class TriePool
+{
+private:
+    static const uint32_t ChunkSize = 1 << 14;
+    static const int MaxSizeClass = 32;
+
+    std::vector<std::unique_ptr<Elem[]>> _chunks;
+    std::vector<std::unique_ptr<Elem[]>> _large; // arrays that do not fit in a chunk
+    uint32_t _used;
+    std::vector<Elem *> _free[MaxSizeClass];
+
+public:
+    TriePool() : _used(ChunkSize) {}
+
+    Elem *allocate(uint32_t capacity)
+    {
+        int sizeclass = Log2(capacity);
+        if (!_free[sizeclass].empty()) {
+            Elem *ptr = _free[sizeclass].back();
+            _free[sizeclass].pop_back();
+            return ptr;
+        }
+        if (capacity > ChunkSize) {
+            _large.emplace_back(new Elem[capacity]);
+            return _large.back().get();
+        }
+        if (_used + capacity > ChunkSize) {
+            _chunks.emplace_back(new Elem[ChunkSize]);
+            _used = 0;
+        }
+        Elem *ptr = _chunks.back().get() + _used;
+        _used += capacity;
+        return ptr;
+    }
+
+    inline void release(Elem *ptr, uint32_t capacity)
+    {
+        _free[Log2(capacity)].push_back(ptr);
+    }
+
+    void clear()
+    {
+        _chunks.clear();
+        _large.clear();
+        _used = ChunkSize;
+        for (auto &list : _free) list.clear();
+    }
+
+private:
+    static inline int Log2(uint32_t capacity)
+    {
+        assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+        return __builtin_ctz(capacity);
+    }
+};
+
+/// Children of a trie node, sorted by key. Most nodes have one or two
+/// children, which are stored inline. Larger fan-outs move to a sorted array
+/// in the pool, and past HashThreshold children an open addressing table is
+/// added on top of the array for lookup. Iteration always walks the sorted
+/// array, so the order is the same as that of a std::map.
+template <class Ty>
+class TrieChildren
+{
+private:
+    static const uint32_t InlineCapacity = 2;
+    static const uint32_t HashThreshold = 32;
+
+    struct Heap {
+        TrieEdge<Ty> *edges;
+        TrieEdge<Ty> *table; // nullptr until the size exceeds HashThreshold
+        uint32_t table_size;
+    };
+
+    uint32_t _size;
+    uint32_t _capacity; // 0 while the children are inline
+    union {
+        TrieEdge<Ty> _inline[InlineCapacity];
+        Heap _heap;
+    };
+
+public:
+    TrieChildren() : _size(0), _capacity(0) {}
+
+    inline uint32_t size() const { return _size; }
+    inline bool empty() const { return _size == 0; }
+    inline const TrieEdge<Ty> *begin() const { return _capacity == 0 ? _inline : _heap.edges; }
+    inline const TrieEdge<Ty> *end() const { return begin() + _size; }
+
+    // point an existing key to another child
+    void assign(Ty key, TrieIndex idx)
+    {
+        TrieEdge<Ty> *edges = (_capacity == 0 ? _inline : _heap.edges);
+        TrieEdge<Ty> *pos = edges + (LowerBound(key) - begin());
+        assert(pos != edges + _size && pos->key == key);
+        pos->idx = idx;
+        if (_capacity == 0 || _heap.table == nullptr) return;
+        uint32_t mask = _heap.table_size - 1;
+        uint32_t slot = Hash(key) & mask;
+        while (_heap.table[slot].key != key) {
+            slot = (slot + 1) & mask;
+        }
+        _heap.table[slot].idx = idx;
+    }
+
+    // returns TrieNull if there is no child with this key
+    TrieIndex find(Ty key) const
+    {
+        if (_capacity == 0) {
+            for (uint32_t i = 0; i < _size; i++) {
+                if (_inline[i].key == key) return _inline[i].idx;
+            }
+            return TrieNull;
+        }
+        if (_heap.table != nullptr) {
+            uint32_t mask = _heap.table_size - 1;
+            for (uint32_t slot = Hash(key) & mask; ; slot = (slot + 1) & mask) {
+                const TrieEdge<Ty> &edge = _heap.table[slot];
+                if (edge.idx == TrieNull) return TrieNull;
+                if (edge.key == key) return edge.idx;
+            }
+        }
+        const TrieEdge<Ty> *it = LowerBound(key);
+        return (it != end() && it->key == key ? it->idx : TrieNull);
+    }
+
+    // the key must not be present yet
+    void insert(Ty key, TrieIndex idx, TriePool<TrieEdge<Ty>> &pool)
+    {
+        if (_size == (_capacity == 0 ? InlineCapacity : _capacity)) {
+            Grow(pool);
+        }
+        TrieEdge<Ty> *edges = (_capacity == 0 ? _inline : _heap.edges);
+        TrieEdge<Ty> *pos = edges + (LowerBound(key) - begin());
+        std::move_backward(pos, edges + _size, edges + _size + 1);
+        pos->key = key;
+        pos->idx = idx;
+        _size++;
+
+        if (_capacity == 0) return;
+        if (_heap.table != nullptr && _size * 2 <= _heap.table_size) {
+            TableInsert(_heap.table, _heap.table_size, key, idx);
+        }
+        else if (_size > HashThreshold) {
+            Rehash(pool);
+        }
+    }
+
+private:
+    static inline uint32_t Hash(Ty key)
+    {
+        return (uint32_t)((std::hash<Ty>()(key) * 0x9e3779b97f4a7c15ULL) >> 32);
+    }
+
+    inline const TrieEdge<Ty> *LowerBound(Ty key) const
+    {
+        return std::lower_bound(begin(), end(), key,
+            [] (const TrieEdge<Ty> &edge, Ty key) { return std::less<Ty>()(edge.key, key); });
+    }
+
+    static inline void TableInsert(TrieEdge<Ty> *table, uint32_t table_size, Ty key, TrieIndex idx)
+    {
+        uint32_t mask = table_size - 1;
+        uint32_t slot = Hash(key) & mask;
+        while (table[slot].idx != TrieNull) {
+            slot = (slot + 1) & mask;
+        }
+        table[slot].key = key;
+        table[slot].idx = idx;
+    }
+
+    void Grow(TriePool<TrieEdge<Ty>> &pool)
+    {
+        uint32_t capacity = (_capacity == 0 ? InlineCapacity * 2 : _capacity * 2);
+        TrieEdge<Ty> *edges = pool.allocate(capacity);
+        std::copy(begin(), end(), edges);
+        if (_capacity == 0) {
+            _heap.table = nullptr;
+            _heap.table_size = 0;
+        }
+        else {
+            pool.release(_heap.edges, _capacity);
+        }
+        _heap.edges = edges;
+        _capacity = capacity;
+    }
+
+    // keep the table at most half full
+    void Rehash(TriePool<TrieEdge<Ty>> &pool)
+    {
+        uint32_t table_size = _capacity * 2;
+        while (table_size < _size * 2) table_size *= 2;
+        TrieEdge<Ty> *table = pool.allocate(table_size);
+        for (uint32_t i = 0; i < table_size; i++) {
+            table[i].idx = TrieNull;
+        }
+        for (const TrieEdge<Ty> &edge : *this) {
+            TableInsert(table, table_size, edge.key, edge.idx);
+        }
+        if (_heap.table != nullptr) {
+            pool.release(_heap.table, _heap.table_size);
+        }
+        _heap.table = table;
+        _heap.table_size = table_size;
+    }
+};
+
 template <class Ty>
 class TrieNode
 {
 public:
-    // the leaf node stores the head of the segment
-    bool _isLeaf;
-    std::map<Ty, TrieNode *> _children;
+    // the last element of the label, the leaf node stores the head of the segment
     Ty _cur;
-    TrieNode *_parent;
     uint64_t _count;
+    TrieIndex _parent;
+    // the edge from the parent is labeled with _length elements
+    // of the label pool of the trie, starting at _label
+    uint32_t _label;
+    uint32_t _length;
+    bool _isLeaf;
+    TrieChildren<Ty> _children;
 
 public:
     inline TrieNode()
     {
         _isLeaf = false;
-        _parent = NULL;
+        _cur = Ty();
+        _parent = TrieNull;
+        _label = 0;
+        _length = 0;
         _count = 0;
     }
 };
 
+/* ===================================================================== */
+/* TrieArena */
+/* ===================================================================== */
+/// Bump allocator for trie nodes. Nodes are carved out of fixed-size slabs,
+/// so a node never moves once allocated and references to it stay valid
+/// while the trie grows. There is no per-node free, the whole arena is
+/// released at once.
+template <class Node>
+class TrieArena
+{
+private:
+    static const uint32_t SlabBits = 14;
+    static const uint32_t SlabSize = 1 << SlabBits;
+
+    std::vector<std::unique_ptr<Node[]>> _slabs;
+    uint32_t _size;
+
+public:
+    TrieArena() : _size(0) {}
+
+    inline uint32_t size() const { return _size; }
+
+    inline TrieIndex allocate()
+    {
+        assert(_size != TrieNull);
+        if ((_size >> SlabBits) == _slabs.size()) {
+            _slabs.emplace_back(new Node[SlabSize]);
+        }
+        return _size++;
+    }
+
+    inline Node &operator[](TrieIndex idx)
+    {
+        assert(idx < _size);
+        return _slabs[idx >> SlabBits][idx & (SlabSize - 1)];
+    }
+
+    inline const Node &operator[](TrieIndex idx) const
+    {
+        assert(idx < _size);
+        return _slabs[idx >> SlabBits][idx & (SlabSize - 1)];
+    }
+
+    inline void clear()
+    {
+        _slabs.clear();
+        _size = 0;
+    }
+};
+
+/* ===================================================================== */
+/* CountMinSketch */
+/* ===================================================================== */
+/// Approximate counts of 64-bit keys in depth rows of width counters. The
+/// estimate never undercounts. Conservative update only raises the counters
+/// that hold the current minimum, which keeps the overcount of rare keys low.
+class CountMinSketch
+{
+private:
+    uint32_t _width;
+    uint32_t _depth;
+    std::vector<uint64_t> _counters;
+
+public:
+    CountMinSketch() : _width(0), _depth(0) {}
+
+    // width is rounded up to a power of two
+    void initialize(uint32_t width, uint32_t depth)
+    {
+        _width = 1;
+        while (_width < width) _width <<= 1;
+        _depth = depth;
+        _counters.assign((size_t)_width * _depth, 0);
+    }
+
+    inline bool empty() const { return _counters.empty(); }
+
+    // add count to key and return the new estimate
+    uint64_t add(uint64_t key, uint64_t count)
+    {
+        uint64_t estimate = UINT64_MAX;
+        for (uint32_t row = 0; row < _depth; row++) {
+            estimate = std::min(estimate, _counters[slot(key, row)]);
+        }
+        uint64_t target = estimate + count;
+        for (uint32_t row = 0; row < _depth; row++) {
+            uint64_t &counter = _counters[slot(key, row)];
+            if (counter < target) counter = target;
+        }
+        return target;
+    }
+
+private:
+    // double hashing on the two halves of the key
+    inline size_t slot(uint64_t key, uint32_t row) const
+    {
+        uint32_t h1 = key, h2 = (key >> 32) | 1;
+        return (size_t)row * _width + ((h1 + row * h2) & (_width - 1));
+    }
+};
+
 /* ===================================================================== */
 /* DataReuse */
 /* ===================================================================== */
@@ -336,86 +1000,351 @@ public:
 /// then this segment contributes to a flush of PIM and data fetch from CPU;
 /// If the initial W is on CPU and there are subsequent R/W on PIM,
 /// then this segment contributes to a flush of CPU and data fetch from PIM.
+
+/// A segment is stored as the path of its sorted elements followed by its
+/// head, the leaf node holds the count. The trie is path-compressed: a chain
+/// of single-child nodes is a single node whose edge label is a range of the
+/// label pool shared by the whole trie, so inserting a segment creates at
+/// most two nodes and splitting an edge copies no labels.
+
+/// All nodes of the trie live in the arena of the DataReuse that owns it.
+/// The root is node 0 and has an empty label.
+
+/// In bounded mode a segment that is not in the trie yet is only counted in
+/// a CountMinSketch, and enters the trie once its estimated count reaches the
+/// admission threshold. Until then its counts go to the residual, so the trie
+/// only grows with frequent segments and no count is lost in aggregate.
 template <class Ty>
 class DataReuse
 {
 private:
-    TrieNode<Ty> *_root;
-    std::vector<TrieNode<Ty> *> _leaves;
+    TrieArena<TrieNode<Ty>> _nodes;
+    TriePool<TrieEdge<Ty>> _edges;
+    std::vector<Ty> _labels;
+    std::vector<TrieIndex> _leaves;
+    std::vector<Ty> _path; // scratch space for UpdateTrie
+
+    // bounded mode, off while the sketch is empty
+    CountMinSketch _sketch;
+    uint64_t _admission_threshold;
+    uint64_t _residual_count;
+    uint64_t _residual_segments;
+
+    // the fraction of cache lines the profiler tracked, the counts are already scaled by its inverse
+    double _sample_rate;
 
 public:
-    DataReuse() { _root = new TrieNode<Ty>(); }
-    ~DataReuse() { DeleteTrie(_root); }
-    inline TrieNode<Ty> *getRoot() { return _root; }
-    inline std::vector<TrieNode<Ty> *> &getLeaves() { return _leaves; }
+    DataReuse() : _admission_threshold(0), _residual_count(0), _residual_segments(0), _sample_rate(1) { _nodes.allocate(); }
+    inline TrieIndex getRoot() const { return 0; }
+    inline std::vector<TrieIndex> &getLeaves() { return _leaves; }
+    inline TrieNode<Ty> &getNode(TrieIndex idx) { return _nodes[idx]; }
+    inline const TrieNode<Ty> &getNode(TrieIndex idx) const { return _nodes[idx]; }
+    // the label of a node has node._length elements
+    inline const Ty *getLabel(const TrieNode<Ty> &node) const { return _labels.data() + node._label; }
+    inline uint32_t size() const { return _nodes.size(); }
+
+    // Enable bounded mode. The sketch takes width * depth * 8 bytes.
+    void setBounded(uint64_t threshold, uint32_t width = 1 << 16, uint32_t depth = 4)
+    {
+        assert(threshold > 0 && width > 0 && depth > 0);
+        _admission_threshold = threshold;
+        _sketch.initialize(width, depth);
+    }
+    inline bool isBounded() const { return !_sketch.empty(); }
+
+    // total count and number of segment occurrences kept out of the trie
+    inline uint64_t getResidualCount() const { return _residual_count; }
+    inline uint64_t getResidualSegments() const { return _residual_segments; }
+    inline void addResidual(uint64_t count, uint64_t segments)
+    {
+        _residual_count += count;
+        _residual_segments += segments;
+    }
+    inline void clearResidual()
+    {
+        _residual_count = 0;
+        _residual_segments = 0;
+    }
+
+    inline double getSampleRate() const { return _sample_rate; }
+    inline void setSampleRate(double rate) { _sample_rate = rate; }
 
 public:
-    void UpdateTrie(TrieNode<Ty> *root, const DataReuseSegment<Ty> *seg)
+    void UpdateTrie(TrieIndex root, const DataReuseSegment<Ty> *seg)
     {
         // A reuse chain segment of size 1 can be removed
         if (seg->size() <= 1)
             return;
 
-        // seg->print(std::cout);
-        // #if TSJ > 0
-        // std::cerr << "[TSJ-DEBUG]:UpdateTrie seg->_set.size()" << seg->_set.size() << std::endl;
-        // #endif
-        TrieNode<Ty> *curNode = root;
-        for (auto cur : seg->_set)
+        _path.assign(seg->_set.begin(), seg->_set.end());
+        _path.push_back(seg->_head);
+        if (isBounded() && FindPath(root, _path.data(), _path.size()) == TrieNull)
         {
-            TrieNode<Ty> *temp = curNode->_children[cur];
-            if (temp == NULL)
+            uint64_t estimate = _sketch.add(HashPath(_path.data(), _path.size()), seg->getCount());
+            if (estimate < _admission_threshold)
             {
-                temp = new TrieNode<Ty>();
-                temp->_parent = curNode;
-                temp->_cur = cur;
-                curNode->_children[cur] = temp;
+                addResidual(seg->getCount(), 1);
+                return;
             }
-            curNode = temp;
         }
-        TrieNode<Ty> *temp = curNode->_children[seg->_head];
-        if (temp == NULL)
+        bool created;
+        TrieIndex leaf = InsertPath(root, _path.data(), _path.size(), created);
+        if (created)
         {
-            temp = new TrieNode<Ty>();
-            temp->_parent = curNode;
-            temp->_cur = seg->_head;
-            curNode->_children[seg->_head] = temp;
-            _leaves.push_back(temp);
+            _leaves.push_back(leaf);
         }
-        temp->_isLeaf = true;
-        assert(temp->_count + seg->getCount() >= temp->_count); // detect overflow
-        temp->_count += seg->getCount();
+        TrieNode<Ty> &temp = _nodes[leaf];
+        temp._isLeaf = true;
+        assert(temp._count + seg->getCount() >= temp._count); // detect overflow
+        temp._count += seg->getCount();
     }
 
-    void DeleteTrie(TrieNode<Ty> *root)
+    // Add every segment of rhs, with each element mapped through convert
+    // and each count multiplied by scale
+    template <class Tz, class Convert>
+    void Merge(DataReuse<Tz> &rhs, Convert convert, double scale = 1)
     {
-        if (!root->_isLeaf)
+        for (TrieIndex leaf : rhs.getLeaves())
         {
-            for (auto it : root->_children)
-            {
-                DeleteTrie(it.second);
+            DataReuseSegment<Tz> from;
+            rhs.ExportSegment(&from, leaf);
+            DataReuseSegment<Ty> seg;
+            seg.insert(convert(from.getHead()));
+            for (auto elem : from)
+                seg.insert(convert(elem));
+            seg.setCount(scale == 1 ? from.getCount() : std::llround(from.getCount() * scale));
+            UpdateTrie(getRoot(), &seg);
+        }
+        addResidual(std::llround(rhs.getResidualCount() * scale), rhs.getResidualSegments());
+    }
+
+    // Add count to the leaf that ends path and return true if the trie
+    // already has one. Only that count is written, atomically, so several
+    // threads holding a shared lock may call this with their own path buffer.
+    bool AddToLeaf(TrieIndex root, const Ty *path, size_t length, uint64_t count)
+    {
+        TrieIndex leaf = FindPath(root, path, length);
+        if (leaf == TrieNull)
+            return false;
+        __atomic_fetch_add(&_nodes[leaf]._count, count, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    static inline uint64_t HashPath(const Ty *path, size_t length)
+    {
+        uint64_t hash = length;
+        for (size_t i = 0; i < length; i++) {
+            hash ^= std::hash<Ty>()(path[i]) + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2);
+            hash *= 0xff51afd7ed558ccdULL;
+        }
+        return hash ^ (hash >> 33);
+    }
+
+    // release every node and start over with an empty root,
+    // the sketch and the residual are kept
+    void DeleteTrie()
+    {
+        _nodes.clear();
+        _edges.clear();
+        _labels.clear();
+        _leaves.clear();
+        _nodes.allocate();
+    }
+
+  private:
+    // the leaf at the end of path, TrieNull if the trie does not have it
+    TrieIndex FindPath(TrieIndex root, const Ty *path, size_t length) const
+    {
+        TrieIndex node = root;
+        size_t pos = 0;
+        while (pos < length) {
+            node = _nodes[node]._children.find(path[pos]);
+            if (node == TrieNull) return TrieNull;
+            const TrieNode<Ty> &temp = _nodes[node];
+            if (pos + temp._length > length) return TrieNull;
+            const Ty *label = getLabel(temp);
+            for (uint32_t i = 1; i < temp._length; i++) {
+                if (label[i] != path[pos + i]) return TrieNull;
             }
+            pos += temp._length;
         }
-        delete root;
+        return _nodes[node]._isLeaf ? node : TrieNull;
     }
 
-  void ExportSegment(DataReuseSegment<Ty> *seg, TrieNode<Ty> *leaf)
+    // Walk down from root along path, splitting the edge where the path
+    // leaves it and adding the unmatched rest as a new node. Returns the
+    // node that ends the path, created tells if it did not exist before.
+    TrieIndex InsertPath(TrieIndex root, const Ty *path, size_t length, bool &created)
     {
-        assert(leaf->_isLeaf);
-        seg->setHead(leaf->_cur);
-        seg->setCount(leaf->_count);
+        TrieIndex node = root;
+        size_t pos = 0;
+        created = false;
+        while (pos < length) {
+            TrieIndex child = _nodes[node]._children.find(path[pos]);
+            if (child == TrieNull) {
+                child = NewNode(node, path + pos, length - pos);
+                _nodes[node]._children.insert(path[pos], child, _edges);
+                created = true;
+                return child;
+            }
+            const TrieNode<Ty> &temp = _nodes[child];
+            const Ty *label = getLabel(temp);
+            uint32_t matched = 1;
+            while (matched < temp._length && pos + matched < length && label[matched] == path[pos + matched]) {
+                matched++;
+            }
+            if (matched < temp._length) {
+                child = SplitEdge(node, child, matched);
+            }
+            node = child;
+            pos += matched;
+        }
+        return node;
+    }
+
+    TrieIndex NewNode(TrieIndex parent, const Ty *label, size_t length)
+    {
+        assert(_labels.size() + length <= UINT32_MAX);
+        TrieIndex idx = _nodes.allocate();
+        TrieNode<Ty> &node = _nodes[idx];
+        node._parent = parent;
+        node._label = _labels.size();
+        node._length = length;
+        node._cur = label[length - 1];
+        _labels.insert(_labels.end(), label, label + length);
+        return idx;
+    }
+
+    // Cut the edge into child after its first prefix elements, the new node
+    // takes the prefix and becomes the parent of child. Returns the new node.
+    TrieIndex SplitEdge(TrieIndex parent, TrieIndex child, uint32_t prefix)
+    {
+        TrieIndex idx = _nodes.allocate();
+        TrieNode<Ty> &node = _nodes[idx];
+        TrieNode<Ty> &suffix = _nodes[child];
+        const Ty *label = getLabel(suffix);
+        node._parent = parent;
+        node._label = suffix._label;
+        node._length = prefix;
+        node._cur = label[prefix - 1];
+        node._children.insert(label[prefix], child, _edges);
+        _nodes[parent]._children.assign(label[0], idx);
+        suffix._parent = idx;
+        suffix._label += prefix;
+        suffix._length -= prefix;
+        return idx;
+    }
 
-        TrieNode<Ty> *temp = leaf;
-        while (temp->_parent != NULL)
+  public:
+    // Store the trie as preorder arrays with one node per label element, the
+    // same layout as an uncompressed trie. Node 0 is the root and parent[0]
+    // is unused. leaves lists the node index of each entry of _leaves.
+    void Flatten(std::vector<uint32_t> &parent, std::vector<Ty> &cur, std::vector<uint64_t> &count,
+                 std::vector<uint8_t> &isleaf, std::vector<uint32_t> &leaves)
+    {
+        parent.assign(1, 0); cur.assign(1, _nodes[getRoot()]._cur);
+        count.assign(1, _nodes[getRoot()]._count); isleaf.assign(1, _nodes[getRoot()]._isLeaf);
+        std::unordered_map<TrieIndex, uint32_t> node2idx;
+        // (node, index of the last element of its parent)
+        std::vector<std::pair<TrieIndex, uint32_t>> stack;
+        const TrieChildren<Ty> &rootchildren = _nodes[getRoot()]._children;
+        for (auto it = rootchildren.end(); it != rootchildren.begin(); ) {
+            --it;
+            stack.push_back(std::make_pair(it->idx, 0));
+        }
+        while (!stack.empty()) {
+            const TrieNode<Ty> &node = _nodes[stack.back().first];
+            uint32_t up = stack.back().second;
+            TrieIndex nodeidx = stack.back().first;
+            stack.pop_back();
+            const Ty *label = getLabel(node);
+            for (uint32_t i = 0; i < node._length; i++) {
+                bool last = (i + 1 == node._length);
+                parent.push_back(up);
+                cur.push_back(label[i]);
+                count.push_back(last ? node._count : 0);
+                isleaf.push_back(last ? node._isLeaf : false);
+                up = parent.size() - 1;
+            }
+            node2idx[nodeidx] = up;
+            for (auto it = node._children.end(); it != node._children.begin(); ) {
+                --it;
+                stack.push_back(std::make_pair(it->idx, up));
+            }
+        }
+        leaves.clear();
+        for (auto leaf : _leaves) {
+            leaves.push_back(node2idx[leaf]);
+        }
+    }
+
+    // Rebuild the trie from the arrays produced by Flatten, replacing the current content.
+    // Any order works as long as every parent comes before its children.
+    /// whether Unflatten can rebuild the trie from these arrays: every node
+    /// but the root has an earlier parent and every listed leaf is a node
+    static bool ValidFlat(size_t size, const uint32_t *parent, size_t leaves_size, const uint32_t *leaves)
+    {
+        for (size_t i = 1; i < size; i++) {
+            if (parent[i] >= i) return false;
+        }
+        for (size_t i = 0; i < leaves_size; i++) {
+            if (leaves[i] >= size) return false;
+        }
+        return true;
+    }
+
+    // the arrays have to pass ValidFlat
+    void Unflatten(size_t size, const uint32_t *parent, const Ty *cur, const uint64_t *count,
+                   const uint8_t *isleaf, size_t leaves_size, const uint32_t *leaves)
+    {
+        DeleteTrie();
+        std::vector<Ty> path;
+        auto insert = [&] (uint32_t leaf) {
+            path.clear();
+            for (uint32_t i = leaf; i != 0; i = parent[i]) {
+                assert(parent[i] < i);
+                path.push_back(cur[i]);
+            }
+            std::reverse(path.begin(), path.end());
+            bool created;
+            TrieIndex idx = InsertPath(getRoot(), path.data(), path.size(), created);
+            _nodes[idx]._isLeaf = true;
+            _nodes[idx]._count = count[leaf];
+            return idx;
+        };
+        std::vector<uint8_t> listed(size, 0);
+        for (size_t i = 0; i < leaves_size; i++) {
+            assert(leaves[i] < size);
+            listed[leaves[i]] = 1;
+            _leaves.push_back(insert(leaves[i]));
+        }
+        for (size_t i = 1; i < size; i++) {
+            if (isleaf[i] && !listed[i]) insert(i);
+        }
+    }
+
+    void ExportSegment(DataReuseSegment<Ty> *seg, TrieIndex leaf)
+    {
+        const TrieNode<Ty> *temp = &_nodes[leaf];
+        assert(temp->_isLeaf);
+        seg->setHead(temp->_cur);
+        seg->setCount(temp->_count);
+
+        while (temp->_parent != TrieNull)
         {
-            seg->insert(temp->_cur);
-            temp = temp->_parent;
+            const Ty *label = getLabel(*temp);
+            for (uint32_t i = temp->_length; i > 0; i--)
+            {
+                seg->insert(label[i - 1]);
+            }
+            temp = &_nodes[temp->_parent];
         }
     }
 
 
-    void ExportSegment(DataReuseSegment<Ty> *seg, TrieNode<Ty> *leaf, BBLID (*get_id)(Ty))
+    void ExportSegment(DataReuseSegment<Ty> *seg, TrieIndex leafidx, BBLID (*get_id)(Ty))
     {
+        const TrieNode<Ty> *leaf = &_nodes[leafidx];
         assert(leaf->_isLeaf);
         seg->setHead(leaf->_cur);
         seg->setCount(leaf->_count);
@@ -441,82 +1370,106 @@ public:
                     << std::setfill('0') << std::setw(16) << bblhash.second
                     << std::endl;
         #endif
-        TrieNode<Ty> *temp = leaf;
-        while (temp->_parent != NULL)
+        const TrieNode<Ty> *temp = leaf;
+        while (temp->_parent != TrieNull)
         {
-            #if TSJ > 0
-            UUID bblhash = temp->_cur->bblhash;
-            std::cerr << "  [TSJ-DEBUG]:" << std::dec<< random << 
-                        " temp count:" << std::dec<< temp->_count <<
-                        "  temp bblid:" << std::dec<< get_id(temp->_cur) <<
-                        "      bblhash:"
-                        << "  " << std::hex
-                        << std::setfill('0') << std::setw(16) << bblhash.first
-                        << "  "
-                        << std::setfill('0') << std::setw(16) << bblhash.second
-                        << std::endl;
-            #endif
-            seg->insert(temp->_cur);
-            temp = temp->_parent;
+            const Ty *label = getLabel(*temp);
+            for (uint32_t i = temp->_length; i > 0; i--)
+            {
+                Ty elem = label[i - 1];
+                #if TSJ > 0
+                UUID bblhash = elem->bblhash;
+                std::cerr << "  [TSJ-DEBUG]:" << std::dec<< random << 
+                            " temp count:" << std::dec<< temp->_count <<
+                            "  temp bblid:" << std::dec<< get_id(elem) <<
+                            "      bblhash:"
+                            << "  " << std::hex
+                            << std::setfill('0') << std::setw(16) << bblhash.first
+                            << "  "
+                            << std::setfill('0') << std::setw(16) << bblhash.second
+                            << std::endl;
+                #endif
+                seg->insert(elem);
+            }
+            temp = &_nodes[temp->_parent];
         }
     }
 
     // Sort leaves by _count in descending order
     void SortLeaves() {
         std::sort(_leaves.begin(), _leaves.end(),
-            [] (const TrieNode<Ty> *lhs, const TrieNode<Ty> *rhs) { return lhs->_count > rhs->_count; });
+            [this] (TrieIndex lhs, TrieIndex rhs) { return _nodes[lhs]._count > _nodes[rhs]._count; });
     }
 
     // the printing function needs to know how to index the elements of type Ty, so it accepts a function with prototype:
     // BBLID get_id(Ty elem);
-    void PrintDotGraphHelper(std::ostream &out, TrieNode<Ty> *root, int parent, int &count, BBLID (*get_id)(Ty))
+    // Every label element is drawn as a vertex of its own, vertices are
+    // numbered in preorder. The walk uses an explicit stack of
+    // (node, vertex of its parent) since the trie can be arbitrarily deep.
+    void PrintDotGraphHelper(std::ostream &out, TrieIndex rootidx, int parent, int &count, BBLID (*get_id)(Ty))
     {
-        out << std::endl;
-        BBLID cur = get_id(root->_cur);
-        if (root->_isLeaf)
-        {
-            out << "    V_" << count << " [shape=box, label=\"head = " << cur << "\n cnt = " << root->_count << "\"];" << std::endl;
-            out << "    V_" << parent << " -> V_" << count << ";" << std::endl;
-            parent = count;
-            count++;
-        }
-        else
+        std::vector<std::pair<TrieIndex, int>> stack;
+        stack.push_back(std::make_pair(rootidx, parent));
+        while (!stack.empty())
         {
-            out << "    V_" << count << " [label=\"" << cur << "\"];" << std::endl;
-            out << "    V_" << parent << " -> V_" << count << ";" << std::endl;
-            parent = count;
-            count++;
+            const TrieNode<Ty> *root = &_nodes[stack.back().first];
+            parent = stack.back().second;
+            stack.pop_back();
+            const Ty *label = getLabel(*root);
+            for (uint32_t i = 0; i < root->_length; i++)
+            {
+                out << std::endl;
+                BBLID cur = get_id(label[i]);
+                if (root->_isLeaf && i + 1 == root->_length)
+                {
+                    out << "    V_" << count << " [shape=box, label=\"head = " << cur << "\n cnt = " << root->_count << "\"];" << std::endl;
+                }
+                else
+                {
+                    out << "    V_" << count << " [label=\"" << cur << "\"];" << std::endl;
+                }
+                out << "    V_" << parent << " -> V_" << count << ";" << std::endl;
+                parent = count;
+                count++;
+            }
 
-            for (auto it : root->_children)
+            if (!root->_isLeaf)
             {
-                DataReuse::PrintDotGraphHelper(out, it.second, parent, count, get_id);
+                for (auto it = root->_children.end(); it != root->_children.begin(); )
+                {
+                    --it;
+                    stack.push_back(std::make_pair(it->idx, parent));
+                }
             }
         }
     }
 
     std::ostream &PrintDotGraph(std::ostream &out, BBLID (*get_id)(Ty))
     {
-        int parent = 0;
         int count = 1;
         out << "digraph trie {" << std::endl;
         out << "    V_0"
             << " [label=\"root\"];" << std::endl;
-        for (auto it : _root->_children)
-        {
-            DataReuse::PrintDotGraphHelper(out, it.second, parent, count, get_id);
-        }
+        DataReuse::PrintDotGraphHelper(out, getRoot(), 0, count, get_id);
         out << "}" << std::endl;
         return out;
     }
 
-    std::ostream &PrintAllSegments(std::ostream &out, BBLID (*get_id)(Ty))
+    // counts are multiplied by scale, the inverse of the rate the segments were sampled at
+    std::ostream &PrintAllSegments(std::ostream &out, BBLID (*get_id)(Ty), double scale = 1)
     {
         for (auto it : _leaves)
         {
             DataReuseSegment<Ty> seg;
             ExportSegment(&seg, it, get_id);
+            if (scale != 1)
+                seg.setCount(std::llround(seg.getCount() * scale));
             seg.print(out, get_id);
         }
+        if (_residual_segments > 0)
+        {
+            out << "residual count = " << (uint64_t)std::llround(_residual_count * scale) << ", segments = " << _residual_segments << std::endl;
+        }
         return out;
     }
 
@@ -570,6 +1523,81 @@ public:
         return out;
     }
 };
+
+/* ===================================================================== */
+/* ConcurrentDataReuse */
+/* ===================================================================== */
+// A reuse trie that many threads update at once. Segments go to one of
+// ShardCount tries by the hash of their path, so the same segment always
+// meets the same trie. Adding to a leaf that exists takes the shard lock
+// shared and bumps the count atomically, only creating nodes takes it
+// exclusively.
+template <class Ty>
+class ConcurrentDataReuse
+{
+public:
+    static const uint32_t ShardCount = 64;
+
+private:
+    struct Shard {
+        std::shared_timed_mutex lock;
+        DataReuse<Ty> trie;
+    };
+    std::vector<std::unique_ptr<Shard>> _shards;
+
+public:
+    ConcurrentDataReuse()
+    {
+        for (uint32_t i = 0; i < ShardCount; i++) {
+            _shards.emplace_back(new Shard);
+        }
+    }
+
+    // the sketch is split among the shards, see DataReuse::setBounded
+    void setBounded(uint64_t threshold, uint32_t width = 1 << 16, uint32_t depth = 4)
+    {
+        width = width / ShardCount > 64 ? width / ShardCount : 64;
+        for (auto &shard : _shards) {
+            std::unique_lock<std::shared_timed_mutex> guard(shard->lock);
+            shard->trie.setBounded(threshold, width, depth);
+        }
+    }
+
+    void UpdateTrie(const DataReuseSegment<Ty> *seg)
+    {
+        if (seg->size() <= 1)
+            return;
+
+        thread_local std::vector<Ty> path;
+        path.assign(seg->begin(), seg->end());
+        path.push_back(seg->getHead());
+        Shard &shard = *_shards[DataReuse<Ty>::HashPath(path.data(), path.size()) % ShardCount];
+        {
+            std::shared_lock<std::shared_timed_mutex> guard(shard.lock);
+            if (shard.trie.AddToLeaf(shard.trie.getRoot(), path.data(), path.size(), seg->getCount()))
+                return;
+        }
+        std::unique_lock<std::shared_timed_mutex> guard(shard.lock);
+        shard.trie.UpdateTrie(shard.trie.getRoot(), seg);
+    }
+
+    // these are not safe to call while other threads update the trie
+    template <class Tz, class Convert>
+    void MergeInto(DataReuse<Tz> &reuse, Convert convert, double scale = 1)
+    {
+        for (auto &shard : _shards) {
+            reuse.Merge(shard->trie, convert, scale);
+        }
+    }
+
+    std::ostream &PrintAllSegments(std::ostream &out, BBLID (*get_id)(Ty), double scale = 1)
+    {
+        for (auto &shard : _shards) {
+            shard->trie.PrintAllSegments(out, get_id, scale);
+        }
+        return out;
+    }
+};
 } // namespace PIMProf
 
 #endif // __DATAREUSE_H__
@@ -0,0 +1,223 @@
+//===- Export.cpp - Machine-readable solver output --------------*- C++ -*-===//
+//
+//
+//===----------------------------------------------------------------------===//
+//
+//
+//===----------------------------------------------------------------------===//
+#include <cmath>
+#include <cstdarg>
+#include <cstring>
+
+#include "Export.h"
+#include "Util.h"
+
+using namespace PIMProf;
+
+/* ===================================================================== */
+/* BufferedWriter */
+/* ===================================================================== */
+
+bool BufferedWriter::open(const std::string &filename)
+{
+    close();
+    _file = fopen(filename.c_str(), "w");
+    _length = 0;
+    return _file != nullptr;
+}
+
+bool BufferedWriter::close()
+{
+    if (_file == nullptr) return true;
+    flush();
+    bool good = !ferror(_file);
+    good &= (fclose(_file) == 0);
+    _file = nullptr;
+    return good;
+}
+
+void BufferedWriter::flush()
+{
+    if (_file != nullptr && _length > 0) {
+        fwrite(_buffer.data(), 1, _length, _file);
+    }
+    _length = 0;
+}
+
+void BufferedWriter::write(const void *data, size_t size)
+{
+    if (_length + size > _buffer.size()) {
+        flush();
+        if (size > _buffer.size()) {
+            fwrite(data, 1, size, _file);
+            return;
+        }
+    }
+    memcpy(_buffer.data() + _length, data, size);
+    _length += size;
+}
+
+void BufferedWriter::printf(const char *format, ...)
+{
+    va_list args;
+    for (int retry = 0; retry < 2; retry++) {
+        size_t space = _buffer.size() - _length;
+        va_start(args, format);
+        int n = vsnprintf(_buffer.data() + _length, space, format, args);
+        va_end(args);
+        if (n < 0) return;
+        if ((size_t)n < space) {
+            _length += n;
+            return;
+        }
+        // did not fit, retry once on an empty buffer
+        flush();
+        if ((size_t)n >= _buffer.size()) {
+            _buffer.resize(n + 1);
+        }
+    }
+}
+
+/* ===================================================================== */
+/* Export */
+/* ===================================================================== */
+
+ExportFormat PIMProf::getExportFormat(const std::string &format, const std::string &filename)
+{
+    std::string name = format;
+    if (name == "") {
+        size_t dot = filename.rfind('.');
+        name = (dot == std::string::npos ? "" : filename.substr(dot + 1));
+    }
+    if (name == "jsonl" || name == "json") return EXPORT_JSONL;
+    if (name == "bin" || name == "binary") return EXPORT_BINARY;
+    return EXPORT_CSV;
+}
+
+static const char *SiteString(int32_t site)
+{
+    if (site == DEFAULT) return "D";
+    if (site >= CPU && site <= Follower) return CostSiteString[site].c_str();
+    return "I";
+}
+
+// %.17g round-trips a double, JSON has no literal for inf and nan
+static void PrintCost(BufferedWriter &out, COST cost, bool json)
+{
+    if (json && !std::isfinite(cost)) {
+        out.puts("null");
+    }
+    else {
+        out.printf("%.17g", cost);
+    }
+}
+
+static void ExportCSV(BufferedWriter &out,
+    const std::vector<CostBreakdown> &costs, const std::vector<DecisionRecord> &records)
+{
+    out.puts("kind,method,bblid,hash_hi,hash_lo,decision,cts_decision,sca_decision,parallelism,bb_count,cpu,pim,reuse,switch,total\n");
+    for (auto &cost : costs) {
+        out.printf("cost,%s,,,,,,,,,", cost.method.c_str());
+        PrintCost(out, cost.cpu, false);
+        out.putc(',');
+        PrintCost(out, cost.pim, false);
+        out.putc(',');
+        PrintCost(out, cost.reuse, false);
+        out.putc(',');
+        PrintCost(out, cost.swtch, false);
+        out.putc(',');
+        PrintCost(out, cost.total, false);
+        out.putc('\n');
+    }
+    for (auto &record : records) {
+        out.printf("bbl,,%ld,%016lx,%016lx,%s,%s,%s,%d,%lu,",
+            record.bblid, record.hash_hi, record.hash_lo,
+            SiteString(record.decision),
+            SiteString(record.cts_decision),
+            SiteString(record.sca_decision),
+            record.parallelism, record.bbcount);
+        PrintCost(out, record.cpu, false);
+        out.putc(',');
+        PrintCost(out, record.pim, false);
+        out.puts(",,,\n");
+    }
+}
+
+static void ExportJSONL(BufferedWriter &out,
+    const std::vector<CostBreakdown> &costs, const std::vector<DecisionRecord> &records)
+{
+    // method names are plain identifiers, no escaping needed
+    for (auto &cost : costs) {
+        out.printf("{\"kind\":\"cost\",\"method\":\"%s\",\"cpu\":", cost.method.c_str());
+        PrintCost(out, cost.cpu, true);
+        out.puts(",\"pim\":");
+        PrintCost(out, cost.pim, true);
+        out.puts(",\"reuse\":");
+        PrintCost(out, cost.reuse, true);
+        out.puts(",\"switch\":");
+        PrintCost(out, cost.swtch, true);
+        out.puts(",\"total\":");
+        PrintCost(out, cost.total, true);
+        out.puts("}\n");
+    }
+    for (auto &record : records) {
+        out.printf("{\"kind\":\"bbl\",\"bblid\":%ld,\"hash_hi\":\"%016lx\",\"hash_lo\":\"%016lx\","
+            "\"decision\":\"%s\",\"cts_decision\":\"%s\",\"sca_decision\":\"%s\","
+            "\"parallelism\":%d,\"bb_count\":%lu,\"cpu\":",
+            record.bblid, record.hash_hi, record.hash_lo,
+            SiteString(record.decision),
+            SiteString(record.cts_decision),
+            SiteString(record.sca_decision),
+            record.parallelism, record.bbcount);
+        PrintCost(out, record.cpu, true);
+        out.puts(",\"pim\":");
+        PrintCost(out, record.pim, true);
+        out.puts("}\n");
+    }
+}
+
+static const char ExportMagic[8] = {'P', 'I', 'M', 'P', 'E', 'X', 'P', 'T'};
+static const uint32_t ExportVersion = 1;
+
+struct ExportCostRecord {
+    char method[24];
+    COST total, cpu, pim, reuse, swtch;
+};
+
+static bool ExportBinary(const std::string &filename,
+    const std::vector<CostBreakdown> &costs, const std::vector<DecisionRecord> &records)
+{
+    BinaryWriter out(filename);
+    out.writeRaw(ExportMagic, sizeof(ExportMagic));
+    out.write(ExportVersion);
+    std::vector<ExportCostRecord> costrecords(costs.size());
+    for (size_t i = 0; i < costs.size(); i++) {
+        memset(costrecords[i].method, 0, sizeof(costrecords[i].method));
+        strncpy(costrecords[i].method, costs[i].method.c_str(), sizeof(costrecords[i].method) - 1);
+        costrecords[i].total = costs[i].total;
+        costrecords[i].cpu = costs[i].cpu;
+        costrecords[i].pim = costs[i].pim;
+        costrecords[i].reuse = costs[i].reuse;
+        costrecords[i].swtch = costs[i].swtch;
+    }
+    out.writeArray(costrecords);
+    out.writeArray(records);
+    return out.good();
+}
+
+bool PIMProf::ExportRecords(const std::string &filename, ExportFormat format,
+    const std::vector<CostBreakdown> &costs, const std::vector<DecisionRecord> &records)
+{
+    if (format == EXPORT_BINARY) {
+        return ExportBinary(filename, costs, records);
+    }
+    BufferedWriter out;
+    if (!out.open(filename)) return false;
+    if (format == EXPORT_JSONL) {
+        ExportJSONL(out, costs, records);
+    }
+    else {
+        ExportCSV(out, costs, records);
+    }
+    return out.close();
+}
@@ -0,0 +1,90 @@
+//===- Export.h - Machine-readable solver output ----------------*- C++ -*-===//
+//
+//
+//===----------------------------------------------------------------------===//
+//
+//
+//===----------------------------------------------------------------------===//
+#ifndef __EXPORT_H__
+#define __EXPORT_H__
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "Common.h"
+
+namespace PIMProf {
+
+/* ===================================================================== */
+/* BufferedWriter */
+/* ===================================================================== */
+/// Formats straight into a large buffer that is written to the file in
+/// blocks, so each field costs one snprintf and no stream state.
+class BufferedWriter {
+  private:
+    FILE *_file = nullptr;
+    std::vector<char> _buffer;
+    size_t _length = 0;
+
+  public:
+    BufferedWriter() : _buffer(1 << 20) {}
+    ~BufferedWriter() { close(); }
+    BufferedWriter(const BufferedWriter &) = delete;
+    BufferedWriter &operator=(const BufferedWriter &) = delete;
+
+    bool open(const std::string &filename);
+    /// returns false if any write failed
+    bool close();
+
+    void write(const void *data, size_t size);
+    void printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    inline void puts(const char *str) { write(str, strlen(str)); }
+    inline void putc(char c)
+    {
+        if (_length == _buffer.size()) flush();
+        _buffer[_length++] = c;
+    }
+
+  private:
+    void flush();
+};
+
+/* ===================================================================== */
+/* Export records */
+/* ===================================================================== */
+
+enum ExportFormat {
+    EXPORT_CSV, EXPORT_JSONL, EXPORT_BINARY
+};
+
+/// decide the format from the name given by --export-format,
+/// or from the file extension if no name is given
+ExportFormat getExportFormat(const std::string &format, const std::string &filename);
+
+/// the time breakdown of one offloading method, in nanoseconds
+struct CostBreakdown {
+    std::string method;
+    COST total, cpu, pim, reuse, swtch;
+};
+
+/// one row of the decision table
+struct DecisionRecord {
+    BBLID bblid;
+    uint64_t hash_hi, hash_lo;
+    int32_t decision, cts_decision, sca_decision;
+    int32_t parallelism;
+    uint64_t bbcount;
+    COST cpu, pim;
+};
+
+/// CSV and JSON lines carry a ``kind'' field that tells cost rows from BBL rows,
+/// the binary form is a header followed by the two record arrays.
+bool ExportRecords(const std::string &filename, ExportFormat format,
+    const std::vector<CostBreakdown> &costs, const std::vector<DecisionRecord> &records);
+
+} // namespace PIMProf
+
+#endif // __EXPORT_H__
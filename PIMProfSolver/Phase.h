@@ -0,0 +1,109 @@
+//===- Phase.h - Group profile epochs into phases ---------------*- C++ -*-===//
+//
+//
+//===----------------------------------------------------------------------===//
+//
+//
+//===----------------------------------------------------------------------===//
+#ifndef __PHASE_H__
+#define __PHASE_H__
+
+#include <vector>
+#include <cmath>
+
+#include "Common.h"
+
+namespace PIMProf {
+
+/* ===================================================================== */
+/* PhaseClassifier */
+/* ===================================================================== */
+/// The signature of an epoch is its basic block vector: the share of the
+/// instructions of the epoch each BBL executed, sorted by BBLID and without
+/// zero entries. Epochs are classified in order, each joins the phase with
+/// the nearest centroid if that is within distance (L1, so between 0 for
+/// the same mix and 2 for disjoint ones), or starts a new phase otherwise.
+class PhaseClassifier {
+  public:
+    typedef std::vector<std::pair<BBLID, double>> Signature;
+
+  private:
+    struct Phase {
+        Signature centroid; // the mean signature of the members
+        int members = 0;
+    };
+
+    double _distance;
+    std::vector<Phase> _phases;
+
+  public:
+    PhaseClassifier(double distance) : _distance(distance) {}
+
+    inline int size() const { return (int)_phases.size(); }
+
+    /// returns the phase of signature
+    int Classify(const Signature &signature)
+    {
+        int nearest = -1;
+        double best = _distance;
+        for (int p = 0; p < size(); p++) {
+            double d = Distance(_phases[p].centroid, signature);
+            if (d <= best) {
+                best = d;
+                nearest = p;
+            }
+        }
+        if (nearest < 0) {
+            nearest = size();
+            _phases.emplace_back();
+        }
+        Phase &phase = _phases[nearest];
+        phase.members++;
+        phase.centroid = Mix(phase.centroid, signature, 1.0 / phase.members);
+        return nearest;
+    }
+
+    static double Distance(const Signature &lhs, const Signature &rhs)
+    {
+        double result = 0;
+        Merge(lhs, rhs, [&](BBLID, double l, double r) { result += std::fabs(l - r); });
+        return result;
+    }
+
+  private:
+    // (1 - weight) * lhs + weight * rhs
+    static Signature Mix(const Signature &lhs, const Signature &rhs, double weight)
+    {
+        Signature result;
+        Merge(lhs, rhs, [&](BBLID bblid, double l, double r) {
+            result.push_back(std::make_pair(bblid, (1 - weight) * l + weight * r));
+        });
+        return result;
+    }
+
+    // call f(bblid, lhs value, rhs value) for every BBLID in either signature
+    template <class F>
+    static void Merge(const Signature &lhs, const Signature &rhs, F f)
+    {
+        size_t i = 0, j = 0;
+        while (i < lhs.size() || j < rhs.size()) {
+            if (j == rhs.size() || (i < lhs.size() && lhs[i].first < rhs[j].first)) {
+                f(lhs[i].first, lhs[i].second, 0.0);
+                i++;
+            }
+            else if (i == lhs.size() || rhs[j].first < lhs[i].first) {
+                f(rhs[j].first, 0.0, rhs[j].second);
+                j++;
+            }
+            else {
+                f(lhs[i].first, lhs[i].second, rhs[j].second);
+                i++;
+                j++;
+            }
+        }
+    }
+};
+
+} // namespace PIMProf
+
+#endif // __PHASE_H__
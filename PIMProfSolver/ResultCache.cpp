@@ -0,0 +1,264 @@
+//===- ResultCache.cpp - On-disk cache of solver results --------*- C++ -*-===//
+//
+//
+//===----------------------------------------------------------------------===//
+//
+//
+//===----------------------------------------------------------------------===//
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <thread>
+#include <cerrno>
+#include <cstdio>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ResultCache.h"
+#include "Util.h"
+#include "../LLVMAnalysis/MurmurHash3.h"
+
+using namespace PIMProf;
+
+/* ===================================================================== */
+/* Cache entry layout */
+/* ===================================================================== */
+
+static const char CacheMagic[8] = {'P', 'I', 'M', 'P', 'C', 'A', 'C', 'H'};
+static const uint32_t CacheVersion = 2;
+static const std::string CacheSuffix = ".pimcache";
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t key[2];
+    uint64_t size;
+};
+
+// The payload after the header is the report, the decision, the cost
+// breakdowns, the export records and the decision table entries, each
+// preceded by its uint64_t length. Records and entries are stored as is.
+static void Append(std::string &out, const void *data, uint64_t size)
+{
+    out.append((const char *)&size, sizeof(size));
+    out.append((const char *)data, size);
+}
+
+template <class T>
+static void AppendArray(std::string &out, const std::vector<T> &array)
+{
+    uint64_t count = array.size();
+    out.append((const char *)&count, sizeof(count));
+    out.append((const char *)array.data(), count * sizeof(T));
+}
+
+static std::string SerializeSolution(const CachedSolution &solution)
+{
+    std::string out;
+    Append(out, solution.report.data(), solution.report.size());
+    std::vector<int32_t> decision(solution.decision.begin(), solution.decision.end());
+    AppendArray(out, decision);
+    uint64_t count = solution.costs.size();
+    out.append((const char *)&count, sizeof(count));
+    for (auto &cost : solution.costs) {
+        Append(out, cost.method.data(), cost.method.size());
+        COST values[5] = {cost.total, cost.cpu, cost.pim, cost.reuse, cost.swtch};
+        out.append((const char *)values, sizeof(values));
+    }
+    AppendArray(out, solution.records);
+    AppendArray(out, solution.table);
+    return out;
+}
+
+// reads the payload back, every length is checked against what is left
+class PayloadReader {
+  private:
+    const char *_pos, *_end;
+
+  public:
+    PayloadReader(const char *data, uint64_t size) : _pos(data), _end(data + size) {}
+
+    inline bool done() const { return _pos == _end; }
+
+    bool read(void *data, uint64_t size)
+    {
+        if (size > (uint64_t)(_end - _pos)) return false;
+        memcpy(data, _pos, size);
+        _pos += size;
+        return true;
+    }
+
+    bool read(std::string &str)
+    {
+        uint64_t size;
+        if (!read(&size, sizeof(size)) || size > (uint64_t)(_end - _pos)) return false;
+        str.assign(_pos, size);
+        _pos += size;
+        return true;
+    }
+
+    template <class T>
+    bool read(std::vector<T> &array)
+    {
+        uint64_t count;
+        if (!read(&count, sizeof(count)) || count > (uint64_t)(_end - _pos) / sizeof(T)) return false;
+        array.resize(count);
+        return read(array.data(), count * sizeof(T));
+    }
+};
+
+static bool DeserializeSolution(const char *data, uint64_t size, CachedSolution &solution)
+{
+    PayloadReader reader(data, size);
+    std::vector<int32_t> decision;
+    uint64_t count;
+    if (!reader.read(solution.report) || !reader.read(decision) || !reader.read(&count, sizeof(count))) {
+        return false;
+    }
+    solution.decision.clear();
+    for (int32_t site : decision) {
+        solution.decision.push_back((CostSite)site);
+    }
+    solution.costs.clear();
+    for (uint64_t i = 0; i < count; i++) {
+        CostBreakdown cost;
+        COST values[5];
+        if (!reader.read(cost.method) || !reader.read(values, sizeof(values))) return false;
+        cost.total = values[0];
+        cost.cpu = values[1];
+        cost.pim = values[2];
+        cost.reuse = values[3];
+        cost.swtch = values[4];
+        solution.costs.push_back(cost);
+    }
+    return reader.read(solution.records) && reader.read(solution.table) && reader.done();
+}
+
+/* ===================================================================== */
+/* ResultCache */
+/* ===================================================================== */
+
+void ResultCache::initialize(const std::string &dir, uint64_t limit)
+{
+    _dir = dir;
+    _limit = limit;
+    if (_dir == "") return;
+    if (mkdir(_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        warningmsg("Unable to create result cache ``%s'', caching disabled", _dir.c_str());
+        _dir = "";
+    }
+}
+
+UUID ResultCache::Fingerprint(const std::string &description)
+{
+    uint64_t result[2];
+    MurmurHash3_x64_128(description.data(), description.size(), 0, result);
+    return UUID(result[0], result[1]);
+}
+
+std::string ResultCache::EntryPath(const UUID &key)
+{
+    char name[40];
+    snprintf(name, sizeof(name), "%016lx%016lx", key.first, key.second);
+    return _dir + "/" + name + CacheSuffix;
+}
+
+bool ResultCache::Lookup(const UUID &key, CachedSolution &result)
+{
+    if (!enabled()) return false;
+    std::string path = EntryPath(key);
+    MappedFile file;
+    if (!file.open(path)) return false;
+
+    CacheHeader header;
+    if (file.size() < sizeof(header)) return false;
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) != 0
+        || header.version != CacheVersion
+        || UUID(header.key[0], header.key[1]) != key
+        || header.size != file.size() - sizeof(header)
+        || !DeserializeSolution(file.data() + sizeof(header), header.size, result)) {
+        warningmsg("Result cache entry ``%s'' is corrupted, ignored", path.c_str());
+        return false;
+    }
+
+    // refresh the modification time so that eviction is least recently used
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    return true;
+}
+
+void ResultCache::Store(const UUID &key, const CachedSolution &solution)
+{
+    if (!enabled()) return;
+    std::string result = SerializeSolution(solution);
+    std::string path = EntryPath(key);
+    // unique among processes and among the threads of a batch run
+    std::string temp = path + ".tmp." + std::to_string(getpid())
+        + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+    header.version = CacheVersion;
+    header.key[0] = key.first;
+    header.key[1] = key.second;
+    header.size = result.size();
+
+    std::ofstream ofs(temp, std::ofstream::out | std::ofstream::binary);
+    ofs.write((const char *)&header, sizeof(header));
+    ofs.write(result.data(), result.size());
+    ofs.close();
+    if (!ofs.good() || rename(temp.c_str(), path.c_str()) != 0) {
+        warningmsg("Unable to write result cache entry ``%s''", path.c_str());
+        unlink(temp.c_str());
+        return;
+    }
+    Evict(key);
+}
+
+void ResultCache::Evict(const UUID &keep)
+{
+    DIR *dir = opendir(_dir.c_str());
+    if (dir == nullptr) return;
+
+    struct Entry {
+        std::string path;
+        struct timespec mtime;
+        uint64_t size;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    std::string kept = EntryPath(keep);
+    while (struct dirent *ent = readdir(dir)) {
+        std::string name(ent->d_name);
+        if (name.size() <= CacheSuffix.size()
+            || name.compare(name.size() - CacheSuffix.size(), CacheSuffix.size(), CacheSuffix) != 0) {
+            continue;
+        }
+        std::string path = _dir + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) continue;
+        total += st.st_size;
+        if (path != kept) {
+            entries.push_back({path, st.st_mtim, (uint64_t)st.st_size});
+        }
+    }
+    closedir(dir);
+    if (total <= _limit) return;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &lhs, const Entry &rhs) {
+        if (lhs.mtime.tv_sec != rhs.mtime.tv_sec) return lhs.mtime.tv_sec < rhs.mtime.tv_sec;
+        return lhs.mtime.tv_nsec < rhs.mtime.tv_nsec;
+    });
+    for (auto &entry : entries) {
+        if (total <= _limit) break;
+        // another solver may have evicted it already
+        if (unlink(entry.path.c_str()) == 0) {
+            infomsg("Evict result cache entry ``%s''", entry.path.c_str());
+        }
+        total -= entry.size;
+    }
+}
@@ -0,0 +1,62 @@
+//===- ResultCache.h - On-disk cache of solver results ----------*- C++ -*-===//
+//
+//
+//===----------------------------------------------------------------------===//
+//
+//
+//===----------------------------------------------------------------------===//
+#ifndef __RESULTCACHE_H__
+#define __RESULTCACHE_H__
+
+#include <string>
+#include <vector>
+
+#include "Common.h"
+#include "Export.h"
+
+namespace PIMProf {
+
+/* ===================================================================== */
+/* ResultCache */
+/* ===================================================================== */
+/// Everything a solver run outputs: the report, the decision, and the
+/// records the export and the decision table are written from, so that
+/// a hit serves them in whatever format is asked for.
+struct CachedSolution {
+    std::string report;
+    DECISION decision;
+    std::vector<CostBreakdown> costs;
+    std::vector<DecisionRecord> records;
+    std::vector<DecisionTableEntry> table;
+};
+
+/// Stores the solver output keyed by a fingerprint of the input files and
+/// the effective parameters, one file per entry in the cache directory.
+/// Once the directory grows beyond the size limit, the least recently used
+/// entries are evicted. Entries are written to a temporary file and renamed,
+/// so several solvers can share the same directory.
+class ResultCache {
+  private:
+    std::string _dir;
+    uint64_t _limit = 0;
+
+  public:
+    void initialize(const std::string &dir, uint64_t limit);
+
+    inline bool enabled() const { return _dir != ""; }
+
+    /// 128-bit fingerprint of an arbitrary description of the solver run
+    static UUID Fingerprint(const std::string &description);
+
+    /// returns false on a miss or if the entry is corrupted
+    bool Lookup(const UUID &key, CachedSolution &result);
+    void Store(const UUID &key, const CachedSolution &result);
+
+  private:
+    std::string EntryPath(const UUID &key);
+    void Evict(const UUID &keep);
+};
+
+} // namespace PIMProf
+
+#endif // __RESULTCACHE_H__
@@ -20,11 +20,16 @@
 #include <map>
 #include <algorithm>
 #include <unordered_map>
+#include <memory>
+#include <mutex>
 #include <cassert>
+#include <cstdlib>
+#include <new>
 
 #include "Common.h"
 #include "Util.h"
 #include "DataReuse.h"
+#include "ThreadPool.h"
 
 namespace PIMProf
 {
@@ -32,6 +37,9 @@ namespace PIMProf
 /* PIMProf Thread Data Collection */
 /* ===================================================================== */
 
+// the BBL nesting the stacks of ThreadStats hold without reallocating
+const size_t BBL_STACK_RESERVE = 1024;
+
 class RunStats
 {
 public:
@@ -42,6 +50,10 @@ public:
     COST elapsed_time; // store the nanosecond count of each basic block
     uint64_t instruction_count;
     uint64_t memory_access;
+    // the estimated variance of elapsed_time (ns^2), 0 unless timing is sampled
+    COST elapsed_time_var = 0;
+    // the epoch of ThreadStats in which it last changed, see ThreadStats::TouchEpoch
+    uint64_t epoch_stamp = 0;
 
     // instance of get_id function, prototype:
     // BBLID get_id(Ty elem);
@@ -69,6 +81,7 @@ public:
         elapsed_time += rhs.elapsed_time;
         instruction_count += rhs.instruction_count;
         memory_access += rhs.memory_access;
+        elapsed_time_var += rhs.elapsed_time_var;
         return *this;
     }
 
@@ -78,6 +91,38 @@ public:
     }
 };
 
+// RunStats are carved out of blocks of BlockSize, so a new BBL does not
+// cost an allocation of its own. They live until the pool is deleted.
+class RunStatsPool
+{
+private:
+    static const size_t BlockSize = 1024;
+    std::vector<RunStats *> m_blocks;
+    size_t m_used; // in the last block
+
+public:
+    RunStatsPool() : m_used(BlockSize) {}
+    ~RunStatsPool()
+    {
+        for (auto block : m_blocks) {
+            delete[] block;
+        }
+    }
+    RunStatsPool(const RunStatsPool &) = delete;
+    RunStatsPool &operator=(const RunStatsPool &) = delete;
+
+    RunStats *New(BBLID bblid, const UUID &bblhash)
+    {
+        if (m_used == BlockSize) {
+            m_blocks.push_back(new RunStats[BlockSize]);
+            m_used = 0;
+        }
+        RunStats *stats = &m_blocks.back()[m_used++];
+        *stats = RunStats(bblid, bblhash);
+        return stats;
+    }
+};
+
 // the pointers in sorted will point to the same location as the pointers in statsmap
 inline void SortStatsMap(UUIDHashMap<RunStats *> &statsmap, std::vector<RunStats *> &sorted)
 {
@@ -91,8 +136,400 @@ inline void SortStatsMap(UUIDHashMap<RunStats *> &statsmap, std::vector<RunStats
         [](RunStats *lhs, RunStats *rhs) { return lhs->bblhash < rhs->bblhash; });
 }
 
+// one stats section of pimprofcpustats.out, sorted by bblhash,
+// title is "Thread <tid>" or "Epoch <index> Thread <tid>"
+// if timing was sampled, the last column is the half width of the 95%
+// confidence interval of the time
+inline void PrintStatsTable(std::ostream &ofs, const std::string &title, const std::vector<RunStats *> &sorted)
+{
+    bool sampled = std::any_of(sorted.begin(), sorted.end(),
+        [](RunStats *stats) { return stats->elapsed_time_var > 0; });
+    ofs << HORIZONTAL_LINE << std::endl;
+    ofs << title << std::endl;
+    ofs << std::setw(7) << "BBLID"
+        << std::setw(15) << "Time(ns)"
+        << std::setw(15) << "Instruction"
+        << std::setw(15) << "Memory Access"
+        << std::setw(18) << "Hash(hi)"
+        << std::setw(18) << "Hash(lo)";
+    if (sampled)
+        ofs << std::setw(15) << "CI95(ns)";
+    ofs << std::endl;
+    for (auto it : sorted)
+    {
+        UUID bblhash = it->bblhash;
+        ofs << std::setw(7) << it->bblid
+            << std::setw(15) << it->elapsed_time
+            << std::setw(15) << it->instruction_count
+            << std::setw(15) << it->memory_access
+            << "  " << std::hex
+            << std::setfill('0') << std::setw(16) << bblhash.first
+            << "  "
+            << std::setfill('0') << std::setw(16) << bblhash.second
+            << std::setfill(' ') << std::dec;
+        if (sampled)
+            ofs << std::setw(15) << 1.96 * std::sqrt(it->elapsed_time_var);
+        ofs << std::endl;
+    }
+}
+
+/* ===================================================================== */
+/* Timing event sampling */
+/* ===================================================================== */
+
+// Take one in period events, either every period-th one or each one with
+// probability 1 / period (the gaps are then geometric). A sampled value is
+// scaled by period, which keeps the sums unbiased, and adds
+// (period - 1) / period times its scaled square to the variance of its sum.
+// That variance is exact for random sampling; for periodic sampling it
+// assumes that the period does not line up with a loop in the program.
+class EventSampler
+{
+private:
+    uint64_t m_period;
+    bool m_random;
+    uint64_t m_countdown; // events until the next sample
+    uint64_t m_state;     // of the xorshift generator
+
+public:
+    EventSampler() : m_period(1), m_random(false), m_countdown(1), m_state(1) {}
+
+    void SetPeriod(uint64_t period, bool random, uint64_t seed)
+    {
+        assert(period > 0);
+        m_period = period;
+        m_random = random;
+        m_state = MixTag(seed) | 1;
+        m_countdown = NextGap();
+    }
+
+    inline bool Enabled() { return m_period > 1; }
+    inline uint64_t GetPeriod() { return m_period; }
+
+    inline bool Sample()
+    {
+        if (--m_countdown > 0)
+            return false;
+        m_countdown = NextGap();
+        return true;
+    }
+
+    // what a sampled value adds to the variance of its sum, given the value after scaling
+    inline COST Variance(COST scaled)
+    {
+        return scaled * scaled * (m_period - 1) / m_period;
+    }
+
+private:
+    uint64_t NextGap()
+    {
+        if (!m_random || m_period <= 1)
+            return m_period;
+        m_state ^= m_state << 13;
+        m_state ^= m_state >> 7;
+        m_state ^= m_state << 17;
+        // uniform in (0, 1]
+        double u = ((m_state >> 11) + 1) * (1.0 / 9007199254740992.0);
+        return 1 + (uint64_t)(std::log(u) / std::log(1 - 1.0 / m_period));
+    }
+};
+
+/* ===================================================================== */
+/* Reuse segment collection */
+/* ===================================================================== */
+
+// Track only a fixed, hash-selected subset of cache lines (SHARDS-style
+// spatial sampling), the reuse counts are scaled by 1 / rate when printed.
+class TagSampler
+{
+private:
+    // only tags that hash below m_threshold out of SampleModulus are
+    // tracked, so the sampling rate is m_threshold / SampleModulus
+    static const uint64_t SampleModulus = 1 << 24;
+    uint64_t m_threshold;
+
+public:
+    TagSampler() : m_threshold(SampleModulus) {}
+
+    void SetRate(double rate)
+    {
+        assert(rate > 0 && rate <= 1);
+        m_threshold = (uint64_t)std::llround(rate * SampleModulus);
+        if (m_threshold == 0)
+            m_threshold = 1;
+    }
+    double GetRate() const { return (double)m_threshold / SampleModulus; }
+
+    bool IsSampled(uintptr_t tag) const
+    {
+        if (m_threshold >= SampleModulus)
+            return true;
+        // the tag tables take the low bits of the same hash, so use the high bits here
+        return (MixTag(tag) >> 40) < m_threshold;
+    }
+
+    void PrintRate(std::ostream &ofs) const
+    {
+        if (m_threshold < SampleModulus) {
+            std::streamsize precision = ofs.precision(17);
+            ofs << "sampling rate = " << GetRate() << std::endl;
+            ofs.precision(precision);
+        }
+    }
+};
+
+// One tag table and reuse trie shared by the ThreadStats of all threads,
+// so that a line written by one thread and read by another forms a single
+// segment. Each tag shard has its own lock, and segments are moved out of
+// the table before they go into the trie, so no lock is held across both.
+class SharedReuseStats
+{
+    typedef DataReuseSegment<RunStats *> PtrDataReuseSegment;
+
+private:
+    static const uint32_t ShardCount = 64;
+
+    struct TagShard {
+        std::mutex lock;
+        TagSegmentTable<RunStats *> table;
+    };
+    std::vector<std::unique_ptr<TagShard>> m_tag_shards;
+
+    ConcurrentDataReuse<RunStats *> m_bbl_data_reuse;
+    TagSampler m_sampler;
+
+    // bits 32 and up are free, the table uses the low bits and the sampler the top 24
+    TagShard &GetTagShard(uintptr_t tag) { return *m_tag_shards[(MixTag(tag) >> 32) % ShardCount]; }
+
+public:
+    SharedReuseStats()
+    {
+        for (uint32_t i = 0; i < ShardCount; i++) {
+            m_tag_shards.emplace_back(new TagShard);
+        }
+    }
+
+    // both must be set before the simulation starts
+    void SetReuseAdmission(uint64_t threshold, uint32_t sketch_width = 1 << 16)
+    {
+        m_bbl_data_reuse.setBounded(threshold, sketch_width);
+    }
+    void SetReuseSampling(double rate) { m_sampler.SetRate(rate); }
+
+    void InsertSegOnHit(uintptr_t tag, RunStats *bblstats, bool is_store)
+    {
+        if (!m_sampler.IsSampled(tag))
+            return;
+        PtrDataReuseSegment split;
+        {
+            TagShard &shard = GetTagShard(tag);
+            std::lock_guard<std::mutex> guard(shard.lock);
+            PtrDataReuseSegment *seg = shard.table.insert(tag);
+            seg->insert(bblstats);
+            seg->setCount(1);
+            if (!is_store)
+                return;
+            // split then insert on store
+            split = std::move(*seg);
+            seg->insert(bblstats);
+            seg->setCount(1);
+        }
+        m_bbl_data_reuse.UpdateTrie(&split);
+    }
+
+    void SplitSegOnMiss(uintptr_t tag)
+    {
+        if (!m_sampler.IsSampled(tag))
+            return;
+        PtrDataReuseSegment split;
+        {
+            TagShard &shard = GetTagShard(tag);
+            std::lock_guard<std::mutex> guard(shard.lock);
+            PtrDataReuseSegment *seg = shard.table.find(tag);
+            if (seg == NULL)
+                return;
+            split = std::move(*seg);
+            shard.table.erase(tag);
+        }
+        m_bbl_data_reuse.UpdateTrie(&split);
+    }
+
+    // call after every thread has its BBLIDs assigned, the elements are
+    // the RunStats of different threads, so the solver merges segments
+    // that differ only in the thread they came from
+    // the shared trie has no RunStats of its own, so it converts with
+    // the BBLIDs the threads were assigned
+    void MergeInto(DataReuse<BBLID> &reuse)
+    {
+        m_bbl_data_reuse.MergeInto(reuse, RunStats::_get_id, 1 / m_sampler.GetRate());
+    }
+    double GetReuseSampleRate() { return m_sampler.GetRate(); }
+
+    void PrintDataReuseSegments(std::ostream &ofs)
+    {
+        ofs << HORIZONTAL_LINE << std::endl;
+        ofs << "ReuseSegment - Shared" << std::endl;
+        m_sampler.PrintRate(ofs);
+        m_bbl_data_reuse.PrintAllSegments(ofs, RunStats::_get_id, 1 / m_sampler.GetRate());
+    }
+};
+
+/* ===================================================================== */
+/* Calling context collection */
+/* ===================================================================== */
+
+// The calling context of a BBL is the chain of BBLs open below it on the
+// stack of ThreadStats, cut to the innermost depth of them. A context is
+// interned by the hash of (parent context, bblhash), so the same chain
+// gets the same hash in every run. Once max_nodes contexts exist, a new
+// context is collapsed into the longest shorter one that exists, down to
+// the BBL alone, so memory stays bounded.
+class ContextTree
+{
+private:
+    struct Node {
+        UUID hash;        // of the whole chain
+        UUID parent;      // the hash of the chain without this BBL
+        Node *suffix;     // the chain without its outermost BBL
+        RunStats *bbl;
+        uint32_t depth;
+        RunStats stats;
+        // the context entered from here last, loops enter the same one again
+        RunStats *last_bbl = NULL;
+        Node *last_child = NULL;
+    };
+
+    uint32_t m_depth;
+    size_t m_max_nodes;
+    uint64_t m_collapsed;
+    UUIDHashMap<Node *> m_nodes;
+    Node *m_root;
+    std::vector<Node *> m_stack;
+
+public:
+    // root stands for the region outside of any BBL
+    ContextTree(RunStats *root, uint32_t depth, size_t max_nodes)
+        : m_depth(depth), m_max_nodes(max_nodes), m_collapsed(0)
+    {
+        assert(depth > 0);
+        m_root = new Node();
+        m_root->hash = GLOBAL_BBLHASH;
+        m_root->parent = GLOBAL_BBLHASH;
+        m_root->suffix = m_root;
+        m_root->bbl = root;
+        m_root->depth = 0;
+        m_root->stats.bblhash = root->bblhash;
+        m_nodes.insert(std::make_pair(m_root->hash, m_root));
+        m_stack.reserve(BBL_STACK_RESERVE);
+        m_stack.push_back(m_root);
+    }
+
+    ~ContextTree()
+    {
+        for (auto it = m_nodes.begin(); it != m_nodes.end(); ++it) {
+            delete it->second;
+        }
+    }
+
+    inline void Enter(RunStats *bbl)
+    {
+        Node *context = m_stack.back();
+        if (context->last_bbl != bbl) {
+            context->last_child = Child(context, bbl);
+            context->last_bbl = bbl;
+        }
+        m_stack.push_back(context->last_child);
+    }
+    inline void Exit() { m_stack.pop_back(); }
+    inline RunStats *GetCurrentStats() { return &m_stack.back()->stats; }
+
+    // one row per context, sorted by context hash, BBLIDs have to be assigned already
+    void PrintStats(std::ostream &ofs, int tid)
+    {
+        std::vector<Node *> sorted;
+        for (auto it = m_nodes.begin(); it != m_nodes.end(); ++it) {
+            sorted.push_back(it->second);
+        }
+        std::sort(sorted.begin(), sorted.end(),
+            [](Node *lhs, Node *rhs) { return lhs->hash < rhs->hash; });
+        ofs << HORIZONTAL_LINE << std::endl;
+        ofs << "Context - Thread " << tid << ", depth " << m_depth << ", collapsed " << m_collapsed << std::endl;
+        ofs << std::setw(7) << "BBLID"
+            << std::setw(15) << "Time(ns)"
+            << std::setw(15) << "Instruction"
+            << std::setw(15) << "Memory Access"
+            << std::setw(18) << "Hash(hi)"
+            << std::setw(18) << "Hash(lo)"
+            << std::setw(18) << "Context(hi)"
+            << std::setw(18) << "Context(lo)"
+            << std::setw(18) << "Parent(hi)"
+            << std::setw(18) << "Parent(lo)"
+            << std::endl;
+        for (auto node : sorted) {
+            ofs << std::setw(7) << node->bbl->bblid
+                << std::setw(15) << node->stats.elapsed_time
+                << std::setw(15) << node->stats.instruction_count
+                << std::setw(15) << node->stats.memory_access
+                << std::hex << std::setfill('0');
+            for (const UUID *hash : {&node->bbl->bblhash, &node->hash, &node->parent}) {
+                ofs << "  " << std::setw(16) << hash->first
+                    << "  " << std::setw(16) << hash->second;
+            }
+            ofs << std::setfill(' ') << std::dec << std::endl;
+        }
+    }
+
+private:
+    static UUID Combine(const UUID &parent, const UUID &bblhash)
+    {
+        uint64_t hi = MixTag(parent.first ^ MixTag(bblhash.first ^ 0x9e3779b97f4a7c15ULL));
+        uint64_t lo = MixTag(parent.second ^ MixTag(bblhash.second ^ 0xc2b2ae3d27d4eb4fULL) ^ hi);
+        return UUID(hi, lo);
+    }
+
+    // the context of bbl entered from context, created unless collapsed
+    Node *Child(Node *context, RunStats *bbl)
+    {
+        if (context->depth >= m_depth)
+            context = context->suffix;
+        while (true) {
+            UUID hash = Combine(context->hash, bbl->bblhash);
+            auto it = m_nodes.find(hash);
+            if (it != m_nodes.end())
+                return it->second;
+            if (context == m_root || m_nodes.size() < m_max_nodes)
+                return Create(context, bbl, hash);
+            m_collapsed++;
+            context = context->suffix;
+        }
+    }
+
+    Node *Create(Node *context, RunStats *bbl, const UUID &hash)
+    {
+        Node *node = new Node();
+        node->hash = hash;
+        node->parent = context->hash;
+        node->bbl = bbl;
+        node->depth = context->depth + 1;
+        node->stats.bblhash = bbl->bblhash;
+        m_nodes.insert(std::make_pair(hash, node));
+        if (context == m_root) {
+            node->suffix = m_root;
+        }
+        else {
+            // the shorter chains are made regardless of max_nodes, there are at most depth of them
+            UUID suffix = Combine(context->suffix->hash, bbl->bblhash);
+            auto it = m_nodes.find(suffix);
+            node->suffix = (it != m_nodes.end() ? it->second : Create(context->suffix, bbl, suffix));
+        }
+        return node;
+    }
+};
+
 class ThreadStats
 {
+    friend class ProfileMerger;
+
     typedef SwitchCountMatrix<RunStats *> PtrSwitchCountMatrix;
     typedef DataReuseSegment<RunStats *> PtrDataReuseSegment;
     typedef DataReuse<RunStats *> PtrDataReuse;
@@ -115,38 +552,134 @@ private:
     // All class objects need to be stored in pointer form,
     // otherwise Sniper will somehow deallocate them unexpectedly.
     UUIDHashMap<RunStats *> *m_bbl_hash2stats;
+    // owns the RunStats of m_bbl_hash2stats and last_begin_bblstats
+    RunStatsPool *m_stats_pool;
+
+    // BBLEnd and OffloadEnd that did not match the open BBL, reported by
+    // PrintMismatches instead of on every event
+    uint64_t m_bblend_mismatch;
+    uint64_t m_offloadend_mismatch;
+    UUID m_first_mismatch[2]; // the BBLEnd hash and the open BBL, of the first BBLEnd mismatch
 
     // count the number of times BBL switch from one to another
     PtrSwitchCountMatrix *m_bbl_switch_count;
 
-    // a map from tag to data reuse segments
-    std::unordered_map<uint64_t, PtrDataReuseSegment *> *m_tag2seg;
+    // Direct-mapped lookaside caches in front of m_bbl_hash2stats and
+    // m_bbl_switch_count, so that a loop over a few BBLs costs BBLStart
+    // a couple of compares and an increment. BBL hashes are random
+    // already, their low bits index the cache.
+    struct BBLCacheEntry {
+        UUID bblhash;
+        RunStats *stats = NULL;
+    };
+    static const uint32_t BBLCacheSize = 256;
+    BBLCacheEntry m_bbl_cache[BBLCacheSize];
+
+    struct SwitchCacheEntry {
+        RunStats *from = NULL, *to = NULL;
+        uint64_t *counter = NULL;
+        uint64_t *epoch_counter = NULL;
+        uint64_t version = 0; // SwitchVersion() when the counters were taken
+    };
+    static const uint32_t SwitchCacheSize = 64;
+    SwitchCacheEntry m_switch_cache[SwitchCacheSize];
+
+    // a map from tag to the open data reuse segment of that cache line
+    TagSegmentTable<RunStats *> *m_tag2seg;
 
     // data structure for storing data reuse info
     PtrDataReuse *m_bbl_data_reuse;
 
+    TagSampler m_sampler;
+
+    // if set, reuse is collected there instead of m_tag2seg and m_bbl_data_reuse
+    SharedReuseStats *m_shared_reuse;
+
+    // Epoch profiling, off while m_epoch_switch_count is NULL. An epoch
+    // keeps what each BBL added to its stats and the switches taken while
+    // it was open, so the solver can tell the phases of a run apart.
+    struct EpochRecord {
+        std::vector<std::pair<RunStats *, RunStats>> stats;
+        PtrSwitchCountMatrix switches;
+    };
+    std::vector<EpochRecord> m_epochs;
+    size_t m_epoch_first; // the index of m_epochs[0], dumped epochs are dropped
+    uint64_t m_epoch_length;       // cut every that many instructions, 0 for markers only
+    uint64_t m_epoch_instructions; // since the last cut
+    // the stats of every BBL at the last cut
+    std::unordered_map<RunStats *, RunStats> m_epoch_base;
+    // the BBLs that changed in the open epoch, each once, so that a cut
+    // only looks at those; m_epoch_stamp numbers the open epoch
+    std::vector<RunStats *> m_epoch_dirty;
+    uint64_t m_epoch_stamp;
+    // the switches of the open epoch
+    PtrSwitchCountMatrix *m_epoch_switch_count;
+    // what the switch cache counts epoch switches into while epochs are off
+    uint64_t m_epoch_switch_dummy;
+
+    // streaming dumps, see DumpDelta
+    uint64_t m_dump_interval;     // dump every that many instructions, 0 for off
+    uint64_t m_dump_instructions; // since the last dump
+    std::ostream *m_dump_stats;
+    std::ostream *m_dump_reuse;
+    int m_dump_count;
+    // the stats of every BBL at the last dump
+    std::unordered_map<RunStats *, RunStats> m_dump_base;
+
+    // calling context stats, off while NULL
+    ContextTree *m_context_tree;
+
+    // timing sampling, see SetTimingSampling, one sampler per kind of
+    // event so that interleaved calls do not skip one kind altogether
+    EventSampler m_time_sampler;
+    EventSampler m_memory_sampler;
+    EventSampler m_cputime_sampler;
+
 public:
     ThreadStats(int _tid = 0)
         : tid(_tid)
         , m_pim_time(0)
         , m_switch_cpu2pim(0)
         , m_switch_pim2cpu(0)
+        , m_bblend_mismatch(0)
+        , m_offloadend_mismatch(0)
+        , m_shared_reuse(NULL)
+        , m_epoch_first(0)
+        , m_epoch_length(0)
+        , m_epoch_instructions(0)
+        , m_epoch_stamp(1)
+        , m_epoch_switch_count(NULL)
+        , m_epoch_switch_dummy(0)
+        , m_dump_interval(0)
+        , m_dump_instructions(0)
+        , m_dump_stats(NULL)
+        , m_dump_reuse(NULL)
+        , m_dump_count(0)
+        , m_context_tree(NULL)
     {
+        // the event handlers allocate nothing once every BBL has been
+        // seen, so the stacks are sized up front. Epochs and dumps are the
+        // exceptions: a cut allocates the record of the closed epoch, the
+        // list of changed BBLs grows until it has held every BBL of an
+        // epoch, and DumpDelta allocates and writes to its streams.
         m_using_pim = new std::vector<bool>;
+        m_using_pim->reserve(BBL_STACK_RESERVE);
         m_using_pim->push_back(false);
 
         // GLOBAL_BBLHASH is the region outside main function.
+        m_stats_pool = new RunStatsPool();
         m_bbl_hash2stats = new UUIDHashMap<RunStats *>;
-        RunStats *globalstats = new RunStats();
+        RunStats *globalstats = m_stats_pool->New(GLOBAL_BBLID, GLOBAL_BBLHASH);
         m_bbl_hash2stats->insert(std::make_pair(GLOBAL_BBLHASH, globalstats));
 
         m_current_bblstats = new std::vector<PIMProf::RunStats *>;
+        m_current_bblstats->reserve(BBL_STACK_RESERVE);
         m_current_bblstats->push_back(globalstats);
 
-        last_begin_bblstats = new RunStats(GLOBAL_BBLID, bblhash);
+        last_begin_bblstats = m_stats_pool->New(GLOBAL_BBLID, GLOBAL_BBLHASH);
 
         m_bbl_switch_count = new PtrSwitchCountMatrix();
-        m_tag2seg = new std::unordered_map<uint64_t, PtrDataReuseSegment *>;
+        m_tag2seg = new TagSegmentTable<RunStats *>;
         m_bbl_data_reuse = new PtrDataReuse();
     }
 
@@ -167,28 +700,118 @@ public:
 
         std::cout << "switch CPU to PIM = " << m_switch_cpu2pim << std::endl;
         std::cout << "switch PIM to CPU = " << m_switch_pim2cpu << std::endl;
+        PrintMismatches(std::cout);
 
         delete m_using_pim;
         delete m_current_bblstats;
 
-        for (auto it = m_bbl_hash2stats->begin(); it != m_bbl_hash2stats->end(); ++it)
-        {
-            delete it->second;
-        }
         delete m_bbl_hash2stats;
+        delete m_stats_pool;
 
         delete m_bbl_switch_count;
 
-        for (auto it = m_tag2seg->begin(); it != m_tag2seg->end(); ++it)
-        {
-            delete it->second;
-        }
         delete m_tag2seg;
 
         delete m_bbl_data_reuse;
+
+        delete m_epoch_switch_count;
+
+        delete m_context_tree;
     }
 
     void setTid(int _tid) { tid = _tid; }
+
+    // Keep a reuse segment out of the trie until it has been seen about
+    // threshold times, see DataReuse::setBounded
+    void SetReuseAdmission(uint64_t threshold, uint32_t sketch_width = 1 << 16)
+    {
+        m_bbl_data_reuse->setBounded(threshold, sketch_width);
+    }
+
+    // see TagSampler
+    void SetReuseSampling(double rate) { m_sampler.SetRate(rate); }
+    double GetReuseSampleRate() { return m_sampler.GetRate(); }
+
+    // Collect reuse into a profile shared with other threads, the
+    // sampling and admission settings of shared apply then.
+    void AttachSharedReuse(SharedReuseStats *shared) { m_shared_reuse = shared; }
+
+    // Cut the profile into epochs of about instructions each, or only at
+    // EpochMarker if instructions is 0. Epochs are printed by
+    // PrintEpochStats and PrintEpochSwitchCount.
+    void SetEpochLength(uint64_t instructions)
+    {
+        m_epoch_length = instructions;
+        if (m_epoch_switch_count == NULL) {
+            m_epoch_switch_count = new PtrSwitchCountMatrix();
+            ClearSwitchCache();
+            // what the BBLs did so far goes into the first epoch
+            for (auto it = m_bbl_hash2stats->begin(); it != m_bbl_hash2stats->end(); ++it) {
+                TouchEpoch(it->second);
+            }
+        }
+    }
+
+    // Record only one in period calls of AddTimeInstruction, AddMemory and
+    // AddCPUTime, scaled by period, see EventSampler. The stats then carry
+    // a confidence interval for the time of each BBL. Periodic sampling
+    // is biased when the period lines up with a loop of the program.
+    void SetTimingSampling(uint64_t period, bool periodic = false)
+    {
+        m_time_sampler.SetPeriod(period, !periodic, ((uint64_t)tid << 2) | 1);
+        m_memory_sampler.SetPeriod(period, !periodic, ((uint64_t)tid << 2) | 2);
+        m_cputime_sampler.SetPeriod(period, !periodic, ((uint64_t)tid << 2) | 3);
+    }
+
+    // Keep stats per calling context as well, see ContextTree. Each context
+    // takes about 100 bytes.
+    void SetContextDepth(uint32_t depth, size_t max_nodes = 1 << 20)
+    {
+        delete m_context_tree;
+        m_context_tree = new ContextTree((*m_current_bblstats)[0], depth, max_nodes);
+        // the BBLs open now are the context of what comes next
+        for (size_t i = 1; i < m_current_bblstats->size(); ++i) {
+            m_context_tree->Enter((*m_current_bblstats)[i]);
+        }
+    }
+
+    // close the open epoch here, ignored unless SetEpochLength was called
+    void EpochMarker()
+    {
+        if (m_epoch_switch_count == NULL)
+            return;
+        m_epochs.emplace_back();
+        EpochRecord &record = m_epochs.back();
+        for (RunStats *stats : m_epoch_dirty) {
+            RunStats &base = m_epoch_base[stats];
+            RunStats delta(GLOBAL_BBLID, stats->bblhash,
+                stats->elapsed_time - base.elapsed_time,
+                stats->instruction_count - base.instruction_count,
+                stats->memory_access - base.memory_access);
+            delta.elapsed_time_var = stats->elapsed_time_var - base.elapsed_time_var;
+            if (delta.elapsed_time != 0 || delta.instruction_count != 0 || delta.memory_access != 0) {
+                record.stats.push_back(std::make_pair(stats, delta));
+                base = *stats;
+            }
+        }
+        m_epoch_dirty.clear();
+        m_epoch_stamp++;
+        record.switches = std::move(*m_epoch_switch_count);
+        *m_epoch_switch_count = PtrSwitchCountMatrix();
+        // the cached epoch counters point into the matrix just closed
+        ClearSwitchCache();
+        m_epoch_instructions = 0;
+    }
+
+    // remember that stats changed in the open epoch, while epochs are on
+    inline void TouchEpoch(RunStats *stats)
+    {
+        if (m_epoch_switch_count != NULL && stats->epoch_stamp != m_epoch_stamp) {
+            stats->epoch_stamp = m_epoch_stamp;
+            m_epoch_dirty.push_back(stats);
+        }
+    }
+
     bool IsUsingPIM() { return m_using_pim->back(); }
 
     RunStats *GetCurrentRunStats() { return m_current_bblstats->back(); }
@@ -200,34 +823,53 @@ public:
     void BBLStart(uint64_t hi, uint64_t lo)
     {
         UUID bblhash = UUID(hi, lo);
-        RunStats *prev_back = GetCurrentRunStats();
-        auto it = m_bbl_hash2stats->find(bblhash);
-        
-        
-        if (it == m_bbl_hash2stats->end()) {
-            RunStats *stats = new RunStats(GLOBAL_BBLID, bblhash);
-            m_bbl_hash2stats->insert(std::make_pair(bblhash, stats));
-            m_current_bblstats->push_back(stats);
-        }
-        else {
-            m_current_bblstats->push_back(it->second);
+        BBLCacheEntry &entry = m_bbl_cache[(hi ^ lo) % BBLCacheSize];
+        if (entry.stats == NULL || entry.bblhash != bblhash) {
+            auto it = m_bbl_hash2stats->find(bblhash);
+            if (it == m_bbl_hash2stats->end()) {
+                // numbered in order of appearance until AssignBBLID
+                RunStats *stats = m_stats_pool->New(m_bbl_hash2stats->size(), bblhash);
+                it = m_bbl_hash2stats->insert(std::make_pair(bblhash, stats)).first;
+            }
+            entry.bblhash = bblhash;
+            entry.stats = it->second;
         }
+        RunStats *stats = entry.stats;
+        m_current_bblstats->push_back(stats);
+        if (m_context_tree != NULL)
+            m_context_tree->Enter(stats);
 
-        m_bbl_switch_count->insert(last_begin_bblstats, GetCurrentRunStats());
-        last_begin_bblstats = GetCurrentRunStats();
+        SwitchCacheEntry &transition = m_switch_cache[
+            (((uintptr_t)last_begin_bblstats >> 4) * 31 + ((uintptr_t)stats >> 4)) % SwitchCacheSize];
+        if (transition.from != last_begin_bblstats || transition.to != stats
+            || transition.version != SwitchVersion()) {
+            transition.from = last_begin_bblstats;
+            transition.to = stats;
+            transition.counter = m_bbl_switch_count->getCounter(last_begin_bblstats, stats);
+            transition.epoch_counter = m_epoch_switch_count == NULL ? &m_epoch_switch_dummy
+                : m_epoch_switch_count->getCounter(last_begin_bblstats, stats);
+            transition.version = SwitchVersion();
+        }
+        ++*transition.counter;
+        ++*transition.epoch_counter;
+        last_begin_bblstats = stats;
     }
 
     void BBLEnd(uint64_t hi, uint64_t lo)
     {
         UUID bblhash = UUID(hi, lo);
-        RunStats *prev_back = GetCurrentRunStats();
-        // printf("%d: %lx %lx %lx %lx\n", tid, bblhash.first, bblhash.second, GetCurrentBBLHash().first, GetCurrentBBLHash().second);
-        if (bblhash != GetCurrentBBLHash()) 
-        {
-            printf("BBLEnd annotator not match: %d %lx %lx %lx %lx\n", tid, bblhash.first, bblhash.second, GetCurrentBBLHash().first, GetCurrentBBLHash().second);
+        if (bblhash != GetCurrentBBLHash()) {
+            if (m_bblend_mismatch++ == 0) {
+                m_first_mismatch[0] = bblhash;
+                m_first_mismatch[1] = GetCurrentBBLHash();
+            }
+            // the global BBL is never closed
+            if (m_current_bblstats->size() == 1)
+                return;
         }
-        assert(bblhash == GetCurrentBBLHash());
         m_current_bblstats->pop_back();
+        if (m_context_tree != NULL)
+            m_context_tree->Exit();
     }
 
     void OffloadStart(uint64_t hi, uint64_t type)
@@ -253,11 +895,11 @@ public:
     {
         // printf("End %d %lx %lu\n", tid, hi, type);
         if (m_using_pim->back() != (type == PIMPROF_DECISION_PIM)) {
-            printf("OffloadEnd annotator not match: %d %lx %lu\n", tid, hi, type);
+            m_offloadend_mismatch++;
         }
-        assert(m_using_pim->back() == (type == PIMPROF_DECISION_PIM));
         bool prev_back = m_using_pim->back();
-        m_using_pim->pop_back();
+        if (m_using_pim->size() > 1)
+            m_using_pim->pop_back();
         if (prev_back != m_using_pim->back()) {
             if (prev_back) {
                 m_switch_pim2cpu++;
@@ -273,13 +915,40 @@ public:
     void AddTimeInstruction(uint64_t time, uint64_t instr)
     {
         RunStats *bblstats = GetCurrentRunStats();
+        if (m_time_sampler.Enabled()) {
+            if (!m_time_sampler.Sample())
+                return;
+            time *= m_time_sampler.GetPeriod();
+            instr *= m_time_sampler.GetPeriod();
+            bblstats->elapsed_time_var += m_time_sampler.Variance((COST)time / 1e6);
+        }
         bblstats->elapsed_time += (COST)time / 1e6;
         bblstats->instruction_count += instr;
+        TouchEpoch(bblstats);
+        if (m_context_tree != NULL) {
+            RunStats *contextstats = m_context_tree->GetCurrentStats();
+            contextstats->elapsed_time += (COST)time / 1e6;
+            contextstats->instruction_count += instr;
+        }
+        m_epoch_instructions += instr;
+        if (m_epoch_length > 0 && m_epoch_instructions >= m_epoch_length)
+            EpochMarker();
+        m_dump_instructions += instr;
+        if (m_dump_interval > 0 && m_dump_instructions >= m_dump_interval)
+            DumpDelta(*m_dump_stats, *m_dump_reuse);
     }
 
     void AddMemory(uint64_t memory_access)
     {
+        if (m_memory_sampler.Enabled()) {
+            if (!m_memory_sampler.Sample())
+                return;
+            memory_access *= m_memory_sampler.GetPeriod();
+        }
         GetCurrentRunStats()->memory_access += memory_access;
+        TouchEpoch(GetCurrentRunStats());
+        if (m_context_tree != NULL)
+            m_context_tree->GetCurrentStats()->memory_access += memory_access;
     }
 
     // time unit is FS (1e-6 NS)
@@ -290,17 +959,13 @@ public:
 
     void InsertSegOnHit(uintptr_t tag, bool is_store)
     {
-        PtrDataReuseSegment *seg;
-        auto it = m_tag2seg->find(tag);
-        if (it == m_tag2seg->end())
-        {
-            seg = new PtrDataReuseSegment();
-            m_tag2seg->insert(std::make_pair(tag, seg));
-        }
-        else
-        {
-            seg = it->second;
+        if (m_shared_reuse != NULL) {
+            m_shared_reuse->InsertSegOnHit(tag, GetCurrentRunStats(), is_store);
+            return;
         }
+        if (!m_sampler.IsSampled(tag))
+            return;
+        PtrDataReuseSegment *seg = m_tag2seg->insert(tag);
         RunStats *bblstats = GetCurrentRunStats();
         seg->insert(bblstats);
         // int32_t threadcount = _storage->_cost_package->_thread_count;
@@ -319,13 +984,18 @@ public:
 
     void SplitSegOnMiss(uintptr_t tag)
     {
-        PtrDataReuseSegment *seg;
-        auto it = m_tag2seg->find(tag);
-        if (it == m_tag2seg->end())
+        if (m_shared_reuse != NULL) {
+            m_shared_reuse->SplitSegOnMiss(tag);
+            return;
+        }
+        if (!m_sampler.IsSampled(tag))
+            return;
+        PtrDataReuseSegment *seg = m_tag2seg->find(tag);
+        if (seg == NULL)
             return; // ignore it if there is no existing segment
-        seg = it->second;
         m_bbl_data_reuse->UpdateTrie(m_bbl_data_reuse->getRoot(), seg);
-        seg->clear();
+        // the line is out of the cache, its next hit opens a new segment
+        m_tag2seg->erase(tag);
     }
 
     void MergeStatsMap(UUIDHashMap<RunStats *> &statsmap)
@@ -370,6 +1040,22 @@ public:
         ofs << m_pim_time << std::endl;
     }
 
+    uint64_t GetMismatchCount() { return m_bblend_mismatch + m_offloadend_mismatch; }
+
+    // the annotations that did not match, nothing if all of them did
+    void PrintMismatches(std::ostream &ofs)
+    {
+        if (GetMismatchCount() == 0)
+            return;
+        ofs << "BBLEnd annotator not match = " << m_bblend_mismatch << std::endl;
+        if (m_bblend_mismatch > 0) {
+            ofs << "first BBLEnd not match: " << std::hex
+                << m_first_mismatch[0].first << " " << m_first_mismatch[0].second << ", open "
+                << m_first_mismatch[1].first << " " << m_first_mismatch[1].second << std::dec << std::endl;
+        }
+        ofs << "OffloadEnd annotator not match = " << m_offloadend_mismatch << std::endl;
+    }
+
     // void PrintDataReuseDotGraph(std::ostream &ofs)
     // {
     //     m_bbl_data_reuse->PrintDotGraph(ofs);
@@ -379,36 +1065,15 @@ public:
     {
         std::vector<RunStats *> sorted;
         SortStatsMap(*m_bbl_hash2stats, sorted);
-
-        ofs << HORIZONTAL_LINE << std::endl;
-        ofs << "Thread " << tid << std::endl;
-        ofs << std::setw(7) << "BBLID"
-            << std::setw(15) << "Time(ns)"
-            << std::setw(15) << "Instruction"
-            << std::setw(15) << "Memory Access"
-            << std::setw(18) << "Hash(hi)"
-            << std::setw(18) << "Hash(lo)"
-            << std::endl;
-        for (auto it : sorted)
-        {
-            UUID bblhash = it->bblhash;
-            ofs << std::setw(7) << it->bblid
-                << std::setw(15) << it->elapsed_time
-                << std::setw(15) << it->instruction_count
-                << std::setw(15) << it->memory_access
-                << "  " << std::hex
-                << std::setfill('0') << std::setw(16) << bblhash.first
-                << "  "
-                << std::setfill('0') << std::setw(16) << bblhash.second
-                << std::setfill(' ') << std::dec << std::endl;
-        }
+        PrintStatsTable(ofs, "Thread " + std::to_string(tid), sorted);
     }
 
     void PrintDataReuseSegments(std::ostream &ofs)
     {
         ofs << HORIZONTAL_LINE << std::endl;
         ofs << "ReuseSegment - Thread " << tid << std::endl;
-        m_bbl_data_reuse->PrintAllSegments(ofs, RunStats::_get_id);
+        m_sampler.PrintRate(ofs);
+        m_bbl_data_reuse->PrintAllSegments(ofs, RunStats::_get_id, 1 / m_sampler.GetRate());
     }
 
     void PrintAllDotGraph(std::ostream &ofs)
@@ -432,17 +1097,435 @@ public:
         m_bbl_switch_count->print(ofs, RunStats::_get_id);
     }
 
+    // One stats section per epoch, to be printed after PrintStats.
+    // BBLIDs have to be assigned already.
+    void PrintEpochStats(std::ostream &ofs)
+    {
+        CloseLastEpoch();
+        PrintEpochStatsTables(ofs);
+    }
+
+    // one switch count section per epoch, to be printed after PrintBBLSwitchCount
+    void PrintEpochSwitchCount(std::ostream &ofs)
+    {
+        CloseLastEpoch();
+        PrintEpochSwitchTables(ofs);
+    }
+
+    // the stats of every calling context, BBLIDs have to be assigned already
+    void PrintContextStats(std::ostream &ofs)
+    {
+        if (m_context_tree != NULL)
+            m_context_tree->PrintStats(ofs, tid);
+    }
+
+    // Dump every instructions to stats and reuse, which have to stay open
+    // until the last DumpDelta.
+    void SetDumpInterval(uint64_t instructions, std::ostream *stats, std::ostream *reuse)
+    {
+        m_dump_interval = instructions;
+        m_dump_stats = stats;
+        m_dump_reuse = reuse;
+    }
+
+    // Append what changed since the last dump: the stats of every BBL that
+    // changed or is new, the reuse segments and switch counts, and the
+    // finished epochs. What is written is dropped from memory, so the
+    // profile only holds one interval, and the solver adds the deltas up.
+    // Until AssignBBLID, which a dumped profile must not get, BBLs are
+    // numbered per thread and the stats rows map the numbers to hashes.
+    // last also closes the open epoch, use it for the final dump.
+    void DumpDelta(std::ostream &stats, std::ostream &reuse, bool last = false)
+    {
+        if (last)
+            CloseLastEpoch();
+        std::vector<RunStats> deltas;
+        for (auto it = m_bbl_hash2stats->begin(); it != m_bbl_hash2stats->end(); ++it) {
+            RunStats *current = it->second;
+            auto base = m_dump_base.find(current);
+            bool seen = (base != m_dump_base.end());
+            if (!seen) {
+                base = m_dump_base.insert(std::make_pair(current, RunStats(current->bblid, current->bblhash))).first;
+            }
+            RunStats delta(current->bblid, current->bblhash,
+                current->elapsed_time - base->second.elapsed_time,
+                current->instruction_count - base->second.instruction_count,
+                current->memory_access - base->second.memory_access);
+            delta.elapsed_time_var = current->elapsed_time_var - base->second.elapsed_time_var;
+            // a new BBL is written even without stats, it may be in a segment
+            if (!seen || delta.elapsed_time != 0 || delta.instruction_count != 0 || delta.memory_access != 0) {
+                deltas.push_back(delta);
+                base->second = *current;
+            }
+        }
+        std::vector<RunStats *> sorted;
+        for (auto &delta : deltas) {
+            sorted.push_back(&delta);
+        }
+        std::sort(sorted.begin(), sorted.end(),
+            [](RunStats *lhs, RunStats *rhs) { return lhs->bblhash < rhs->bblhash; });
+        std::string suffix = std::to_string(m_dump_count) + " - Thread " + std::to_string(tid);
+        PrintStatsTable(stats, "Delta " + std::to_string(m_dump_count) + " Thread " + std::to_string(tid), sorted);
+        PrintEpochStatsTables(stats);
+
+        // the shared reuse profile is not per thread, it is printed as a whole
+        if (m_shared_reuse == NULL) {
+            reuse << HORIZONTAL_LINE << std::endl;
+            reuse << "ReuseDelta " << suffix << std::endl;
+            m_sampler.PrintRate(reuse);
+            m_bbl_data_reuse->PrintAllSegments(reuse, RunStats::_get_id, 1 / m_sampler.GetRate());
+            m_bbl_data_reuse->DeleteTrie();
+            m_bbl_data_reuse->clearResidual();
+        }
+        reuse << HORIZONTAL_LINE << std::endl;
+        reuse << "SwitchDelta " << suffix << std::endl;
+        m_bbl_switch_count->print(reuse, RunStats::_get_id);
+        *m_bbl_switch_count = PtrSwitchCountMatrix();
+        ClearSwitchCache();
+        PrintEpochSwitchTables(reuse);
+
+        m_epoch_first += m_epochs.size();
+        m_epochs.clear();
+        stats.flush();
+        reuse.flush();
+        m_dump_count++;
+        m_dump_instructions = 0;
+    }
+
   private:
     UUIDHashMap<COST> m_bblhash2cputime;
 
+    // the epoch counters are part of the version, a cut clears the cache instead
+    inline uint64_t SwitchVersion()
+    {
+        return m_bbl_switch_count->getVersion()
+            + (m_epoch_switch_count == NULL ? 0 : m_epoch_switch_count->getVersion());
+    }
+
+    void ClearSwitchCache()
+    {
+        for (uint32_t i = 0; i < SwitchCacheSize; ++i) {
+            m_switch_cache[i] = SwitchCacheEntry();
+        }
+    }
+
+    void PrintEpochStatsTables(std::ostream &ofs)
+    {
+        for (size_t e = 0; e < m_epochs.size(); ++e) {
+            std::vector<RunStats *> sorted;
+            for (auto &it : m_epochs[e].stats) {
+                it.second.bblid = it.first->bblid;
+                sorted.push_back(&it.second);
+            }
+            std::sort(sorted.begin(), sorted.end(),
+                [](RunStats *lhs, RunStats *rhs) { return lhs->bblhash < rhs->bblhash; });
+            PrintStatsTable(ofs, "Epoch " + std::to_string(m_epoch_first + e) + " Thread " + std::to_string(tid), sorted);
+        }
+    }
+
+    void PrintEpochSwitchTables(std::ostream &ofs)
+    {
+        for (size_t e = 0; e < m_epochs.size(); ++e) {
+            ofs << HORIZONTAL_LINE << std::endl;
+            ofs << "EpochSwitchCount " << m_epoch_first + e << " - Thread " << tid << std::endl;
+            m_epochs[e].switches.print(ofs, RunStats::_get_id);
+        }
+    }
+
+    // the instructions after the last cut make up one more epoch
+    void CloseLastEpoch()
+    {
+        if (m_epoch_instructions > 0)
+            EpochMarker();
+    }
+
   public:
     void AddCPUTime(uint64_t time)
     {
+        if (m_cputime_sampler.Enabled()) {
+            if (!m_cputime_sampler.Sample())
+                return;
+            time *= m_cputime_sampler.GetPeriod();
+        }
         UUID bblhash = GetCurrentBBLHash();
         m_bblhash2cputime[bblhash] += (COST)time / 1e6;
     }
 };
 
+/* ===================================================================== */
+/* ThreadStatsRegistry */
+/* ===================================================================== */
+// Owns the ThreadStats of every simulated thread. Each one sits in its own
+// cache-line-aligned slot, so the counters one thread updates on every
+// event never share a line with those of another. Register is meant to be
+// called by the simulator thread that will use the slot: the slot and
+// everything its constructor allocates are first touched there, so Linux
+// places them on the NUMA node of that thread, and glibc serves them from
+// the malloc arena of that thread. The calling thread can find its
+// ThreadStats again with Local, without a lookup or a lock.
+class ThreadStatsRegistry
+{
+private:
+    static const size_t CacheLineSize = 64;
+
+    struct alignas(64) Slot {
+        ThreadStats stats;
+        Slot(int tid) : stats(tid) {}
+    };
+
+    std::mutex m_lock;
+    std::vector<Slot *> m_slots; // by tid, NULL until registered
+
+    // the slot of the calling thread, and the registry it belongs to
+    static std::pair<ThreadStatsRegistry *, ThreadStats *> &LocalSlot()
+    {
+        static thread_local std::pair<ThreadStatsRegistry *, ThreadStats *> local(NULL, NULL);
+        return local;
+    }
+
+public:
+    // max_threads is only a hint, e.g. the core count of the Sniper config
+    ThreadStatsRegistry(int max_threads = 128)
+    {
+        m_slots.reserve(max_threads);
+    }
+
+    ~ThreadStatsRegistry()
+    {
+        for (auto slot : m_slots) {
+            if (slot == NULL)
+                continue;
+            slot->~Slot();
+            free(slot);
+        }
+        if (LocalSlot().first == this)
+            LocalSlot() = std::make_pair((ThreadStatsRegistry *)NULL, (ThreadStats *)NULL);
+    }
+
+    ThreadStatsRegistry(const ThreadStatsRegistry &) = delete;
+    ThreadStatsRegistry &operator=(const ThreadStatsRegistry &) = delete;
+
+    // the ThreadStats of tid, created on the calling thread if it is new,
+    // and bound to the calling thread either way
+    ThreadStats *Register(int tid)
+    {
+        assert(tid >= 0);
+        Slot *slot;
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if ((size_t)tid >= m_slots.size())
+                m_slots.resize(tid + 1, NULL);
+            slot = m_slots[tid];
+        }
+        if (slot == NULL) {
+            void *memory = NULL;
+            if (posix_memalign(&memory, CacheLineSize, sizeof(Slot)) != 0)
+                throw std::bad_alloc();
+            slot = new (memory) Slot(tid);
+            std::lock_guard<std::mutex> guard(m_lock);
+            assert(m_slots[tid] == NULL);
+            m_slots[tid] = slot;
+        }
+        LocalSlot() = std::make_pair(this, &slot->stats);
+        return &slot->stats;
+    }
+
+    // the ThreadStats last registered on the calling thread, NULL if none
+    ThreadStats *Local()
+    {
+        std::pair<ThreadStatsRegistry *, ThreadStats *> &local = LocalSlot();
+        return local.first == this ? local.second : NULL;
+    }
+
+    // NULL if tid has not registered
+    ThreadStats *Get(int tid)
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        return (size_t)tid < m_slots.size() && m_slots[tid] != NULL ? &m_slots[tid]->stats : NULL;
+    }
+
+    // every registered ThreadStats ordered by tid, e.g. for ProfileMerger::Merge
+    std::vector<ThreadStats *> Threads()
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        std::vector<ThreadStats *> threads;
+        for (auto slot : m_slots) {
+            if (slot != NULL)
+                threads.push_back(&slot->stats);
+        }
+        return threads;
+    }
+};
+
+/* ===================================================================== */
+/* ProfileMerger */
+/* ===================================================================== */
+// Merge the profiles of all threads at the end of a simulation into one
+// that is keyed by BBLID. The stats maps, reuse tries and switch matrices
+// are folded pairwise in a tree on a thread pool, so n threads take
+// ceil(log2(n)) rounds. The stats of each thread are kept apart, so the
+// solver still gets the elapsed time of every thread.
+class ProfileMerger
+{
+private:
+    struct MergedStats {
+        RunStats total;
+        // the stats of every thread that ran the BBL, ordered by tid after Merge
+        std::vector<std::pair<int, RunStats>> threads;
+    };
+    typedef UUIDHashMap<MergedStats> MergedStatsMap;
+
+    int m_nthreads;
+    MergedStatsMap m_stats;
+    std::vector<MergedStats *> m_sorted; // by BBLID
+    DataReuse<BBLID> m_bbl_data_reuse;
+    SwitchCountMatrix<BBLID> m_bbl_switch_count;
+    double m_sample_rate;
+
+    static BBLID _get_id(BBLID bblid) { return bblid; }
+
+    // fold(lhs, rhs) merges item rhs into item lhs, the result ends up in item 0
+    template <class Fold>
+    static void TreeReduce(ThreadPool &pool, size_t n, Fold fold)
+    {
+        for (size_t stride = 1; stride < n; stride *= 2) {
+            for (size_t lhs = 0; lhs + stride < n; lhs += 2 * stride) {
+                pool.Submit([=]() { fold(lhs, lhs + stride); });
+            }
+            pool.Wait();
+        }
+    }
+
+public:
+    ProfileMerger(int nthreads = std::thread::hardware_concurrency())
+        : m_nthreads(nthreads), m_sample_rate(1)
+    {
+    }
+
+    // Also assigns the BBLIDs of every thread, as GenerateBBLID and
+    // AssignBBLID do. Reuse collected in shared is merged in as well.
+    void Merge(std::vector<ThreadStats *> &threads, SharedReuseStats *shared = NULL)
+    {
+        ThreadPool pool(m_nthreads);
+        size_t n = threads.size();
+
+        std::vector<MergedStatsMap> maps(n);
+        for (size_t i = 0; i < n; i++) {
+            pool.Submit([&, i]() {
+                for (auto &it : *threads[i]->m_bbl_hash2stats) {
+                    MergedStats &merged = maps[i][it.first];
+                    merged.total = *it.second;
+                    merged.threads.push_back(std::make_pair(threads[i]->tid, *it.second));
+                }
+            });
+        }
+        pool.Wait();
+        TreeReduce(pool, n, [&](size_t lhs, size_t rhs) {
+            for (auto &it : maps[rhs]) {
+                auto p = maps[lhs].find(it.first);
+                if (p == maps[lhs].end()) {
+                    maps[lhs].insert(std::make_pair(it.first, std::move(it.second)));
+                }
+                else {
+                    p->second.total.MergeStats(it.second.total);
+                    p->second.threads.insert(p->second.threads.end(), it.second.threads.begin(), it.second.threads.end());
+                }
+            }
+            MergedStatsMap().swap(maps[rhs]);
+        });
+        m_stats.clear();
+        if (n > 0) m_stats.swap(maps[0]);
+
+        // the same BBLIDs as GenerateBBLID
+        m_sorted.clear();
+        for (auto &it : m_stats) {
+            m_sorted.push_back(&it.second);
+        }
+        std::sort(m_sorted.begin(), m_sorted.end(),
+            [](MergedStats *lhs, MergedStats *rhs) { return lhs->total.bblhash < rhs->total.bblhash; });
+        for (BBLID i = 0; i < (BBLID)m_sorted.size(); ++i) {
+            MergedStats &merged = *m_sorted[i];
+            merged.total.bblid = i;
+            std::sort(merged.threads.begin(), merged.threads.end(),
+                [](const std::pair<int, RunStats> &lhs, const std::pair<int, RunStats> &rhs) { return lhs.first < rhs.first; });
+            for (auto &thread : merged.threads) {
+                thread.second.bblid = i;
+            }
+        }
+
+        // item 0 of each fold is the result itself
+        m_bbl_data_reuse.DeleteTrie();
+        m_bbl_switch_count = SwitchCountMatrix<BBLID>();
+        m_sample_rate = 1;
+        std::vector<std::unique_ptr<DataReuse<BBLID>>> owned_reuse(n);
+        std::vector<std::unique_ptr<SwitchCountMatrix<BBLID>>> owned_switch(n);
+        std::vector<DataReuse<BBLID> *> reuse(n, &m_bbl_data_reuse);
+        std::vector<SwitchCountMatrix<BBLID> *> switchcnt(n, &m_bbl_switch_count);
+        for (size_t i = 1; i < n; i++) {
+            owned_reuse[i].reset(new DataReuse<BBLID>);
+            owned_switch[i].reset(new SwitchCountMatrix<BBLID>);
+            reuse[i] = owned_reuse[i].get();
+            switchcnt[i] = owned_switch[i].get();
+        }
+        for (size_t i = 0; i < n; i++) {
+            ThreadStats *stats = threads[i];
+            m_sample_rate = std::min(m_sample_rate, stats->GetReuseSampleRate());
+            pool.Submit([&, i, stats]() {
+                for (auto &it : *stats->m_bbl_hash2stats) {
+                    it.second->bblid = m_stats.find(it.first)->second.total.bblid;
+                }
+                reuse[i]->Merge(*stats->m_bbl_data_reuse, RunStats::_get_id, 1 / stats->GetReuseSampleRate());
+                switchcnt[i]->Merge(*stats->m_bbl_switch_count, RunStats::_get_id);
+            });
+        }
+        pool.Wait();
+        TreeReduce(pool, n, [&](size_t lhs, size_t rhs) {
+            reuse[lhs]->Merge(*reuse[rhs], _get_id);
+            owned_reuse[rhs].reset();
+            switchcnt[lhs]->Merge(*switchcnt[rhs], _get_id);
+            owned_switch[rhs].reset();
+        });
+        if (shared != NULL) {
+            m_sample_rate = std::min(m_sample_rate, shared->GetReuseSampleRate());
+            shared->MergeInto(m_bbl_data_reuse);
+        }
+    }
+
+    // one section per thread, as ThreadStats::PrintStats of every thread would print
+    void PrintStats(std::ostream &ofs)
+    {
+        std::map<int, std::vector<RunStats *>> sections;
+        for (auto merged : m_sorted) {
+            for (auto &thread : merged->threads) {
+                sections[thread.first].push_back(&thread.second);
+            }
+        }
+        for (auto &it : sections) {
+            PrintStatsTable(ofs, "Thread " + std::to_string(it.first), it.second);
+        }
+    }
+
+    void PrintDataReuseSegments(std::ostream &ofs)
+    {
+        ofs << HORIZONTAL_LINE << std::endl;
+        ofs << "ReuseSegment - Merged" << std::endl;
+        // the counts were scaled when merged, the rate is only for the solver to report
+        if (m_sample_rate < 1) {
+            std::streamsize precision = ofs.precision(17);
+            ofs << "sampling rate = " << m_sample_rate << std::endl;
+            ofs.precision(precision);
+        }
+        m_bbl_data_reuse.PrintAllSegments(ofs, _get_id);
+    }
+
+    void PrintBBLSwitchCount(std::ostream &ofs)
+    {
+        ofs << HORIZONTAL_LINE << std::endl;
+        ofs << "BBLSwitchCount - Merged" << std::endl;
+        m_bbl_switch_count.print(ofs, _get_id);
+    }
+};
+
 } // namespace PIMProf
 
 #endif // __STATS_H__
\ No newline at end of file
@@ -138,44 +138,34 @@ CACHE_LEVEL::CACHE_LEVEL(STORAGE *storage, CostSite cost_site, StorageLevel stor
 {
     assert(IsPower2(_lineSize));
     assert(IsPower2(_setIndexMask + 1));
-    // NumSets = cacheSize / (associativity * lineSize)
+    for (uint32_t i = 0; i < MAX_COST_SITE; i++)
+        _hitcost[i] = hitcost[i];
+}
+
+template <class POLICY>
+CACHE_LEVEL_T<POLICY>::CACHE_LEVEL_T(STORAGE *storage, CostSite cost_site, StorageLevel storage_level, std::string policy, uint32_t cacheSize, uint32_t lineSize, uint32_t associativity, uint32_t allocation, COST hitcost[MAX_COST_SITE])
+  : CACHE_LEVEL(storage, cost_site, storage_level, policy, cacheSize, lineSize, associativity, allocation, hitcost),
+    _sets(NumSets(), associativity)
+{
+}
+
+CACHE_LEVEL *CACHE_LEVEL::Create(STORAGE *storage, CostSite cost_site, StorageLevel storage_level, std::string policy, uint32_t cacheSize, uint32_t lineSize, uint32_t associativity, uint32_t allocation, COST hitcost[MAX_COST_SITE])
+{
     if (policy == "direct_mapped") {
-        for (uint32_t i = 0; i < NumSets(); i++) {
-            DIRECT_MAPPED *_set = new DIRECT_MAPPED(storage, associativity);
-            _set->SetAssociativity(associativity);
-            _sets.push_back(_set);
-        }
+        return new CACHE_LEVEL_T<DIRECT_MAPPED>(storage, cost_site, storage_level, policy, cacheSize, lineSize, associativity, allocation, hitcost);
     }
     else if (policy == "round_robin") {
-        for (uint32_t i = 0; i < NumSets(); i++) {
-            ROUND_ROBIN *_set = new ROUND_ROBIN(storage, associativity);
-            _set->SetAssociativity(associativity);
-            _sets.push_back(_set);
-        }
+        return new CACHE_LEVEL_T<ROUND_ROBIN>(storage, cost_site, storage_level, policy, cacheSize, lineSize, associativity, allocation, hitcost);
     }
     else if (policy == "lru") {
-        for (uint32_t i = 0; i < NumSets(); i++) {
-            LRU *_set = new LRU(storage, associativity);
-            _set->SetAssociativity(associativity);
-            _sets.push_back(_set);
-        }
-    }
-    else {
-        errormsg() << "Invalid cache replacement policy name!" << std::endl;
-        assert(0);
+        return new CACHE_LEVEL_T<LRU>(storage, cost_site, storage_level, policy, cacheSize, lineSize, associativity, allocation, hitcost);
     }
-    for (uint32_t i = 0; i < MAX_COST_SITE; i++)
-        _hitcost[i] = hitcost[i];
-}
-
-CACHE_LEVEL::~CACHE_LEVEL()
-{
-    while (!_sets.empty()) {
-        CACHE_SET *temp = _sets.back();
-        if (temp != NULL)
-            delete temp;
-        _sets.pop_back();
+    else if (policy == "plru") {
+        return new CACHE_LEVEL_T<PLRU>(storage, cost_site, storage_level, policy, cacheSize, lineSize, associativity, allocation, hitcost);
     }
+    errormsg() << "Invalid cache replacement policy name!" << std::endl;
+    assert(0);
+    return NULL;
 }
 
 int bbl_costcount = 0;
@@ -211,7 +201,8 @@ void CACHE_LEVEL::AddMemCost(BBLID bblid, uint32_t simd_len)
 }
 
 
-bool CACHE_LEVEL::Access(ADDRINT addr, uint32_t size, ACCESS_TYPE accessType, BBLID bblid, uint32_t simd_len)
+template <class POLICY>
+bool CACHE_LEVEL_T<POLICY>::Access(ADDRINT addr, uint32_t size, ACCESS_TYPE accessType, BBLID bblid, uint32_t simd_len)
 {
     const ADDRINT highAddr = addr + size;
     bool allHit = true;
@@ -249,17 +240,15 @@ void CACHE_LEVEL::AddInstructionMemCost(BBLID bblid, uint32_t simd_len)
 }
 
 
-bool CACHE_LEVEL::AccessSingleLine(ADDRINT addr, ACCESS_TYPE accessType, BBLID bblid, uint32_t simd_len)
+template <class POLICY>
+bool CACHE_LEVEL_T<POLICY>::AccessSingleLine(ADDRINT addr, ACCESS_TYPE accessType, BBLID bblid, uint32_t simd_len)
 {
     ADDRINT tagaddr;
     uint32_t setIndex;
 
     SplitAddress(addr, tagaddr, setIndex);
 
-    CACHE_SET *set = _sets[setIndex];
-
-    CACHE_TAG *tag = set->Find(tagaddr);
-    bool hit = (tag != NULL);
+    bool hit = _sets.Find(setIndex, tagaddr);
 
     // Since the cost in config is the total access latency of hitting a cache level
     // we only increase the total cost when there is a hit.
@@ -280,7 +269,7 @@ bool CACHE_LEVEL::AccessSingleLine(ADDRINT addr, ACCESS_TYPE accessType, BBLID b
     // every access to a memory address will promote that address to L1
     if ((!hit) && (accessType == ACCESS_TYPE_LOAD || STORE_ALLOCATION == CACHE_ALLOC::STORE_ALLOCATE))
     {
-        tag = set->Replace(tagaddr);
+        _sets.Replace(setIndex, tagaddr);
 
         assert(_next_level != NULL);
         // We only keep track of the data reuse chain from the view of CPU
@@ -297,13 +286,10 @@ bool CACHE_LEVEL::AccessSingleLine(ADDRINT addr, ACCESS_TYPE accessType, BBLID b
     return hit;
 }
 
-void CACHE_LEVEL::Flush()
+template <class POLICY>
+void CACHE_LEVEL_T<POLICY>::Flush()
 {
-    for (int32_t index = NumSets(); index >= 0; index--)
-    {
-        CACHE_SET *set = _sets[index];
-        set->Flush();
-    }
+    _sets.Flush();
     IncFlushCounter();
 }
 
@@ -479,7 +465,7 @@ void STORAGE::ReadConfig(ConfigReader &reader)
                 errormsg() << "Cache: Invalid hitcost in cache level `" << name <<"`" << std::endl;
                 assert(0);
             }
-            _storage[i][j] = new CACHE_LEVEL(this, (CostSite)i, (StorageLevel)j, policy, cachesize, linesize, associativity, allocation, hitcost);
+            _storage[i][j] = CACHE_LEVEL::Create(this, (CostSite)i, (StorageLevel)j, policy, cachesize, linesize, associativity, allocation, hitcost);
             // _storage[i][0:j] are not NULL for sure.
             if (j == UL2) {
                 _storage[i][IL1]->_next_level = _storage[i][j];
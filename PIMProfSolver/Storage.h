@@ -12,13 +12,13 @@
 #include <fstream>
 #include <iostream>
 #include <string>
-#include <list>
 #include <vector>
 #include <set>
 
 #include "pin.H"
 #include "Util.h"
 #include "CostPackage.h"
+#include "CacheSet.h"
 
 
 #include "INIReader.h"
@@ -82,254 +82,6 @@ namespace PIMProf {
 // forward declaration
 class STORAGE;
 
-/// @brief Cache tag
-/// dynamic data structure should only be allocated on construction
-/// and deleted on destruction
-class CACHE_TAG
-{
-  private:
-    ADDRINT _tag;
-    STORAGE *_storage;
-
-  public:
-    CACHE_TAG(STORAGE *storage, ADDRINT tagaddr = 0)
-    {
-        _tag = tagaddr;
-        _storage = storage;
-    }
-
-    inline bool operator == (const ADDRINT &rhs) const { return _tag == rhs; }
-
-    inline void SetTag(ADDRINT tagaddr) {
-       _tag = tagaddr;
-    }
-    inline ADDRINT GetTag() const { return _tag; }
-
-    inline STORAGE *GetParent() { return _storage; }
-};
-
-
-class CACHE_SET
-{
-  protected:
-    static const uint32_t MAX_ASSOCIATIVITY = 32;
-    STORAGE *_storage;
-  public:
-    virtual ~CACHE_SET() {};
-    virtual void SetAssociativity(uint32_t associativity) = 0;
-    virtual uint32_t GetAssociativity(uint32_t associativity) = 0;
-    virtual CACHE_TAG *Find(ADDRINT tagaddr) = 0;
-    virtual CACHE_TAG *Replace(ADDRINT tagaddr) = 0;
-    virtual void Flush() = 0;
-};
-
-
-class DIRECT_MAPPED : public CACHE_SET
-{
-  private:
-    CACHE_TAG *_tag;
-
-  public:
-    inline DIRECT_MAPPED(STORAGE *storage, uint32_t associativity = 1) 
-    {
-        assert(associativity == 1);
-        _tag = new CACHE_TAG(storage, 0);
-        _storage = storage;
-    }
-
-    inline ~DIRECT_MAPPED()
-    {
-        delete _tag;
-    }
-
-    inline void SetAssociativity(uint32_t associativity) { assert(associativity == 1); }
-    inline uint32_t GetAssociativity(uint32_t associativity) { return 1; }
-
-    inline CACHE_TAG *Find(ADDRINT tagaddr) 
-    {
-        if (*_tag == tagaddr) {
-            return _tag;
-        }
-        return NULL;
-    }
-    inline CACHE_TAG *Replace(ADDRINT tagaddr) 
-    {
-        _tag->SetTag(tagaddr);
-        return _tag;
-    }
-    inline void Flush() { _tag->SetTag(0); }
-};
-
-/// @brief Cache set with round robin replacement
-class ROUND_ROBIN : public CACHE_SET
-{
-  private:
-    CACHE_TAG *_tags[MAX_ASSOCIATIVITY];
-    uint32_t _tagsLastIndex;
-    uint32_t _nextReplaceIndex;
-
-  public:
-    
-    inline ROUND_ROBIN(STORAGE *storage, uint32_t associativity)
-        : _tagsLastIndex(associativity - 1)
-    {
-        assert(associativity <= MAX_ASSOCIATIVITY);
-        _nextReplaceIndex = _tagsLastIndex;
-
-        for (int32_t index = _tagsLastIndex; index >= 0; index--)
-        {
-            _tags[index] = new CACHE_TAG(storage, 0);
-        }
-        _storage = storage;
-    }
-
-    inline ~ROUND_ROBIN()
-    {
-        for (int32_t index = _tagsLastIndex; index >= 0; index--)
-        {
-            delete _tags[index];
-        }
-    }
-
-    inline void SetAssociativity(uint32_t associativity)
-    {
-        assert(associativity <= MAX_ASSOCIATIVITY);
-        _tagsLastIndex = associativity - 1;
-        _nextReplaceIndex = _tagsLastIndex;
-    }
-
-    inline uint32_t GetAssociativity(uint32_t associativity) { return _tagsLastIndex + 1; }
-
-    inline CACHE_TAG *Find(ADDRINT tagaddr)
-    {
-        for (int32_t index = _tagsLastIndex; index >= 0; index--)
-        {
-            if (*_tags[index] == tagaddr)
-                return _tags[index];
-        }
-        return NULL;
-    }
-
-    inline CACHE_TAG *Replace(ADDRINT tagaddr)
-    {
-        // g++ -O3 too dumb to do CSE on following lines?!
-        const uint32_t index = _nextReplaceIndex;
-
-        _tags[index]->SetTag(tagaddr);
-        // condition typically faster than modulo
-        _nextReplaceIndex = (index == 0 ? _tagsLastIndex : index - 1);
-        return _tags[index];
-    }
-
-    inline void Flush()
-    {
-        for (int32_t index = _tagsLastIndex; index >= 0; index--)
-        {
-            _tags[index]->SetTag(0);
-        }
-        _nextReplaceIndex = _tagsLastIndex;
-    }
-};
-
-class LRU : public CACHE_SET
-{
-  public:
-    typedef std::list<CACHE_TAG *> CacheTagList;
-
-  private:
-    // this is a fixed-size list where the size is the current associativity
-    // front is MRU, back is LRU
-    CacheTagList _tags;
-
-  public:
-    inline LRU(STORAGE *storage, uint32_t associativity = MAX_ASSOCIATIVITY)
-    {
-        assert(associativity <= MAX_ASSOCIATIVITY);
-        for (uint32_t i = 0; i < associativity; i++)
-        {
-            CACHE_TAG *tag = new CACHE_TAG(storage, 0);
-            tag->SetTag(0);
-            _tags.push_back(tag);
-        }
-        _storage = storage;
-    }
-
-    inline ~LRU()
-    {
-        while (!_tags.empty())
-        {
-            CACHE_TAG *tag = _tags.back();
-            delete tag;
-            _tags.pop_back();
-        }
-    }
-
-    inline void SetAssociativity(uint32_t associativity)
-    {
-        assert(associativity <= MAX_ASSOCIATIVITY);
-        while (!_tags.empty())
-        {
-            CACHE_TAG *tag = _tags.back();
-            delete tag;
-            _tags.pop_back();
-        }
-        for (uint32_t i = 0; i < associativity; i++)
-        {
-            CACHE_TAG *tag = new CACHE_TAG(_storage, 0);
-            _tags.push_back(tag);
-        }
-    }
-
-    inline uint32_t GetAssociativity(uint32_t associativity)
-    {
-        return _tags.size();
-    }
-
-    inline CACHE_TAG *Find(ADDRINT tagaddr)
-    {
-        CacheTagList::iterator it = _tags.begin();
-        CacheTagList::iterator eit = _tags.end();
-        for (; it != eit; ++it)
-        {
-            CACHE_TAG *tag = *it;
-            // promote the accessed cache line to the front
-            if (*tag == tagaddr)
-            {
-                _tags.erase(it);
-                _tags.push_front(tag);
-                return _tags.front();
-            }
-        }
-        return NULL;
-    }
-
-    inline CACHE_TAG *Replace(ADDRINT tagaddr)
-    {
-        CACHE_TAG *tag = _tags.back();
-        _tags.pop_back();
-        tag->SetTag(tagaddr);
-        _tags.push_front(tag);
-        return tag;
-    }
-
-    inline void Flush()
-    {
-        uint32_t associativity = _tags.size();
-        while (!_tags.empty())
-        {
-            CACHE_TAG *tag = _tags.back();
-            delete tag;
-            _tags.pop_back();
-        }
-        for (uint32_t i = 0; i < associativity; i++)
-        {
-            CACHE_TAG *tag = new CACHE_TAG(_storage, 0);
-            _tags.push_back(tag);
-        }
-    }
-};
-
-
 namespace CACHE_ALLOC
 {
 enum STORE_ALLOCATION
@@ -344,6 +96,7 @@ class STORAGE_LEVEL_BASE
 {
     friend class STORAGE;
     friend class CACHE_LEVEL;
+    template <class POLICY> friend class CACHE_LEVEL_T;
     friend class MEMORY_LEVEL;
   protected:
     static const uint32_t HIT_MISS_NUM = 2;
@@ -404,14 +157,10 @@ class STORAGE_LEVEL_BASE
 };
 
 
-/// @brief Templated cache class with specific cache set allocation policies
-/// All that remains to be done here is allocate and deallocate the right
-/// type of cache sets.
+/// @brief Cache level of any replacement policy: geometry, costs and stats.
+/// The sets live in CACHE_LEVEL_T, Create picks the policy by its name.
 class CACHE_LEVEL : public STORAGE_LEVEL_BASE
 {
-  private:
-    std::vector<CACHE_SET *> _sets;
-
   protected:
     const uint32_t _cacheSize;
     const uint32_t _lineSize;
@@ -432,10 +181,12 @@ class CACHE_LEVEL : public STORAGE_LEVEL_BASE
   protected:
     uint32_t NumSets() const { return _setIndexMask + 1; }
 
-  public:
-    // constructors/destructors
     CACHE_LEVEL(STORAGE *storage, CostSite cost_site, StorageLevel storage_level, std::string policy, uint32_t cacheSize, uint32_t lineSize, uint32_t associativity, uint32_t allocation, COST hitcost[MAX_COST_SITE]);
-    ~CACHE_LEVEL();
+
+  public:
+    /// @return a cache level with the sets of policy
+    /// "direct_mapped", "round_robin", "lru" or "plru"
+    static CACHE_LEVEL *Create(STORAGE *storage, CostSite cost_site, StorageLevel storage_level, std::string policy, uint32_t cacheSize, uint32_t lineSize, uint32_t associativity, uint32_t allocation, COST hitcost[MAX_COST_SITE]);
 
   public:
     // accessors
@@ -475,6 +226,25 @@ class CACHE_LEVEL : public STORAGE_LEVEL_BASE
 
     void AddInstructionMemCost(BBLID bblid, uint32_t simd_len);
 
+    virtual void Flush() = 0;
+    void ResetStats();
+    inline std::string getReplacementPolicy() {
+        return _replacement_policy;
+    }
+    std::ostream &StatsLong(std::ostream &out) const;
+};
+
+/// @brief Cache level with the sets of one replacement policy,
+/// so that the tag lookup and the policy update are inlined into the access.
+template <class POLICY>
+class CACHE_LEVEL_T final : public CACHE_LEVEL
+{
+  private:
+    CACHE_SETS<POLICY> _sets;
+
+  public:
+    CACHE_LEVEL_T(STORAGE *storage, CostSite cost_site, StorageLevel storage_level, std::string policy, uint32_t cacheSize, uint32_t lineSize, uint32_t associativity, uint32_t allocation, COST hitcost[MAX_COST_SITE]);
+
     /// Cache access from addr to addr+size-1/*!
     /// @return true if all accessed cache lines hit
     bool Access(ADDRINT addr, uint32_t size, ACCESS_TYPE accessType, BBLID bblid, uint32_t simd_len);
@@ -484,11 +254,6 @@ class CACHE_LEVEL : public STORAGE_LEVEL_BASE
     bool AccessSingleLine(ADDRINT addr, ACCESS_TYPE accessType, BBLID bblid, uint32_t simd_len);
 
     void Flush();
-    void ResetStats();
-    inline std::string getReplacementPolicy() {
-        return _replacement_policy;
-    }
-    std::ostream &StatsLong(std::ostream &out) const;
 };
 
 class MEMORY_LEVEL : public STORAGE_LEVEL_BASE
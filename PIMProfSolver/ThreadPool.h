@@ -0,0 +1,176 @@
+//===- ThreadPool.h - Work-stealing thread pool -----------------*- C++ -*-===//
+//
+//
+//===----------------------------------------------------------------------===//
+//
+//
+//===----------------------------------------------------------------------===//
+#ifndef __THREADPOOL_H__
+#define __THREADPOOL_H__
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace PIMProf {
+
+/* ===================================================================== */
+/* ThreadPool */
+/* ===================================================================== */
+/// Each worker owns a deque of tasks. A worker takes tasks from the front of
+/// its own deque and steals from the back of the others when it runs dry.
+/// Tasks submitted from outside the pool are dealt round robin and run in
+/// submission order, tasks submitted from inside a worker go to the front of
+/// that worker's own deque and run first.
+class ThreadPool {
+  public:
+    typedef std::function<void()> Task;
+
+  private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> _workers;
+    std::vector<std::thread> _threads;
+
+    std::mutex _lock;
+    std::condition_variable _task_available;
+    std::condition_variable _all_done;
+    std::atomic<size_t> _queued; // tasks sitting in some deque
+    size_t _pending = 0;         // tasks submitted but not finished
+    size_t _next = 0;
+    bool _stop = false;
+
+    // the pool and worker id of the calling thread
+    struct ThreadContext {
+        const ThreadPool *pool = nullptr;
+        int id = -1;
+    };
+    static ThreadContext &ThisThread()
+    {
+        thread_local ThreadContext context;
+        return context;
+    }
+
+  public:
+    ThreadPool(int nthreads) : _queued(0)
+    {
+        if (nthreads < 1) nthreads = 1;
+        for (int i = 0; i < nthreads; i++) {
+            _workers.emplace_back(new Worker);
+        }
+        for (int i = 0; i < nthreads; i++) {
+            _threads.emplace_back([this, i]() { Run(i); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        Wait();
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _stop = true;
+        }
+        _task_available.notify_all();
+        for (auto &thread : _threads) {
+            thread.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    inline int size() const { return (int)_workers.size(); }
+
+    void Submit(Task task)
+    {
+        int self = Self();
+        int target = self;
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _pending++;
+            _queued++;
+            if (target < 0) {
+                target = _next;
+                _next = (_next + 1) % _workers.size();
+            }
+        }
+        {
+            std::lock_guard<std::mutex> guard(_workers[target]->lock);
+            if (self < 0) {
+                _workers[target]->tasks.push_back(std::move(task));
+            }
+            else {
+                _workers[target]->tasks.push_front(std::move(task));
+            }
+        }
+        _task_available.notify_one();
+    }
+
+    /// block until every submitted task has finished,
+    /// must not be called from inside a task
+    void Wait()
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        _all_done.wait(guard, [this]() { return _pending == 0; });
+    }
+
+  private:
+    // the worker id of the calling thread in this pool, -1 otherwise
+    int Self()
+    {
+        return ThisThread().pool == this ? ThisThread().id : -1;
+    }
+
+    bool Pop(int id, Task &task)
+    {
+        int n = _workers.size();
+        for (int i = 0; i < n; i++) {
+            Worker &worker = *_workers[(id + i) % n];
+            std::lock_guard<std::mutex> guard(worker.lock);
+            if (worker.tasks.empty()) continue;
+            if (i == 0) {
+                task = std::move(worker.tasks.front());
+                worker.tasks.pop_front();
+            }
+            else {
+                task = std::move(worker.tasks.back());
+                worker.tasks.pop_back();
+            }
+            _queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void Run(int id)
+    {
+        ThisThread().pool = this;
+        ThisThread().id = id;
+        while (true) {
+            Task task;
+            if (Pop(id, task)) {
+                task();
+                std::lock_guard<std::mutex> guard(_lock);
+                if (--_pending == 0) {
+                    _all_done.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> guard(_lock);
+            _task_available.wait(guard, [this]() { return _stop || _queued > 0; });
+            if (_stop && _queued == 0) return;
+        }
+    }
+};
+
+} // namespace PIMProf
+
+#endif // __THREADPOOL_H__
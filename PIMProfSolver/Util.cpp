@@ -8,18 +8,48 @@
 
 #include "Util.h"
 #include <getopt.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <thread>
+#include <stdexcept>
+
+#include "../LLVMAnalysis/MurmurHash3.h"
 
 using namespace PIMProf;
 
+// options that only have a long form
+enum LongOption {
+    OPT_SAVE_SNAPSHOT = 256,
+    OPT_LOAD_SNAPSHOT,
+    OPT_CACHE_DIR,
+    OPT_CACHE_SIZE,
+    OPT_EXPORT,
+    OPT_EXPORT_FORMAT,
+    OPT_DECISION_TABLE,
+    OPT_PHASE_DISTANCE,
+    OPT_CPU_CONTEXT,
+    OPT_PIM_CONTEXT
+};
+
 void Usage()
 {
     infomsg("Usage: ./Solver.exe <mode> -c <cpu_stats_file> -p <pim_stats_file> -r <reuse_file> -o <output_file> -s <sca_decision_file>");
-    infomsg("Select mode from: mpki, para, reuse");
+    infomsg("       ./Solver.exe batch <manifest> -o <summary_csv> -j <threads> -m <memory_budget_MB>");
+    infomsg("Select mode from: mpki, para, reuse, batch");
+    infomsg("Options: --save-snapshot <file> --load-snapshot <file>");
+    infomsg("         --cache-dir <dir> --cache-size <MB, default 1024>");
+    infomsg("         --export <file> --export-format <csv|jsonl|binary>, -o may be omitted when exporting");
+    infomsg("         --decision-table <file>, binary decision table for OffloaderInjection");
+    infomsg("         --phase-distance <0-2, default 0.5>, how far apart the instruction mix of two epochs of one phase may be (reuse)");
+    infomsg("         --cpu-context <file> --pim-context <file>, calling context stats of the two runs (reuse)");
     exit(0);
 }
 
-void CommandLineParser::initialize(int argc, char *argv[])
+bool CommandLineParser::Parse(int argc, char *argv[])
 {
+    // returns false on -h and on an unrecognized option
     auto parser = [&](const char* const short_opt, const option long_opt[]) {
         while (true) {
             const auto opt = getopt_long(argc, argv, short_opt, long_opt, nullptr);
@@ -39,18 +69,43 @@ void CommandLineParser::initialize(int argc, char *argv[])
                 _reusefile = std::string(optarg); std::cout << "reuse " << _reusefile << std::endl; break;
             case 'o':
                 _outputfile = std::string(optarg); std::cout << "output " << _outputfile << std::endl; break;
+            case 'j':
+                _threads = std::stoi(std::string(optarg)); std::cout << "threads " << _threads << std::endl; break;
+            case 'm':
+                _memoryBudget = std::stoull(std::string(optarg)) << 20; std::cout << "memory budget " << (_memoryBudget >> 20) << " MB" << std::endl; break;
             case 'd':
                 dataMoveThreshold = std::stod(std::string(optarg)); std::cout << "dataMoveThreshold " << dataMoveThreshold << std::endl; break;
+            case OPT_SAVE_SNAPSHOT:
+                _saveSnapshotFile = std::string(optarg); std::cout << "save snapshot " << _saveSnapshotFile << std::endl; break;
+            case OPT_LOAD_SNAPSHOT:
+                _loadSnapshotFile = std::string(optarg); std::cout << "load snapshot " << _loadSnapshotFile << std::endl; break;
+            case OPT_CACHE_DIR:
+                _cacheDir = std::string(optarg); std::cout << "cache dir " << _cacheDir << std::endl; break;
+            case OPT_EXPORT:
+                _exportFile = std::string(optarg); std::cout << "export " << _exportFile << std::endl; break;
+            case OPT_EXPORT_FORMAT:
+                _exportFormat = std::string(optarg); std::cout << "export format " << _exportFormat << std::endl; break;
+            case OPT_DECISION_TABLE:
+                _decisionTableFile = std::string(optarg); std::cout << "decision table " << _decisionTableFile << std::endl; break;
+            case OPT_PHASE_DISTANCE:
+                _phaseDistance = std::stod(std::string(optarg)); std::cout << "phase distance " << _phaseDistance << std::endl; break;
+            case OPT_CPU_CONTEXT:
+                _cpucontextfile = std::string(optarg); std::cout << "cpu context " << _cpucontextfile << std::endl; break;
+            case OPT_PIM_CONTEXT:
+                _pimcontextfile = std::string(optarg); std::cout << "pim context " << _pimcontextfile << std::endl; break;
+            case OPT_CACHE_SIZE:
+                _cacheSize = std::stoull(std::string(optarg)) << 20; std::cout << "cache size " << (_cacheSize >> 20) << " MB" << std::endl; break;
             case 'h': // -h or --help
             case '?': // Unrecognized option
             default:
-                Usage();
+                return false;
             }
         }
+        return true;
     };
 
     
-    if (argc <= 1) { Usage(); }
+    if (argc <= 1) { return false; }
     std::string _mode_string(argv[1]);
     optind++;
     if (_mode_string == "mpki") {
@@ -61,17 +116,27 @@ void CommandLineParser::initialize(int argc, char *argv[])
             {"pim", required_argument, nullptr, 'p'},
             {"reuse", required_argument, nullptr, 'r'},
             {"output", required_argument, nullptr, 'o'},
+            {"save-snapshot", required_argument, nullptr, OPT_SAVE_SNAPSHOT},
+            {"load-snapshot", required_argument, nullptr, OPT_LOAD_SNAPSHOT},
+            {"cache-dir", required_argument, nullptr, OPT_CACHE_DIR},
+            {"cache-size", required_argument, nullptr, OPT_CACHE_SIZE},
+            {"export", required_argument, nullptr, OPT_EXPORT},
+            {"export-format", required_argument, nullptr, OPT_EXPORT_FORMAT},
+            {"decision-table", required_argument, nullptr, OPT_DECISION_TABLE},
             {"help", no_argument, nullptr, 'h'},
             {nullptr, no_argument, nullptr, 0}
         };
-        parser(short_opt, long_opt);
-        if (_cpustatsfile == "" || _pimstatsfile == "" || _outputfile == "") {
-            Usage();
+        if (!parser(short_opt, long_opt)) {
+            return false;
+        }
+        if (_cpustatsfile == "" || _pimstatsfile == "" || (_outputfile == "" && _exportFile == "" && _decisionTableFile == "")) {
+            return false;
         }
     }
     else if (_mode_string == "para") {
         _mode = Mode::PARA;
-        assert(0);
+        errormsg("Mode para is not supported");
+        return false;
     }
     else if (_mode_string == "reuse") {
         _mode = Mode::REUSE;
@@ -84,13 +149,25 @@ void CommandLineParser::initialize(int argc, char *argv[])
             {"reuse", required_argument, nullptr, 'r'},
             {"output", required_argument, nullptr, 'o'}, 
             {"data", no_argument, nullptr, 'd'},  
+            {"save-snapshot", required_argument, nullptr, OPT_SAVE_SNAPSHOT},
+            {"load-snapshot", required_argument, nullptr, OPT_LOAD_SNAPSHOT},
+            {"cache-dir", required_argument, nullptr, OPT_CACHE_DIR},
+            {"cache-size", required_argument, nullptr, OPT_CACHE_SIZE},
+            {"export", required_argument, nullptr, OPT_EXPORT},
+            {"export-format", required_argument, nullptr, OPT_EXPORT_FORMAT},
+            {"decision-table", required_argument, nullptr, OPT_DECISION_TABLE},
+            {"phase-distance", required_argument, nullptr, OPT_PHASE_DISTANCE},
+            {"cpu-context", required_argument, nullptr, OPT_CPU_CONTEXT},
+            {"pim-context", required_argument, nullptr, OPT_PIM_CONTEXT},
             {"help", no_argument, nullptr, 'h'},
             {nullptr, no_argument, nullptr, 0}
         };
-        parser(short_opt, long_opt);
-        if (_cpustatsfile == "" || _pimstatsfile == "" || _reusefile == "" || _outputfile == "" || _scaDecisionFile==""
+        if (!parser(short_opt, long_opt)) {
+            return false;
+        }
+        if (_cpustatsfile == "" || _pimstatsfile == "" || _reusefile == "" || (_outputfile == "" && _exportFile == "" && _decisionTableFile == "") || _scaDecisionFile==""
             || _decisionFile=="") {
-            Usage();
+            return false;
         }
     }
     else if (_mode_string == "debug") {
@@ -101,17 +178,122 @@ void CommandLineParser::initialize(int argc, char *argv[])
             {"pim", required_argument, nullptr, 'p'},
             {"reuse", required_argument, nullptr, 'r'},
             {"output", required_argument, nullptr, 'o'},
+            {"save-snapshot", required_argument, nullptr, OPT_SAVE_SNAPSHOT},
+            {"load-snapshot", required_argument, nullptr, OPT_LOAD_SNAPSHOT},
+            {"cache-dir", required_argument, nullptr, OPT_CACHE_DIR},
+            {"cache-size", required_argument, nullptr, OPT_CACHE_SIZE},
+            {"export", required_argument, nullptr, OPT_EXPORT},
+            {"export-format", required_argument, nullptr, OPT_EXPORT_FORMAT},
+            {"decision-table", required_argument, nullptr, OPT_DECISION_TABLE},
             {"help", no_argument, nullptr, 'h'},
             {nullptr, no_argument, nullptr, 0}
         };
-        parser(short_opt, long_opt);
-        if (_cpustatsfile == "" || _pimstatsfile == "" || _reusefile == "" || _outputfile == "") {
-            Usage();
+        if (!parser(short_opt, long_opt)) {
+            return false;
+        }
+        if (_cpustatsfile == "" || _pimstatsfile == "" || _reusefile == "" || (_outputfile == "" && _exportFile == "" && _decisionTableFile == "")) {
+            return false;
+        }
+    }
+    else if (_mode_string == "batch") {
+        _mode = Mode::BATCH;
+        if (argc <= 2) { return false; }
+        _manifestFile = std::string(argv[2]);
+        std::cout << "manifest " << _manifestFile << std::endl;
+        optind++;
+        _threads = std::thread::hardware_concurrency();
+        _memoryBudget = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE) / 2;
+        const char* const short_opt = "o:j:m:h";
+        const option long_opt[] = {
+            {"output", required_argument, nullptr, 'o'},
+            {"threads", required_argument, nullptr, 'j'},
+            {"memory", required_argument, nullptr, 'm'},
+            {"help", no_argument, nullptr, 'h'},
+            {nullptr, no_argument, nullptr, 0}
+        };
+        if (!parser(short_opt, long_opt)) {
+            return false;
+        }
+        if (_outputfile == "") {
+            return false;
         }
     }
     else {
+        return false;
+    }
+    return true;
+}
+
+bool CommandLineParser::initialize(int argc, char *argv[], bool usage_on_error)
+{
+    bool valid;
+    try {
+        valid = Parse(argc, argv);
+    }
+    catch (const std::logic_error &) {
+        // std::stoi and friends on a malformed number
+        valid = false;
+    }
+    if (!valid && usage_on_error) {
         Usage();
     }
+    return valid;
+}
+
+bool MappedFile::open(const std::string &filename)
+{
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    _size = st.st_size;
+    if (_size > 0) {
+        _addr = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (_addr == MAP_FAILED) {
+            _addr = nullptr;
+            _size = 0;
+            ::close(fd);
+            return false;
+        }
+    }
+    ::close(fd);
+    _open = true;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (_addr != nullptr) {
+        munmap(_addr, _size);
+    }
+    _addr = nullptr;
+    _size = 0;
+    _open = false;
+}
+
+UUID PIMProf::HashFile(const std::string &filename)
+{
+    MappedFile file;
+    if (filename == "" || !file.open(filename)) return GLOBAL_BBLHASH;
+
+    // MurmurHash3 takes an int length, so large files are hashed block by block
+    // and each block hash is chained into the next one
+    const size_t block = (size_t)1 << 30;
+    uint64_t result[2] = {file.size(), 0};
+    for (size_t offset = 0; offset < file.size() || offset == 0; offset += block) {
+        uint64_t chain[4];
+        size_t len = std::min(block, file.size() - offset);
+        MurmurHash3_x64_128(file.data() + offset, len, 0, chain);
+        chain[2] = result[0];
+        chain[3] = result[1];
+        MurmurHash3_x64_128(chain, sizeof(chain), 0, result);
+        if (len == 0) break;
+    }
+    return UUID(result[0], result[1]);
 }
 
 void PIMProf::PrintInstruction(std::ostream *out, uint64_t insAddr, std::string insDis, uint32_t simd_len) {
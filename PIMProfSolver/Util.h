@@ -14,6 +14,8 @@
 #include <bitset>
 #include <cassert>
 #include <cstdarg>
+#include <cstring>
+#include <fstream>
 
 #include "Common.h"
 #include "INIReader.h"
@@ -118,6 +120,123 @@ PRETTY_PRINT_FUNC_HELPER(info, GREENCOLOR)
 PRETTY_PRINT_FUNC_HELPER(error, REDCOLOR)
 PRETTY_PRINT_FUNC_HELPER(warning, YELLOWCOLOR)
 
+/* ===================================================================== */
+/* MappedFile */
+/* ===================================================================== */
+/// Read-only mapping of an entire file, unmapped on destruction.
+/// An empty file is a valid mapping of size 0.
+class MappedFile {
+  private:
+    void *_addr = nullptr;
+    size_t _size = 0;
+    bool _open = false;
+
+  public:
+    MappedFile() {}
+    MappedFile(const std::string &filename) { open(filename); }
+    ~MappedFile() { close(); }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const std::string &filename);
+    void close();
+
+    inline bool is_open() const { return _open; }
+    inline const char *data() const { return (const char *)_addr; }
+    inline size_t size() const { return _size; }
+};
+
+/// 128-bit MurmurHash3 of the content of a file,
+/// returns GLOBAL_BBLHASH if the file cannot be read.
+UUID HashFile(const std::string &filename);
+
+/* ===================================================================== */
+/* Binary I/O */
+/* ===================================================================== */
+/// Every array is padded to 8 bytes so that the reader can hand out
+/// pointers directly into a mapped file.
+class BinaryWriter {
+  private:
+    std::ofstream _ofs;
+    uint64_t _offset = 0;
+
+  public:
+    BinaryWriter(const std::string &filename)
+        : _ofs(filename, std::ofstream::out | std::ofstream::binary) {}
+
+    inline bool good() const { return _ofs.good(); }
+
+    inline void writeRaw(const void *data, size_t size)
+    {
+        _ofs.write((const char *)data, size);
+        _offset += size;
+        static const char zeros[8] = {0};
+        if (_offset % 8) {
+            size_t pad = 8 - _offset % 8;
+            _ofs.write(zeros, pad);
+            _offset += pad;
+        }
+    }
+
+    template <class T>
+    inline void write(const T &val) { writeRaw(&val, sizeof(T)); }
+
+    template <class T>
+    inline void writeArray(const std::vector<T> &vec)
+    {
+        write((uint64_t)vec.size());
+        writeRaw(vec.data(), vec.size() * sizeof(T));
+    }
+};
+
+class BinaryReader {
+  private:
+    const char *_data;
+    size_t _size;
+    size_t _offset = 0;
+    bool _fail = false;
+
+  public:
+    BinaryReader(const char *data, size_t size) : _data(data), _size(size) {}
+
+    inline bool fail() const { return _fail; }
+
+    inline const void *readRaw(size_t size)
+    {
+        size_t padded = (size + 7) / 8 * 8;
+        if (_fail || padded > _size - _offset) {
+            _fail = true;
+            return nullptr;
+        }
+        const void *result = _data + _offset;
+        _offset += padded;
+        return result;
+    }
+
+    template <class T>
+    inline T read()
+    {
+        T val;
+        const void *p = readRaw(sizeof(T));
+        if (p == nullptr) return T();
+        memcpy(&val, p, sizeof(T));
+        return val;
+    }
+
+    // returns a pointer into the underlying buffer, valid as long as the buffer is
+    template <class T>
+    inline const T *readArray(uint64_t &size)
+    {
+        size = read<uint64_t>();
+        if (_fail || size > (_size - _offset) / sizeof(T)) {
+            _fail = true;
+            size = 0;
+            return nullptr;
+        }
+        return (const T *)readRaw(size * sizeof(T));
+    }
+};
+
 /* ===================================================================== */
 /* CommandLineParser */
 /* ===================================================================== */
@@ -126,17 +245,29 @@ class CommandLineParser {
   public:
     double dataMoveThreshold = 0.01;
     enum Mode {
-        MPKI, PARA, REUSE, DEBUG
+        MPKI, PARA, REUSE, DEBUG, BATCH
     };
   private:
     std::string _decisionFile,_scaDecisionFile, _cpustatsfile, _pimstatsfile;
     std::string _reusefile;
     std::string _outputfile;
+    std::string _saveSnapshotFile, _loadSnapshotFile;
+    std::string _cacheDir;
+    std::string _exportFile, _exportFormat;
+    std::string _decisionTableFile;
+    double _phaseDistance = 0.5;
+    std::string _cpucontextfile, _pimcontextfile;
+    uint64_t _cacheSize = (uint64_t)1024 << 20;
+    std::string _manifestFile;
+    int _threads = 1;
+    uint64_t _memoryBudget = 0;
     Mode _mode;
     
 
   public:
-    void initialize(int argc, char *argv[]);
+    /// returns false on a bad command line, after printing the usage and
+    /// exiting unless usage_on_error is false
+    bool initialize(int argc, char *argv[], bool usage_on_error = true);
 
     inline std::string decisionFile() { return _decisionFile; }
     inline std::string scaDecisionFile() { return _scaDecisionFile; }
@@ -144,9 +275,24 @@ class CommandLineParser {
     inline std::string pimstatsfile() { return _pimstatsfile; }
     inline std::string reusefile() { return _reusefile; }
     inline std::string outputfile() { return _outputfile; }
+    inline std::string saveSnapshotFile() { return _saveSnapshotFile; }
+    inline std::string loadSnapshotFile() { return _loadSnapshotFile; }
+    inline std::string cacheDir() { return _cacheDir; }
+    inline std::string exportFile() { return _exportFile; }
+    inline std::string exportFormat() { return _exportFormat; }
+    inline std::string decisionTableFile() { return _decisionTableFile; }
+    inline double phaseDistance() { return _phaseDistance; }
+    inline std::string cpucontextfile() { return _cpucontextfile; }
+    inline std::string pimcontextfile() { return _pimcontextfile; }
+    inline uint64_t cacheSize() { return _cacheSize; }
+    inline std::string manifestFile() { return _manifestFile; }
+    inline int threads() { return _threads; }
+    inline uint64_t memoryBudget() { return _memoryBudget; }
     inline Mode mode() { return _mode; }
     inline bool enableglobalbbl() { return true; } // whether considering the dependency with the global BBL, for debug use
 
+  private:
+    bool Parse(int argc, char *argv[]);
 };
 
 /* ===================================================================== */
@@ -13,6 +13,7 @@
 
 #include <Util.h>
 #include <CostSolver.h>
+#include <BatchDriver.h>
 
 using namespace PIMProf;
 
@@ -27,9 +28,24 @@ int main(int argc, char *argv[])
 {
     _command_line_parser.initialize(argc, argv);
 
-    _cost_solver.initialize(&_command_line_parser);
-    std::ofstream ofs(_command_line_parser.outputfile());
-    _cost_solver.PrintSolution(ofs);
+    if (_command_line_parser.mode() == CommandLineParser::Mode::BATCH) {
+        BatchDriver driver;
+        driver.initialize(&_command_line_parser);
+        return driver.Run() == 0 ? 0 : 1;
+    }
+
+    if (!_cost_solver.initialize(&_command_line_parser)) {
+        return 1;
+    }
+    if (_command_line_parser.outputfile() != "") {
+        std::ofstream ofs(_command_line_parser.outputfile());
+        _cost_solver.PrintSolution(ofs);
+    }
+    else {
+        // export only, the report goes nowhere
+        std::ostream null(nullptr);
+        _cost_solver.PrintSolution(null);
+    }
 
     // std::ofstream ofs("decision.out");
     // DECISION decision = _cost_solver.PrintSolution(ofs);
@@ -0,0 +1,90 @@
+// Lookups per second of the cache sets of CacheSet.h for each replacement
+// policy and associativity, over synthetic address streams: a working set
+// that fits the cache, one twice its size, uniform addresses over 64 MB and
+// a sequential scan. The hit counts have to be the same whatever the tag
+// compare is built with, so build it three times and compare:
+//   g++ -std=gnu++14 -O2 -DNDEBUG -mavx2 -I../PIMProfSolver cacheSetLookup.cpp -o cacheSetLookup
+//   g++ -std=gnu++14 -O2 -DNDEBUG -I../PIMProfSolver cacheSetLookup.cpp -o cacheSetLookup_sse2
+//   g++ -std=gnu++14 -O2 -DNDEBUG -DPIMPROF_SCALAR_TAGS -I../PIMProfSolver cacheSetLookup.cpp -o cacheSetLookup_scalar
+//   ./cacheSetLookup [accesses]
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "CacheSet.h"
+
+using namespace PIMProf;
+
+static const uint32_t CACHE_SIZE = 1 << 20;
+static const uint32_t LINE_SHIFT = 6;
+
+struct Stream {
+    std::string name;
+    std::vector<uint64_t> addrs;
+};
+
+static uint64_t Next(uint64_t &x)
+{
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+static std::vector<Stream> MakeStreams(uint64_t accesses)
+{
+    std::vector<Stream> streams(4);
+    streams[0].name = "fits";
+    streams[1].name = "twice";
+    streams[2].name = "uniform";
+    streams[3].name = "scan";
+    uint64_t x = 88172645463325252ULL;
+    for (uint64_t i = 0; i < accesses; i++) {
+        streams[0].addrs.push_back(Next(x) % (CACHE_SIZE / 2));
+        streams[1].addrs.push_back(Next(x) % (CACHE_SIZE * 2));
+        streams[2].addrs.push_back(Next(x) % (64 << 20));
+        streams[3].addrs.push_back(i * 8 % (16 << 20));
+    }
+    return streams;
+}
+
+template <class POLICY>
+static void Measure(const char *policy, uint32_t associativity, const std::vector<Stream> &streams)
+{
+    for (auto &stream : streams) {
+        CACHE_SETS<POLICY> sets(CACHE_SIZE / (associativity << LINE_SHIFT), associativity);
+        const uint64_t setMask = sets.NumSets() - 1;
+        uint64_t hits = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t addr : stream.addrs) {
+            uint64_t tagaddr = addr >> LINE_SHIFT;
+            uint32_t set = tagaddr & setMask;
+            if (sets.Find(set, tagaddr)) {
+                hits++;
+            }
+            else {
+                sets.Replace(set, tagaddr);
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << policy << " " << associativity << "-way " << stream.name << ": "
+            << stream.addrs.size() / seconds / 1e6 << " M lookups per second, "
+            << hits << " hits" << std::endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t accesses = (argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000);
+    std::vector<Stream> streams = MakeStreams(accesses);
+    std::cout << "tag compare width " << TAG_VECTOR << std::endl;
+    Measure<DIRECT_MAPPED>("direct_mapped", 1, streams);
+    for (uint32_t associativity : {8, 16, 32}) {
+        Measure<ROUND_ROBIN>("round_robin", associativity, streams);
+        Measure<LRU>("lru", associativity, streams);
+        Measure<PLRU>("plru", associativity, streams);
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+// Events per second of the ThreadStats annotation handlers, and the heap
+// allocations they make while BBLs are new and once every BBL has been
+// seen. The second run closes one BBL in 64 with the wrong hash. With a
+// thread count, the last runs take 1, 2, 4 ... up to that many threads,
+// each on its own ThreadStats from a ThreadStatsRegistry.
+//   g++ -std=gnu++14 -O2 -DNDEBUG -I../PIMProfSolver threadStatsEvents.cpp -o threadStatsEvents -pthread
+//   ./threadStatsEvents [iterations] [BBLs] [threads]
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <thread>
+
+#include "Stats.h"
+
+using namespace PIMProf;
+
+static std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations++;
+    void *p = malloc(size);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+// a loop nest: an outer BBL, an offloaded region inside it, and a few of
+// bbls inner BBLs that run for a while and touch memory
+static uint64_t RunEvents(ThreadStats &stats, uint64_t iterations, uint64_t bbls, bool mismatch)
+{
+    uint64_t events = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        uint64_t outer = 1 + i % 8;
+        stats.BBLStart(outer, 0);
+        stats.AddTimeInstruction(1000000, 10);
+        stats.OffloadStart(100 + i % 4, (i & 1) ? PIMPROF_DECISION_PIM : PIMPROF_DECISION_CPU);
+        for (uint64_t j = 0; j < 4; j++) {
+            uint64_t inner = 1000 + (i * 4 + j) % bbls;
+            stats.BBLStart(inner, 0);
+            stats.AddTimeInstruction(2000000, 20);
+            stats.AddMemory(2);
+            stats.BBLEnd((mismatch && (i * 4 + j) % 64 == 0) ? 0 : inner, 0);
+        }
+        stats.OffloadEnd(100 + i % 4, (i & 1) ? PIMPROF_DECISION_PIM : PIMPROF_DECISION_CPU);
+        stats.BBLEnd(outer, 0);
+        events += 6 + 4 * 4;
+    }
+    return events;
+}
+
+static void Measure(const char *name, ThreadStats &stats, uint64_t iterations, uint64_t bbls, bool mismatch)
+{
+    uint64_t before = allocations;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t events = RunEvents(stats, iterations, bbls, mismatch);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cerr << name << ": " << events << " events, " << events / seconds << " events per second, "
+        << allocations - before << " allocations" << std::endl;
+}
+
+// every thread runs iterations on its own ThreadStats
+static void MeasureThreads(int nthreads, uint64_t iterations, uint64_t bbls)
+{
+    ThreadStatsRegistry registry(nthreads);
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t]() {
+            ThreadStats *stats = registry.Register(t);
+            RunEvents(*stats, bbls, bbls, false);
+            ready++;
+            while (!go) std::this_thread::yield();
+            RunEvents(*registry.Local(), iterations, bbls, false);
+        });
+    }
+    while (ready < nthreads) std::this_thread::yield();
+    auto start = std::chrono::steady_clock::now();
+    go = true;
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t events = nthreads * iterations * (6 + 4 * 4);
+    std::cerr << nthreads << " threads: " << events / seconds << " events per second, "
+        << events / seconds / nthreads << " per thread" << std::endl;
+    std::cout.setstate(std::ios::failbit);
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t iterations = (argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000);
+    uint64_t bbls = (argc > 2 ? strtoull(argv[2], NULL, 10) : 4096);
+    int nthreads = (argc > 3 ? atoi(argv[3]) : 0);
+    {
+        ThreadStats stats(0);
+        // every BBL and switch is new here
+        Measure("warm up", stats, bbls, bbls, false);
+        Measure("steady", stats, iterations, bbls, false);
+        std::cout.setstate(std::ios::failbit); // the per-BBL times printed on exit
+    }
+    std::cout.clear();
+    {
+        ThreadStats stats(0);
+        Measure("warm up", stats, bbls, bbls, false);
+        Measure("mismatch", stats, iterations, bbls, true);
+        std::cerr << "mismatches: " << stats.GetMismatchCount() << std::endl;
+        std::cout.setstate(std::ios::failbit);
+    }
+    for (int n = 1; n <= nthreads; n *= 2) {
+        MeasureThreads(n, iterations, bbls);
+    }
+    return 0;
+}